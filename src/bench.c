@@ -0,0 +1,474 @@
+/* The hot paths of the engine are static, the benchmark is built with
+   game.c in the same translation unit to reach them. */
+#include "game.c"
+#include <getopt.h>
+#include "common.h"
+
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+#define DEFAULT_REPS    (11)
+#define REPS_MAX        (101)
+#define WARMUP_NS       (UINT64_C(20000000))
+#define REP_NS          (UINT64_C(10000000))
+#define BENCH_SLOT      (0)
+#define SLOW_TIMER      (UINT32_MAX - STEP_TIME_GRANULARITY)
+
+/* what a benchmark mutates in a game slot, restored before each operation */
+struct slot_copy {
+    uint32_t step_time_cur;
+    uint32_t step_time_next;
+    uint32_t ticking;
+    struct block_state bs;
+    uint16_t rows[BOARD_ROWS];
+    uint64_t rng;
+    struct game_state gs;
+};
+
+struct bench_case {
+    const char *name;
+    void (*setup)(int arg);
+    void (*run)(size_t iters, int arg);
+    int arg;
+    int restores;   /* the slot is restored before each operation, its cost is in the figures */
+};
+
+struct bench_result {
+    size_t iters;
+    double ns_median;
+    double ns_min;
+    double cycles_median;
+    double cycles_min;
+};
+
+/* keeps the results of the operations alive */
+static volatile uintptr_t sink = 0;
+static struct slot_copy saved;
+
+static void print_usage(const char *prog_name);
+static uint64_t cycles(void);
+static void slot_save(size_t i, struct slot_copy *c);
+static void slot_restore(size_t i, const struct slot_copy *c);
+static void measure(const struct bench_case *bc, size_t reps, struct bench_result *r);
+static int write_json(FILE *fp, const struct bench_case *cases, const struct bench_result *results, size_t count, size_t reps, double tsc_per_ns, double restore_ns);
+
+/*! \brief the board of a game in progress: a block in the air above a partly filled floor.
+    \param full_rows    bit r set for each of the 8 bottom rows which is full.
+*/
+static void setup_board(int full_rows)
+{
+    struct block_state bs = { .id = 2, .rot = 0, .x = 3, .y = 4 };
+
+    seed_game(BENCH_SLOT, UINT64_C(0x5EED));
+    init_game(BENCH_SLOT);
+    for(size_t k = 0; k < 8; k++)
+    {
+        size_t r = FIELD_HEIGHT - 1 - k;
+        /* every other row is full but for one cell */
+        uint16_t partial = (k % 2) ? (uint16_t)(ROW_FULL & ~(1u << (k + 1))) : (uint16_t)0x0F3;
+        store.rows[BENCH_SLOT][r] = ROW_WALLS | (((full_rows >> k) & 1) ? ROW_FULL : partial);
+    }
+    store_block(BENCH_SLOT, &bs);
+    /* stay away from level ups, they print and change the pace */
+    store.gs[BENCH_SLOT].togo = UINT32_MAX / 2;
+    render_canvas(BENCH_SLOT);
+    slot_save(BENCH_SLOT, &saved);
+}
+
+static void run_restore(size_t iters, int arg)
+{
+    (void)arg;
+    for(size_t n = 0; n < iters; n++)
+    {
+        slot_restore(BENCH_SLOT, &saved);
+        sink += store.rows[BENCH_SLOT][n % FIELD_HEIGHT];
+    }
+}
+
+static void run_collides(size_t iters, int arg)
+{
+    struct block_state bs = load_block(BENCH_SLOT);
+
+    (void)arg;
+    for(size_t n = 0; n < iters; n++)
+    {
+        bs.x = (uint8_t)(n % (FIELD_WIDTH - 2));
+        bs.y = (uint8_t)(n % FIELD_HEIGHT);
+        sink += collides(BENCH_SLOT, &bs);
+    }
+}
+
+static void run_lock_block(size_t iters, int arg)
+{
+    (void)arg;
+    for(size_t n = 0; n < iters; n++)
+    {
+        slot_restore(BENCH_SLOT, &saved);
+        lock_block(BENCH_SLOT);
+        sink += store.rows[BENCH_SLOT][4];
+    }
+}
+
+static void run_render_canvas(size_t iters, int arg)
+{
+    (void)arg;
+    for(size_t n = 0; n < iters; n++)
+    {
+        render_canvas(BENCH_SLOT);
+        sink += (unsigned char)store.canvas[BENCH_SLOT][n % FIELD_HEIGHT][0];
+    }
+}
+
+static void run_remove_lines(size_t iters, int arg)
+{
+    (void)arg;
+    for(size_t n = 0; n < iters; n++)
+    {
+        slot_restore(BENCH_SLOT, &saved);
+        test_remove_lines(BENCH_SLOT);
+        sink += store.gs[BENCH_SLOT].points;
+    }
+}
+
+static void run_update_state(size_t iters, int arg)
+{
+    for(size_t n = 0; n < iters; n++)
+    {
+        slot_restore(BENCH_SLOT, &saved);
+        struct block_state bs = load_block(BENCH_SLOT);
+        /* arg 0: move one column left, 1: move down into the floor, the block locks */
+        bs.x -= arg == 0;
+        bs.y = arg == 0 ? bs.y : (uint8_t)(FIELD_HEIGHT - 2);
+        sink += (uintptr_t)update_state(BENCH_SLOT, &bs, arg != 0);
+    }
+}
+
+static void run_handle_input(size_t iters, int arg)
+{
+    for(size_t n = 0; n < iters; n++)
+    {
+        slot_restore(BENCH_SLOT, &saved);
+        sink += (uintptr_t)handle_input(BENCH_SLOT, (enum tet_input)arg);
+    }
+}
+
+/*! \brief the board of setup_board(), the gravity timer expires after arg substeps.
+    \param arg  substeps until the block falls, 0 for never.
+*/
+static void setup_substep(int arg)
+{
+    setup_board(0);
+    store.step_time_cur[BENCH_SLOT] = arg == 0 ? SLOW_TIMER : (uint32_t)arg * STEP_TIME_GRANULARITY;
+    slot_save(BENCH_SLOT, &saved);
+}
+
+static void run_substep(size_t iters, int arg)
+{
+    /* the timer runs out after UINT32_MAX / STEP_TIME_GRANULARITY substeps, far more than a run */
+    if(arg == 0)
+    {
+        store.step_time_cur[BENCH_SLOT] = SLOW_TIMER;
+    }
+    for(size_t n = 0; n < iters; n++)
+    {
+        /* a timer which never expires runs without being restored */
+        if(arg != 0)
+        {
+            slot_restore(BENCH_SLOT, &saved);
+        }
+        sink += (uintptr_t)handle_substep(BENCH_SLOT);
+    }
+}
+
+static void setup_substeps(int arg)
+{
+    for(size_t i = 0; i < (size_t)arg; i++)
+    {
+        seed_game(i, i);
+        init_game(i);
+        store.step_time_cur[i] = SLOW_TIMER;
+    }
+}
+
+static void run_substeps(size_t iters, int arg)
+{
+    struct game_state *states[GAME_SLOTS];
+
+    for(size_t i = 0; i < (size_t)arg; i++)
+    {
+        store.step_time_cur[i] = SLOW_TIMER;
+    }
+    for(size_t n = 0; n < iters; n++)
+    {
+        sink += handle_substeps(0, (size_t)arg, states);
+        sink += (uintptr_t)states[0];
+    }
+}
+
+static void run_serialize(size_t iters, int arg)
+{
+    char data[FRAME_SIZE];
+
+    (void)arg;
+    for(size_t n = 0; n < iters; n++)
+    {
+        serialize_data(data, &store.gs[BENCH_SLOT]);
+        sink += (unsigned char)data[n % FRAME_SIZE];
+    }
+}
+
+/* the first case is the cost of slot_restore(), cf. bench_case.restores */
+static const struct bench_case cases[] = {
+    { "slot_restore", setup_board, run_restore, 0, 0 },
+    { "collides", setup_board, run_collides, 0, 0 },
+    { "lock_block", setup_board, run_lock_block, 0, 1 },
+    { "render_canvas", setup_board, run_render_canvas, 0, 0 },
+    { "test_remove_lines/none", setup_board, run_remove_lines, 0x00, 1 },
+    { "test_remove_lines/single", setup_board, run_remove_lines, 0x01, 1 },
+    { "test_remove_lines/double", setup_board, run_remove_lines, 0x03, 1 },
+    { "test_remove_lines/split", setup_board, run_remove_lines, 0x05, 1 },
+    { "test_remove_lines/tetris", setup_board, run_remove_lines, 0x0F, 1 },
+    { "update_state/move", setup_board, run_update_state, 0, 1 },
+    { "update_state/lock", setup_board, run_update_state, 1, 1 },
+    { "handle_input/void", setup_board, run_handle_input, TET_VOID, 1 },
+    { "handle_input/left", setup_board, run_handle_input, TET_LEFT, 1 },
+    { "handle_input/right", setup_board, run_handle_input, TET_RIGHT, 1 },
+    { "handle_input/down", setup_board, run_handle_input, TET_DOWN, 1 },
+    { "handle_input/down_instant", setup_board, run_handle_input, TET_DOWN_INSTANT, 1 },
+    { "handle_input/clock", setup_board, run_handle_input, TET_CLOCK, 1 },
+    { "handle_input/cclock", setup_board, run_handle_input, TET_CCLOCK, 1 },
+    { "handle_input/cheat", setup_board, run_handle_input, TET_CHEAT, 1 },
+    { "handle_input/pause", setup_board, run_handle_input, TET_PAUSE, 1 },
+    { "handle_input/restart", setup_board, run_handle_input, TET_RESTART, 1 },
+    { "handle_input/faster", setup_board, run_handle_input, TET_FASTER, 1 },
+    { "handle_input/slower", setup_board, run_handle_input, TET_SLOWER, 1 },
+    { "handle_substep/tick", setup_substep, run_substep, 0, 0 },
+    { "handle_substep/fall", setup_substep, run_substep, 1, 1 },
+    { "handle_substeps/8_games", setup_substeps, run_substeps, GAME_LANES, 0 },
+    { "serialize_data", setup_board, run_serialize, 0, 0 },
+};
+
+#define NB_CASES (sizeof(cases) / sizeof(cases[0]))
+
+int main(int argc, char *argv[])
+{
+    int c = 0;
+    size_t reps = DEFAULT_REPS;
+    const char *out = NULL;
+    const char *filter = NULL;
+    struct bench_result results[NB_CASES];
+    struct bench_case selected[NB_CASES];
+    struct bench_result restore;
+    size_t count = 0;
+
+    while ( (c = getopt(argc, argv, "ho:r:f:")) != -1 ) {
+        switch ( c ) {
+            case 'o':
+                /* user passed where to write the results */
+                out = optarg;
+                break;
+
+            case 'r':
+                /* user passed the number of repetitions */
+                reps = (size_t)atoi(optarg);
+                if(reps == 0 || reps > REPS_MAX)
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'f':
+                /* user passed which benchmarks to run */
+                filter = optarg;
+                break;
+
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+
+            case '?':
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    pthread_once(&shapes_once, build_shapes);
+    uint64_t c0 = cycles();
+    uint64_t t0 = mono_ns();
+    measure(&cases[0], reps, &restore);
+    for(size_t i = 0; i < NB_CASES; i++)
+    {
+        if(filter != NULL && strstr(cases[i].name, filter) == NULL)
+        {
+            continue;
+        }
+        selected[count] = cases[i];
+        measure(&selected[count], reps, &results[count]);
+        (void)fprintf(stderr, "%-28s %10.2f ns/op %10.1f cycles/op", selected[count].name,
+                results[count].ns_median, results[count].cycles_median);
+        if(selected[count].restores)
+        {
+            (void)fprintf(stderr, " %10.2f ns/op without slot_restore", results[count].ns_median - restore.ns_median);
+        }
+        (void)fprintf(stderr, "\n");
+        count++;
+    }
+    double tsc_per_ns = (double)(cycles() - c0) / (double)(mono_ns() - t0);
+
+    FILE *fp = out != NULL ? fopen(out, "w") : stdout;
+    if(fp == NULL)
+    {
+        perror(out);
+        return 1;
+    }
+    int rc = write_json(fp, selected, results, count, reps, tsc_per_ns, restore.ns_median);
+    if(fp != stdout && fclose(fp) != 0)
+    {
+        perror(out);
+        rc = 1;
+    }
+
+    return rc;
+}
+
+/*! \brief print usage to sterr
+    \param prog_name    program name string
+*/
+static void print_usage(const char *prog_name)
+{
+    (void)fprintf(stderr, "Usage: %s [-o <file>] [-r <reps>] [-f <name>] [-h]\n"
+                    "Options:\n"
+                    "  -o <file>\t\tWrite the results as JSON to a file (default stdout).\n"
+                    "  -r <reps>\t\tTimed repetitions of each benchmark (default %d).\n"
+                    "  -f <name>\t\tOnly run the benchmarks whose name contains this.\n"
+                    "  -h\t\t\tPrint help and exit.\n",
+                    prog_name, DEFAULT_REPS);
+}
+
+/*! \brief read the time stamp counter.
+    \return cycles of the reference clock, 0 where there is no counter.
+*/
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*! \brief copy what the benchmarks mutate in a game slot.
+    \param i        game slot.
+    \param c[out]   copy.
+*/
+static void slot_save(size_t i, struct slot_copy *c)
+{
+    c->step_time_cur = store.step_time_cur[i];
+    c->step_time_next = store.step_time_next[i];
+    c->ticking = store.ticking[i];
+    c->bs = load_block(i);
+    memcpy(c->rows, store.rows[i], sizeof(c->rows));
+    c->rng = store.rng[i];
+    c->gs = store.gs[i];
+}
+
+/*! \brief put a game slot back in the state it was copied in.
+    \param i    game slot.
+    \param c    copy.
+*/
+static void slot_restore(size_t i, const struct slot_copy *c)
+{
+    store.step_time_cur[i] = c->step_time_cur;
+    store.step_time_next[i] = c->step_time_next;
+    store.ticking[i] = c->ticking;
+    store_block(i, &c->bs);
+    memcpy(store.rows[i], c->rows, sizeof(c->rows));
+    store.rng[i] = c->rng;
+    store.gs[i] = c->gs;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*! \brief time a benchmark: warm up while finding how many operations fill a
+    repetition, then keep the median and the best of the repetitions.
+    \param bc       benchmark.
+    \param reps     timed repetitions.
+    \param r[out]   per operation results.
+*/
+static void measure(const struct bench_case *bc, size_t reps, struct bench_result *r)
+{
+    double ns[REPS_MAX];
+    double cyc[REPS_MAX];
+    size_t iters = 1;
+    uint64_t elapsed = 0;
+
+    bc->setup(bc->arg);
+    while(1)
+    {
+        uint64_t t0 = mono_ns();
+        bc->run(iters, bc->arg);
+        elapsed = mono_ns() - t0;
+        if(elapsed >= WARMUP_NS / 4)
+        {
+            break;
+        }
+        iters *= 2;
+    }
+    iters = (size_t)((double)iters * (double)REP_NS / (double)elapsed) + 1;
+    bc->run(iters, bc->arg);
+
+    for(size_t k = 0; k < reps; k++)
+    {
+        uint64_t c0 = cycles();
+        uint64_t t0 = mono_ns();
+        bc->run(iters, bc->arg);
+        uint64_t t1 = mono_ns();
+        uint64_t c1 = cycles();
+        ns[k] = (double)(t1 - t0) / (double)iters;
+        cyc[k] = (double)(c1 - c0) / (double)iters;
+    }
+    qsort(ns, reps, sizeof(ns[0]), compare_double);
+    qsort(cyc, reps, sizeof(cyc[0]), compare_double);
+    r->iters = iters;
+    r->ns_median = ns[reps / 2];
+    r->ns_min = ns[0];
+    r->cycles_median = cyc[reps / 2];
+    r->cycles_min = cyc[0];
+}
+
+/*! \brief write the results as JSON.
+    \param fp           destination.
+    \param cases        benchmarks run.
+    \param results      their results.
+    \param count        number of benchmarks.
+    \param reps         timed repetitions of each.
+    \param tsc_per_ns   rate of the cycle counter.
+    \param restore_ns   median cost of slot_restore(), left out of ns_per_op_net.
+    \return 0 on success, 1 on error.
+*/
+static int write_json(FILE *fp, const struct bench_case *cases, const struct bench_result *results, size_t count, size_t reps, double tsc_per_ns, double restore_ns)
+{
+    (void)fprintf(fp, "{\n  \"revision\": \"%s\",\n  \"compiler\": \"%s\",\n  \"timestamp_ms\": %llu,\n"
+                    "  \"clients_max\": %d,\n  \"reps\": %zu,\n  \"tsc_per_ns\": %.4f,\n  \"slot_restore_ns\": %.3f,\n  \"results\": [\n",
+                    BENCH_REVISION, __VERSION__, (unsigned long long)epoch_ms(), CLIENTS_MAX, reps, tsc_per_ns, restore_ns);
+    for(size_t i = 0; i < count; i++)
+    {
+        /* ns_per_op includes slot_restore() where the benchmark restores the slot, ns_per_op_net does not */
+        (void)fprintf(fp, "    {\"name\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.3f, \"ns_per_op_min\": %.3f, "
+                        "\"ns_per_op_net\": %.3f, \"cycles_per_op\": %.1f, \"cycles_per_op_min\": %.1f}%s\n",
+                        cases[i].name, results[i].iters, results[i].ns_median, results[i].ns_min,
+                        results[i].ns_median - (cases[i].restores ? restore_ns : 0.0),
+                        results[i].cycles_median, results[i].cycles_min, i + 1 < count ? "," : "");
+    }
+    (void)fprintf(fp, "  ]\n}\n");
+
+    return ferror(fp) ? 1 : 0;
+}
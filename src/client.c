@@ -5,10 +5,18 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <poll.h>
 #include <ncurses.h>
 #include <signal.h>
+#include <time.h>
 #include "game.h"
 #include "common.h"
+#include "leaderboard.h"
+#include "hist.h"
+#include "replay.h"
 
 #define BUF_SIZE 255
 #define WIN_POS_X 2
@@ -18,35 +26,185 @@
 #define NB_HIGH_SCORES_SHOWN (10)
 #define SERVER_DEFAULT_PORT "30001"
 #define SERVER_DEFAULT_IP   "127.0.0.1"
-#define CLEAR_SCREEN_TIME   3000
 #define NCURSES_ERR         ((int)0x0FFF1111)
+#define PANEL_LINES         (5)
+#define PANEL_POS_X         ((int)(FIELD_WIDTH + 5))
+#define PANEL_POS_Y         (3)
+#define PREDICT_SLOT        (0)
+#define PENDING_MAX         (256)
+#define PING_INTERVAL_NS    (UINT64_C(1000000000))
+#define LATENCY_POS_Y       (1)
+#define REPLAY_SLOT         (0)
+#define REPLAY_SPEED_MAX    (64u)
+#define REPLAY_SEEK_MS      (10000u)
+#define RESUME_ATTEMPTS     (10u)
+#define RESUME_RETRY_MS     (500)
+
+/* leaderboard lines shown beside the field, filled by server answers */
+struct panel_t {
+    char title[24];
+    uint32_t first_rank;
+    size_t count;
+    struct lb_entry entries[PANEL_LINES];
+};
+
+/* parameters the server opened the session with */
+struct session_t {
+    uint32_t id;
+    uint32_t substep_ms;
+    uint32_t step_time_ms;
+    uint64_t seed;
+    uint64_t token;             /* resumes the session on a new connection */
+};
+
+/* where the session is played, to resume it when the connection drops */
+struct reconnect_t {
+    const char *server_ip;
+    const char *server_port;
+    unsigned int attempts;      /* connections tried since the last frame */
+};
+
+/* local run of the game, server frames are replayed with the inputs they
+   do not acknowledge yet so that keys show up without waiting on the server */
+struct prediction_t {
+    struct game_state *state;   /* game in PREDICT_SLOT, NULL until a server snapshot is loaded */
+    uint32_t sent;              /* game inputs sent */
+    uint32_t acked;             /* game inputs applied by the server */
+    char pending[PENDING_MAX];  /* input n is at n % PENDING_MAX */
+    bool resync;                /* inputs not acknowledged by the next frame were lost with the connection */
+};
+
+/* what the terminal currently shows, only what differs gets drawn */
+struct screen_t {
+    bool valid;
+    char field[FIELD_HEIGHT][FIELD_WIDTH];
+    unsigned int level;
+    unsigned int points;
+    unsigned int togo;
+    int lines;
+    int cols;
+    bool panel_dirty;
+    uint64_t latency[4];    /* shown percentiles, in us */
+};
+
+/* round trip of pings and time from sending an input to the frame acknowledging it */
+struct latency_t {
+    struct hist rtt;
+    struct hist input;
+    uint64_t next_ping;
+};
+
+/* playback of a recorded session, in place of a game */
+struct viewer_t {
+    struct replay replay;
+    bool active;
+    bool playing;
+    unsigned int speed;         /* 1 to REPLAY_SPEED_MAX times the recorded pace */
+    uint32_t position;          /* events applied */
+    uint64_t clock_ns;          /* playback time since the start of the game */
+    struct game_state *state;   /* game in REPLAY_SLOT */
+    char status[80];            /* shown status line */
+};
 
 WINDOW *my_win = NULL;
 struct game_state gs = {0};
-int sock = 0;
+struct panel_t panel = {0};
+struct session_t session = {0};
+struct reconnect_t reconnect = {0};
+struct prediction_t prediction = {0};
+struct latency_t latency = {0};
+struct screen_t screen = {0};
+struct viewer_t viewer = {0};
+int sock = -1;
 
 static void print_usage(const char *prog_name);
-static int init_connection(const char *server_ip, const char *server_port);
+static int init_connection(const char *server_ip, const char *server_port, bool fastopen, const char *hello, size_t hello_len);
+static size_t encode_hello(char data[2 + PLAYER_NAME_LEN], const char *name, unsigned int versus_players);
+static int send_request(int ch);
+static int resume_session(void);
+static void recv_msg_header(enum msg_type *type, uint16_t *len);
+static void recv_scores(char *data, uint16_t len, uint32_t *first_rank, struct lb_entry *entries, size_t *count, size_t max);
+static void panel_draw(void);
+static void hud_draw(void);
+static void latency_draw(void);
+static void screen_init(void);
+static void screen_invalidate(void);
 static int game_session(void);
-static void recv_data(struct game_state *gs);
+static enum msg_type recv_data(struct game_state *gs);
+static int send_key(int ch);
+static void screen_draw(void);
+static void predict_input(char input);
+static void reconcile(const char *data);
+static void show_prediction(const struct game_state *predicted);
+static int send_ping(void);
 static void show_high_scores(void);
 static void finish(int sig);
-WINDOW *field_draw(const char field[FIELD_HEIGHT][FIELD_WIDTH]);
+static int fetch_replay(const char *server_ip, const char *server_port, const char *name, unsigned char **data);
+static int replay_session(void);
+static void viewer_seek(uint32_t position);
+static void viewer_step(void);
+static void viewer_step_back(void);
+static void viewer_key(int ch);
+static void viewer_draw(void);
+WINDOW *field_create(void);
+void field_draw(WINDOW *win, const char field[FIELD_HEIGHT][FIELD_WIDTH]);
 
 int main(int argc, char *argv[])
 {
     char c = 0;
     char *server_ip = SERVER_DEFAULT_IP;
     char *server_port = SERVER_DEFAULT_PORT;
+    char *name = getenv("USER");
+    char hello[2 + PLAYER_NAME_LEN];
+    bool fastopen = false;
     int32_t check_port = 0;
+    const char *replay_file = NULL;
+    const char *replay_name = NULL;
+    unsigned char *replay_data = NULL;
+    unsigned int versus_players = 0;
 
     if (signal(SIGINT, finish) == SIG_ERR) {
         perror(0);
         exit(1);
     }
+    /* a broken connection is resumed, not fatal */
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        perror(0);
+        exit(1);
+    }
 
-    while ( (c = getopt(argc, argv, "hi:p:")) != -1 ) {
+    while ( (c = getopt(argc, argv, "hfi:p:n:v:R:W:")) != -1 ) {
         switch ( c ) {
+            case 'n':
+                /* user passed player name */
+                name = optarg;
+                break;
+
+            case 'v':
+                /* user wants to play in a versus room */
+                versus_players = (unsigned int)atoi(optarg);
+                if(versus_players < 2 || versus_players > UINT8_MAX)
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'R':
+                /* user wants to watch a recording file */
+                replay_file = optarg;
+                break;
+
+            case 'W':
+                /* user wants to watch a recording of the server */
+                replay_name = optarg;
+                break;
+
+            case 'f':
+                /* user wants the hello sent within the connection request */
+                fastopen = true;
+                break;
+
             case 'i':
                 /* user passed server IP */
                 server_ip = optarg;
@@ -76,8 +234,27 @@ int main(int argc, char *argv[])
         }
     }
 
+    if(replay_file != NULL || replay_name != NULL)
+    {
+        int rc = replay_file != NULL ? replay_open(&viewer.replay, replay_file) :
+                fetch_replay(server_ip, server_port, replay_name, &replay_data);
+        if(rc == 0)
+        {
+            rc = replay_session();
+            finish(0);
+        }
+        return rc;
+    }
+
     /* we are ready to start the game */
-    sock = init_connection(server_ip, server_port);
+    size_t hello_len = encode_hello(hello, name != NULL ? name : "player", versus_players);
+    sock = init_connection(server_ip, server_port, fastopen, hello, hello_len);
+    if(sock < 0)
+    {
+        return 1;
+    }
+    reconnect.server_ip = server_ip;
+    reconnect.server_port = server_port;
 
     int rc = game_session();
 
@@ -85,17 +262,99 @@ int main(int argc, char *argv[])
     return rc;
 }
 
+/*! \brief Encode the request opening the session with the player name.
+    \param data[out]        encoded request.
+    \param name             player name, truncated to PLAYER_NAME_LEN - 1 characters.
+    \param versus_players   size of the versus room to play in, 0 for a solo game.
+    \return length of the request.
+*/
+static size_t encode_hello(char data[2 + PLAYER_NAME_LEN], const char *name, unsigned int versus_players)
+{
+    size_t len = 0;
+
+    memset(data, 0, 2 + PLAYER_NAME_LEN);
+    if(versus_players != 0)
+    {
+        data[len++] = (char)REQ_VERSUS;
+        data[len++] = (char)versus_players;
+    }
+    else
+    {
+        data[len++] = (char)REQ_HELLO;
+    }
+    strncpy(data + len, name, PLAYER_NAME_LEN - 1);
+
+    return len + PLAYER_NAME_LEN;
+}
+
+/*! \brief receive the header of the next message from the server.
+    \param type[out]    message type.
+    \param len[out]     payload length.
+*/
+static void recv_msg_header(enum msg_type *type, uint16_t *len)
+{
+    char header[MSG_HEADER_SIZE];
+
+    /* a resumed session starts over with the messages of a new session */
+    while(recv_all(sock, header, sizeof(header)) != 0)
+    {
+        if(resume_session() != 0)
+        {
+            (void)fprintf(stderr, "Connection to server lost\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    *type = (enum msg_type)header[0];
+    *len = get_u16(header + 2);
+}
+
+/*! \brief decode a MSG_HIGH_SCORES or MSG_SCORES_RANGE payload.
+    \param data             payload.
+    \param len              payload length.
+    \param first_rank[out]  rank of the first entry.
+    \param entries[out]     decoded entries.
+    \param count[out]       number of decoded entries.
+    \param max              size of entries.
+*/
+static void recv_scores(char *data, uint16_t len, uint32_t *first_rank, struct lb_entry *entries, size_t *count, size_t max)
+{
+    size_t n = len >= 8 ? get_u32(data + 4) : 0;
+
+    *first_rank = len >= 8 ? get_u32(data) : 0;
+    if(n > (size_t)(len - 8) / LB_ENTRY_WIRE_SIZE)
+    {
+        n = (size_t)(len - 8) / LB_ENTRY_WIRE_SIZE;
+    }
+    *count = n < max ? n : max;
+    for(size_t i = 0; i < *count; i++)
+    {
+        lb_entry_decode(&entries[i], data + 8 + (i * LB_ENTRY_WIRE_SIZE));
+    }
+}
+
 /*! \brief First communication with server, will fetch and show high scores.
+    The session parameters and the first frame follow in the same flight.
 */
 static void show_high_scores(void)
 {
-    char high_score[NB_HIGH_SCORES_SHOWN * 4] = {0};
+    char data[UINT16_MAX];
+    struct lb_entry entries[NB_HIGH_SCORES_SHOWN];
+    enum msg_type type;
+    uint16_t len = 0;
+    uint32_t first_rank = 0;
+    size_t count = 0;
 
-    if(recv(sock, high_score, sizeof(high_score) / sizeof(high_score[0]), 0) < 0)
+    recv_msg_header(&type, &len);
+    if(type != MSG_HIGH_SCORES || recv_all(sock, data, len) != 0)
     {
-        perror("recv()");
+        (void)fprintf(stderr, "Unexpected answer from server\n");
         exit(EXIT_FAILURE);
     }
+    recv_scores(data, len, &first_rank, entries, &count, NB_HIGH_SCORES_SHOWN);
+    while(recv_data(&gs) != MSG_FRAME)
+    {
+        /* the session parameters come before the first frame */
+    }
 
     if(mvprintw(0, 0, "High scores. Beat them ;) !") == ERR)
     {
@@ -103,9 +362,9 @@ static void show_high_scores(void)
         exit(EXIT_FAILURE);
     }
 
-    for(size_t i = 0; i < NB_HIGH_SCORES_SHOWN; i++)
+    for(size_t i = 0; i < count; i++)
     {
-        if(mvprintw(i + 2, 0, "%02d. with a score of %u", i + 1, high_score[i * 4] | high_score[i * 4 + 1] | high_score[i * 4 + 2] | high_score[i * 4 + 3]) == ERR)
+        if(mvprintw(i + 2, 0, "%02zu. %-15s with a score of %u", i + first_rank, entries[i].name, entries[i].score) == ERR)
         {
             perror("mvprintw()");
             exit(EXIT_FAILURE);
@@ -126,20 +385,189 @@ static void show_high_scores(void)
     /* blocking call to wait on user input before starting the game */
     (void)getchar();
 
-    char data = (char)TET_VOID;
-    if(send(sock, &data, 1, 0) < 0)
+    char start = (char)TET_VOID;
+    if(send(sock, &start, 1, 0) < 0)
+    {
+        perror("send()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*! \brief send a leaderboard request for the keys bound to one.
+    \param ch   key pressed.
+    \return 1 if a request has been sent, 0 otherwise.
+*/
+static int send_request(int ch)
+{
+    char data[7] = {0};
+    size_t len = 1;
+
+    switch(ch)
+    {
+        case 'k':
+            /* own rank */
+            data[0] = (char)REQ_RANK;
+            break;
+        case 'a':
+            /* scores around our own one */
+            data[0] = (char)REQ_AROUND;
+            put_u16(data + 1, PANEL_LINES / 2);
+            len = 3;
+            break;
+        case 't':
+            /* best scores */
+            data[0] = (char)REQ_TOP;
+            put_u32(data + 1, 1);
+            put_u16(data + 5, PANEL_LINES);
+            len = 7;
+            break;
+        default:
+            return 0;
+    }
+
+    if(send(sock, data, len, 0) < 0 && resume_session() != 0)
     {
         perror("send()");
         exit(EXIT_FAILURE);
     }
+    return 1;
 }
 
-/*! \brief Initialize the connection to the remote server.
+/*! \brief take the parked session over on a new connection, after the previous one dropped.
+    The server answers like to a hello, with the current state of the game.
+    \return 0 on success, 1 if the session cannot be resumed.
+*/
+static int resume_session(void)
+{
+    char request[13];
+
+    if(session.token == 0 || reconnect.server_ip == NULL)
+    {
+        return 1;
+    }
+    request[0] = (char)REQ_RESUME;
+    put_u32(request + 1, session.id);
+    put_u64(request + 5, session.token);
+    close(sock);
+    sock = -1;
+    while(sock < 0 && reconnect.attempts < RESUME_ATTEMPTS)
+    {
+        /* the server may be unreachable for a while */
+        if(reconnect.attempts++ != 0)
+        {
+            (void)nanosleep(&(struct timespec){ .tv_nsec = RESUME_RETRY_MS * 1000000L }, NULL);
+        }
+        sock = init_connection(reconnect.server_ip, reconnect.server_port, false, request, sizeof(request));
+    }
+    if(sock < 0)
+    {
+        return 1;
+    }
+    prediction.resync = true;
+    screen_invalidate();
+
+    return 0;
+}
+
+/*! \brief draw the leaderboard panel beside the field, when it got new content.
+*/
+static void panel_draw(void)
+{
+    if(!screen.panel_dirty || panel.title[0] == '\0')
+    {
+        return;
+    }
+    (void)mvprintw(PANEL_POS_Y - 1, PANEL_POS_X, "%s", panel.title);
+    clrtoeol();
+    for(size_t i = 0; i < PANEL_LINES; i++)
+    {
+        (void)move(PANEL_POS_Y + i, PANEL_POS_X);
+        clrtoeol();
+        if(i < panel.count)
+        {
+            (void)printw("%3zu %-8.8s %6u", i + panel.first_rank, panel.entries[i].name, panel.entries[i].score);
+        }
+    }
+    screen.panel_dirty = false;
+}
+
+/*! \brief draw the terminal size and the game status, when they changed.
+*/
+static void hud_draw(void)
+{
+    if(!screen.valid || screen.lines != LINES || screen.cols != COLS)
+    {
+        if(mvprintw(0, 0, "lines: %d\tcol: %d!", LINES, COLS) == ERR)
+        {
+            perror("printw()");
+            finish(NCURSES_ERR);
+        }
+        clrtoeol();
+        screen.lines = LINES;
+        screen.cols = COLS;
+    }
+    if(!screen.valid || screen.level != gs.level || screen.points != gs.points || screen.togo != gs.togo)
+    {
+        if(mvprintw(LINES - 2, 0, "Level %d, score is %d, %d lines\n are needed until next level!", gs.level, gs.points, gs.togo) == ERR)
+        {
+            perror("mvprintw()");
+            finish(NCURSES_ERR);
+        }
+        screen.level = gs.level;
+        screen.points = gs.points;
+        screen.togo = gs.togo;
+    }
+}
+
+/*! \brief draw the latency percentiles, when they changed.
+*/
+static void latency_draw(void)
+{
+    uint64_t shown[4] = {
+        hist_percentile(&latency.rtt, 50) / 1000, hist_percentile(&latency.rtt, 99) / 1000,
+        hist_percentile(&latency.input, 50) / 1000, hist_percentile(&latency.input, 99) / 1000,
+    };
+    if(!screen.valid || memcmp(shown, screen.latency, sizeof(shown)) != 0)
+    {
+        if(mvprintw(LATENCY_POS_Y, 0, "rtt %.2f/%.2f ms, input %.2f/%.2f ms (p50/p99)",
+                    shown[0] / 1e3, shown[1] / 1e3, shown[2] / 1e3, shown[3] / 1e3) == ERR)
+        {
+            perror("mvprintw()");
+            finish(NCURSES_ERR);
+        }
+        clrtoeol();
+        memcpy(screen.latency, shown, sizeof(shown));
+    }
+}
+
+/*! \brief forget what the terminal shows and redraw everything, after a resize.
+*/
+static void screen_invalidate(void)
+{
+    if(clear() == ERR)
+    {
+        perror("clear()");
+        exit(EXIT_FAILURE);
+    }
+    screen.valid = false;
+    screen.panel_dirty = true;
+    if(my_win != NULL)
+    {
+        box(my_win, 0, 0);
+        touchwin(my_win);
+    }
+}
+
+/*! \brief Initialize the connection to the remote server and open the session.
     \param server_ip    server IP string formatted.
     \param server_port  server port string formatted.
+    \param fastopen     send the hello within the SYN (TCP Fast Open).
+    \param hello        encoded hello request.
+    \param hello_len    length of the hello request.
+    \return socket, -1 if no address of the server could be connected to.
     \other  inspired by the getaddrinfo manual example.
 */
-static int init_connection(const char *server_ip, const char *server_port)
+static int init_connection(const char *server_ip, const char *server_port, bool fastopen, const char *hello, size_t hello_len)
 {
     struct addrinfo hints;
     struct addrinfo *result, *rp;
@@ -156,7 +584,7 @@ static int init_connection(const char *server_ip, const char *server_port)
     s = getaddrinfo(server_ip, server_port, &hints, &result);
     if (s != 0) {
         (void)fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     /* getaddrinfo() returns a list of address structures.
@@ -172,12 +600,28 @@ static int init_connection(const char *server_ip, const char *server_port)
             continue;
         }
 
-        if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1)
+        /* without a cookie yet the kernel falls back to a regular handshake */
+        if (fastopen && sendto(sfd, hello, hello_len, MSG_FASTOPEN, rp->ai_addr, rp->ai_addrlen) == (ssize_t)hello_len)
         {
-            /* success */
             (void)printf("Connected to server!\n");
             break;
         }
+        if (fastopen && errno != EOPNOTSUPP)
+        {
+            close(sfd);
+            continue;
+        }
+
+        if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1)
+        {
+            /* success */
+            if(send(sfd, hello, hello_len, 0) == (ssize_t)hello_len)
+            {
+                (void)printf("Connected to server!\n");
+                break;
+            }
+            perror("send()");
+        }
 
         close(sfd);
     }
@@ -187,7 +631,13 @@ static int init_connection(const char *server_ip, const char *server_port)
     if (rp == NULL)     /* No address succeeded */
     {
         (void)fprintf(stderr, "Could not connect\n");
-        exit(EXIT_FAILURE);
+        return -1;
+    }
+
+    /* keys are sent one by one, do not hold them back waiting on acknowledgements */
+    if(setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) != 0)
+    {
+        perror("setsockopt(TCP_NODELAY)");
     }
 
     return sfd;
@@ -198,26 +648,23 @@ static int init_connection(const char *server_ip, const char *server_port)
 */
 static void print_usage(const char *prog_name)
 {
-    (void)fprintf(stderr, "Usage: %s [-i <server ip>] [-p <server port>] [-h]\n"
+    (void)fprintf(stderr, "Usage: %s [-i <server ip>] [-p <server port>] [-n <name>] [-v <players>] [-f] [-R <file>] [-W <recording>] [-h]\n"
                     "Options:\n"
                     "  -i <server ip>\t\tIP adresse of the server.\n"
                     "  -p <server port>\t\tServer port in use.\n"
+                    "  -n <name>\t\t\tPlayer name for the leaderboard.\n"
+                    "  -v <players>\t\t\tPlay versus in a room of this many players.\n"
+                    "  -f\t\t\t\tUse TCP Fast Open.\n"
+                    "  -R <file>\t\t\tWatch a recording file.\n"
+                    "  -W <recording>\t\tWatch a recording of the server.\n"
                     "  -h\t\t\t\tPrint help and exit.\n",
                     prog_name);
 }
 
-/*! \brief Start a game session.
-    \return 0 on success 1 on error
+/*! \brief Set the terminal up for the game.
 */
-static int game_session(void)
+static void screen_init(void)
 {
-    char field[FIELD_HEIGHT][FIELD_WIDTH];
-    uint32_t last_handling = time_in_ms();
-    int ch = 0;
-    
-    memset(field, ' ', FIELD_SIZE);
-    gs.field = &field;
-
     initscr();
     if(cbreak() == ERR)
     {
@@ -249,153 +696,627 @@ static int game_session(void)
         perror("refresh()");
         exit(EXIT_FAILURE);
     }
+}
+
+/*! \brief Start a game session.
+    \return 0 on success 1 on error
+*/
+static int game_session(void)
+{
+    char field[FIELD_HEIGHT][FIELD_WIDTH];
+    int ch = 0;
     
+    memset(field, ' ', FIELD_SIZE);
+    gs.field = &field;
 
+    screen_init();
     show_high_scores();
-    if(clear() == ERR)
+    my_win = field_create();
+    screen_invalidate();
+    screen_draw();
+
+    struct pollfd fds[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = sock, .events = POLLIN },
+    };
+    latency.next_ping = mono_ns();
+    while(gs.phase != TET_LOSE && gs.phase != TET_WIN)
     {
-        perror("clear()");
-        exit(EXIT_FAILURE);
+        uint64_t now = mono_ns();
+        if(now >= latency.next_ping)
+        {
+            if(send_ping() != 0 && resume_session() != 0)
+            {
+                perror("send()");
+                exit(EXIT_FAILURE);
+            }
+            latency.next_ping = now + PING_INTERVAL_NS;
+        }
+
+        /* sleep until a key is pressed, the server pushes something or the next ping is due */
+        fds[1].fd = sock;
+        if(poll(fds, 2, (int)((latency.next_ping - now) / 1000000) + 1) < 0 && errno != EINTR)
+        {
+            perror("poll()");
+            exit(EXIT_FAILURE);
+        }
+
+        /* send every key right away, a poll interrupted by a resize is followed by KEY_RESIZE */
+        while((ch = getch()) != ERR)
+        {
+            if(ch == 'q')
+            {
+                return 0;
+            }
+            /* a resize may leave residual text messages, start from a clean screen */
+            if(ch == KEY_RESIZE)
+            {
+                screen_invalidate();
+            }
+            else if(send_request(ch) == 0 && send_key(ch) != 0 && resume_session() != 0)
+            {
+                perror("send()");
+                exit(EXIT_FAILURE);
+            }
+        }
+        /* the connection may have been replaced meanwhile */
+        if(fds[1].revents != 0 && fds[1].fd == sock)
+        {
+            (void)recv_data(&gs);
+        }
+        screen_draw();
     }
 
-	my_win = field_draw((const char (*)[FIELD_WIDTH])gs.field);
+    return 0;
+}
+
+/*! \brief send the game input bound to a key.
+    \param ch   key pressed.
+    \return 0 on success or if no input is bound to the key, 1 on error.
+*/
+static int send_key(int ch)
+{
+    char data[14];
     char user_input = TET_VOID;
 
-    while ((ch = getch()) != 'q')
+    switch(ch)
     {
-        recv_data(&gs);
+        case KEY_UP:
+            user_input = TET_CLOCK;
+            break;
+        case KEY_DOWN:
+            user_input = TET_DOWN;
+            break;
+        case KEY_LEFT:
+            user_input = TET_LEFT;
+            break;
+        case KEY_RIGHT:
+            user_input = TET_RIGHT;
+            break;
+        case 'r':
+            user_input = TET_RESTART;
+            break;
+        case ' ':
+            user_input = TET_DOWN_INSTANT;
+            break;
+        case 'm':
+            user_input = TET_CCLOCK;
+            break;
+        case 'c':
+            user_input = TET_CHEAT;
+            break;
+        case 'p':
+            user_input = TET_PAUSE;
+            break;
+        case 'f':
+            user_input = TET_FASTER;
+            break;
+        case 's':
+            user_input = TET_SLOWER;
+            break;
+        default:
+            return 0;
+    }
+
+    data[0] = (char)REQ_INPUT;
+    data[1] = user_input;
+    put_u32(data + 2, prediction.sent + 1);
+    put_u64(data + 6, mono_ns());
+    if(send(sock, data, sizeof(data), 0) < 0)
+    {
+        return 1;
+    }
+    predict_input(user_input);
+
+    return 0;
+}
+
+/*! \brief send a ping, answered by a MSG_PONG.
+    \return 0 on success, 1 on error.
+*/
+static int send_ping(void)
+{
+    char data[9];
 
-        if(gs.phase == TET_LOSE)
+    data[0] = (char)REQ_PING;
+    put_u64(data + 1, mono_ns());
+
+    return send(sock, data, sizeof(data), 0) < 0 ? 1 : 0;
+}
+
+/*! \brief apply an input sent to the server to the local game right away.
+    \param input    enum tet_input sent.
+*/
+static void predict_input(char input)
+{
+    prediction.sent++;
+    prediction.pending[prediction.sent % PENDING_MAX] = input;
+    /* too many inputs in flight to replay them, wait on the server */
+    if(prediction.state == NULL || prediction.sent - prediction.acked >= PENDING_MAX)
+    {
+        return;
+    }
+    (void)handle_input(PREDICT_SLOT, (enum tet_input)input);
+    show_prediction(prediction.state);
+}
+
+/*! \brief roll the local game back to a server frame and replay the inputs it does not acknowledge.
+    \param data     MSG_FRAME payload of FRAME_MSG_SIZE bytes.
+*/
+static void reconcile(const char *data)
+{
+    uint32_t acked = get_u32(data + FRAME_ACK_OFFSET);
+    uint64_t echo = get_u64(data + FRAME_ECHO_OFFSET);
+
+    /* only the first frame acknowledging an input tells when it got applied */
+    if(acked != prediction.acked && echo != 0)
+    {
+        hist_record(&latency.input, mono_ns() - echo);
+    }
+    prediction.state = load_game(PREDICT_SLOT, (const unsigned char *)data + FRAME_SNAPSHOT_OFFSET);
+    prediction.acked = acked;
+    if(prediction.resync)
+    {
+        /* numbering goes on from the last input the server got */
+        prediction.sent = acked;
+        prediction.resync = false;
+    }
+    if(prediction.state == NULL || prediction.acked == prediction.sent || prediction.sent - prediction.acked >= PENDING_MAX)
+    {
+        return;
+    }
+    for(uint32_t n = prediction.acked + 1; n != prediction.sent + 1; n++)
+    {
+        (void)handle_input(PREDICT_SLOT, (enum tet_input)prediction.pending[n % PENDING_MAX]);
+    }
+    show_prediction(prediction.state);
+}
+
+/*! \brief show the local game, the phase stays the one of the server.
+    \param predicted    state of the local game.
+*/
+static void show_prediction(const struct game_state *predicted)
+{
+    gs.points = predicted->points;
+    gs.level = predicted->level;
+    gs.togo = predicted->togo;
+    memcpy(gs.field, predicted->field, FIELD_SIZE);
+}
+
+/*! \brief bring the terminal up to date with a single update.
+*/
+static void screen_draw(void)
+{
+    hud_draw();
+    if(viewer.active)
+    {
+        viewer_draw();
+    }
+    else
+    {
+        latency_draw();
+    }
+    panel_draw();
+    (void)wnoutrefresh(stdscr);
+    field_draw(my_win, (const char (*)[FIELD_WIDTH])gs.field);
+    screen.valid = true;
+    (void)doupdate();
+}
+
+/*! \brief receive the next message from the server, deserialize frames into gs.
+    \param gs   game status pointer.
+    \return type of the message received.
+*/
+static enum msg_type recv_data(struct game_state *gs)
+{
+    char data[UINT16_MAX];
+    char *ptr = &(*gs->field)[0][0];
+    enum msg_type type;
+    uint16_t len = 0;
+
+    recv_msg_header(&type, &len);
+    if(recv_all(sock, data, len) != 0)
+    {
+        if(resume_session() != 0)
         {
-            break;
+            (void)fprintf(stderr, "Connection to server lost\n");
+            exit(EXIT_FAILURE);
         }
-
-        switch(ch)
+        return recv_data(gs);
+    }
+    if(type != MSG_FRAME || len < FRAME_SIZE)
+    {
+        if(type == MSG_SESSION && len >= SESSION_SIZE)
         {
-            case KEY_UP:
-                user_input = TET_CLOCK;
-                break;
-            case KEY_DOWN:
-                user_input = TET_DOWN;
-                break;
-            case KEY_LEFT:
-                user_input = TET_LEFT;
-                break;
-            case KEY_RIGHT:
-                user_input = TET_RIGHT;
-                break;
-            case 'r':
-                user_input = TET_RESTART;
-                break;
-            case ' ':
-                user_input = TET_DOWN_INSTANT;
-                break;
-            case 'm':
-                user_input = TET_CCLOCK;
-                break;
-            case 'c':
-                user_input = TET_CHEAT;
-                break;
-            case 'p':
-                user_input = TET_PAUSE;
-                break;
-            case 'f':
-                user_input = TET_FASTER;
-                break;
-            case 's':
-                user_input = TET_SLOWER;
-                break;
-            default:
-                user_input = TET_VOID;
-                break;
+            if(get_u16(data + 4) != FIELD_WIDTH || get_u16(data + 6) != FIELD_HEIGHT)
+            {
+                (void)fprintf(stderr, "Server plays on another field size\n");
+                exit(EXIT_FAILURE);
+            }
+            session.id = get_u32(data);
+            session.substep_ms = get_u32(data + 8);
+            /* the predicted game limits its pace like the one of the server */
+            (void)set_step_granularity(session.substep_ms);
+            session.step_time_ms = get_u32(data + 12);
+            session.seed = get_u64(data + 16);
+            session.token = get_u64(data + 24);
+            seed_game(PREDICT_SLOT, session.seed);
         }
+        else if(type == MSG_RANK && len >= 8 + LB_ENTRY_WIRE_SIZE)
+        {
+            panel.first_rank = get_u32(data);
+            panel.count = panel.first_rank != 0 ? 1 : 0;
+            lb_entry_decode(&panel.entries[0], data + 8);
+            (void)snprintf(panel.title, sizeof(panel.title), "Rank of %u", get_u32(data + 4));
+            screen.panel_dirty = true;
+        }
+        else if(type == MSG_PONG && len >= 8)
+        {
+            hist_record(&latency.rtt, mono_ns() - get_u64(data));
+        }
+        else if(type == MSG_SCORES_RANGE)
+        {
+            recv_scores(data, len, &panel.first_rank, panel.entries, &panel.count, PANEL_LINES);
+            (void)snprintf(panel.title, sizeof(panel.title), "Leaderboard");
+            screen.panel_dirty = true;
+        }
+        return type;
+    }
+
+    reconnect.attempts = 0;
+    gs->phase  = (enum tet_phase)data[0];
+    gs->points = get_u32(data + 4);
+    gs->level  = get_u32(data + 8);
+    gs->togo   = get_u32(data + 12);
+
+    for(size_t i = 0; i < FIELD_SIZE; i++)
+    {
+        *ptr = data[i + 16];
+        ptr++;
+    }
+    if(len >= FRAME_MSG_SIZE)
+    {
+        reconcile(data);
+    }
+
+    return type;
+}
+
+/*! \brief download a recording streamed by the server.
+    \param server_ip    server IP string formatted.
+    \param server_port  server port string formatted.
+    \param name         name of the recording on the server.
+    \param data[out]    content of the recording, viewer.replay points into it.
+    \return 0 on success, 1 on error.
+*/
+static int fetch_replay(const char *server_ip, const char *server_port, const char *name, unsigned char **data)
+{
+    char request[1 + REPLAY_NAME_LEN] = {0};
+    char size[8];
+    enum msg_type type;
+    uint16_t len = 0;
+
+    request[0] = (char)REQ_REPLAY;
+    strncpy(request + 1, name, REPLAY_NAME_LEN - 1);
+    sock = init_connection(server_ip, server_port, false, request, sizeof(request));
+    if(sock < 0)
+    {
+        return 1;
+    }
+
+    recv_msg_header(&type, &len);
+    if(type != MSG_REPLAY || len != sizeof(size) || recv_all(sock, size, sizeof(size)) != 0)
+    {
+        (void)fprintf(stderr, "Unexpected answer from server\n");
+        return 1;
+    }
+    uint64_t total = get_u64(size);
+    if(total == 0)
+    {
+        (void)fprintf(stderr, "No recording %s on the server\n", name);
+        return 1;
+    }
+    *data = malloc(total);
+    if(*data == NULL)
+    {
+        perror("malloc()");
+        return 1;
+    }
+    if(recv_all(sock, *data, total) != 0)
+    {
+        (void)fprintf(stderr, "Connection to server lost\n");
+        return 1;
+    }
+    if(replay_from_buffer(&viewer.replay, *data, total) != 0)
+    {
+        (void)fprintf(stderr, "%s is not a recording\n", name);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*! \brief play a recording back, until the user quits.
+    \return 0 on success, 1 on error.
+*/
+static int replay_session(void)
+{
+    char field[FIELD_HEIGHT][FIELD_WIDTH];
+    struct pollfd fds = { .fd = STDIN_FILENO, .events = POLLIN };
+    int ch = 0;
+
+    memset(field, ' ', FIELD_SIZE);
+    gs.field = &field;
+    viewer.speed = 1;
+    viewer.playing = true;
+    viewer.state = replay_seek(&viewer.replay, REPLAY_SLOT, 0);
+    if(viewer.state == NULL)
+    {
+        (void)fprintf(stderr, "The recording is empty\n");
+        return 1;
+    }
+    viewer.active = true;
+    show_prediction(viewer.state);
 
-        if(send(sock, &user_input, 1, 0) < 0)
+    screen_init();
+    my_win = field_create();
+    screen_invalidate();
+
+    uint64_t last = mono_ns();
+    while(1)
+    {
+        uint64_t now = mono_ns();
+        if(viewer.playing)
         {
-            perror("send()");
-            exit(EXIT_FAILURE);
+            viewer.clock_ns += (now - last) * viewer.speed;
         }
+        last = now;
 
-        delwin(my_win);
+        /* apply every event due at the playback time, frames in between are not drawn */
+        while(viewer.playing && viewer.position < viewer.replay.events &&
+                replay_event_time(&viewer.replay, viewer.position) * UINT64_C(1000000) <= viewer.clock_ns)
+        {
+            (void)replay_step(&viewer.replay, REPLAY_SLOT, viewer.position);
+            viewer.position++;
+        }
+        viewer.playing = viewer.playing && viewer.position < viewer.replay.events;
+        show_prediction(viewer.state);
+        screen_draw();
 
-        /* every n seconds, clear the screen completely to remove possible residual text messages (due to reisizes...) */
-        if((time_in_ms() - last_handling) > CLEAR_SCREEN_TIME)
+        /* sleep until a key is pressed or the next event is due */
+        int timeout = -1;
+        if(viewer.playing)
         {
-            clear();
-            last_handling = time_in_ms();
+            uint64_t due = replay_event_time(&viewer.replay, viewer.position) * UINT64_C(1000000);
+            timeout = due > viewer.clock_ns ? (int)((due - viewer.clock_ns) / viewer.speed / 1000000) + 1 : 0;
         }
-        if(mvprintw(0, 0, "lines: %d\tcol: %d!", LINES, COLS) == ERR)
+        if(poll(&fds, 1, timeout) < 0 && errno != EINTR)
         {
-            perror("printw()");
-            finish(NCURSES_ERR);
+            perror("poll()");
+            exit(EXIT_FAILURE);
         }
-        if(mvprintw(LINES - 2, 0, "Level %d, score is %d, %d lines\n are needed until next level!", gs.level, gs.points, gs.togo) == ERR)
+        while((ch = getch()) != ERR)
         {
-            perror("mvprintw()");
-            finish(NCURSES_ERR);
+            if(ch == 'q')
+            {
+                return 0;
+            }
+            if(ch == KEY_RESIZE)
+            {
+                screen_invalidate();
+            }
+            else
+            {
+                viewer_key(ch);
+            }
         }
-        refresh();
-        my_win = field_draw((const char (*)[FIELD_WIDTH])gs.field);
-
-        napms(50);
     }
 
     return 0;
 }
 
-/*! \brief receive data and deserialize it.
-    \param gs   game status pointer.
+/*! \brief handle a key of the viewer.
+    \param ch   key pressed.
 */
-static void recv_data(struct game_state *gs)
+static void viewer_key(int ch)
 {
-    char data[FIELD_SIZE + 16] = {0};
-    char *ptr = &(*gs->field)[0][0];
-    ssize_t n = 0;
+    uint32_t ms = (uint32_t)(viewer.clock_ns / 1000000);
 
-    if((n = recv(sock, data, sizeof(data) / sizeof(data[0]), 0)) < 0)
+    switch(ch)
     {
-        perror("recv()");
-        exit(EXIT_FAILURE);
+        case ' ':
+        case 'p':
+            /* play from the start again once at the end */
+            if(!viewer.playing && viewer.position == viewer.replay.events)
+            {
+                viewer_seek(0);
+            }
+            viewer.playing = !viewer.playing;
+            break;
+        case '+':
+        case 'f':
+            viewer.speed = viewer.speed < REPLAY_SPEED_MAX ? viewer.speed * 2 : viewer.speed;
+            break;
+        case '-':
+        case 's':
+            viewer.speed = viewer.speed > 1 ? viewer.speed / 2 : viewer.speed;
+            break;
+        case KEY_RIGHT:
+            viewer.playing = false;
+            viewer_step();
+            break;
+        case KEY_LEFT:
+            viewer.playing = false;
+            viewer_step_back();
+            break;
+        case KEY_NPAGE:
+        case ']':
+            viewer_seek(replay_find(&viewer.replay, ms + REPLAY_SEEK_MS));
+            /* past the last event the playback time stays on it */
+            if(viewer.position < viewer.replay.events)
+            {
+                viewer.clock_ns = (uint64_t)(ms + REPLAY_SEEK_MS) * 1000000;
+            }
+            break;
+        case KEY_PPAGE:
+        case '[':
+            ms = ms > REPLAY_SEEK_MS ? ms - REPLAY_SEEK_MS : 0;
+            viewer_seek(replay_find(&viewer.replay, ms));
+            viewer.clock_ns = (uint64_t)ms * 1000000;
+            break;
+        case KEY_HOME:
+            viewer_seek(0);
+            break;
+        case KEY_END:
+            viewer_seek(viewer.replay.events);
+            break;
+        default:
+            break;
+    }
+}
+
+/*! \brief jump to a position of the recording, from its nearest keyframe.
+    \param position     number of events applied.
+*/
+static void viewer_seek(uint32_t position)
+{
+    viewer.position = position > viewer.replay.events ? viewer.replay.events : position;
+    viewer.clock_ns = viewer.position > 0 ? replay_event_time(&viewer.replay, viewer.position - 1) * UINT64_C(1000000) : 0;
+    (void)replay_seek(&viewer.replay, REPLAY_SLOT, viewer.position);
+}
+
+/*! \brief go to the next frame, the next event which changes the game.
+*/
+static void viewer_step(void)
+{
+    while(viewer.position < viewer.replay.events)
+    {
+        bool changed = replay_step(&viewer.replay, REPLAY_SLOT, viewer.position) != NULL;
+        viewer.clock_ns = replay_event_time(&viewer.replay, viewer.position) * UINT64_C(1000000);
+        viewer.position++;
+        if(changed)
+        {
+            break;
+        }
     }
+}
 
-    gs->phase  = (enum tet_phase)data[0];
-    gs->points = data[4] | data[5] << 8 | data[6] << 16 | data[7] << 24;
-    gs->level  = data[8] | data[9] << 8 | data[10] << 16 | data[11] << 24;
-    gs->togo   = data[12] | data[13] << 8 | data[14] << 16 | data[15] << 24;
+/*! \brief go back to the previous frame, found by replaying from the keyframes before it.
+*/
+static void viewer_step_back(void)
+{
+    uint32_t target = 0;
+    uint32_t end = viewer.position > 0 ? viewer.position - 1 : 0;
+    uint32_t first = (end / REPLAY_SEGMENT_EVENTS) * REPLAY_SEGMENT_EVENTS;
 
-    for(size_t i = 0; i <= FIELD_SIZE; i++)
+    while(1)
     {
-        *ptr = data[i + 16];
-        ptr++;
+        (void)replay_seek(&viewer.replay, REPLAY_SLOT, first);
+        for(uint32_t event = first; event < end; event++)
+        {
+            if(replay_step(&viewer.replay, REPLAY_SLOT, event) != NULL)
+            {
+                target = event + 1;
+            }
+        }
+        if(target != 0 || first == 0)
+        {
+            break;
+        }
+        /* nothing changed in this segment, look in the previous one */
+        end = first;
+        first -= REPLAY_SEGMENT_EVENTS;
     }
+    viewer_seek(target);
 }
 
-/*! \brief Draw a window with the tetris field.
-    \param  field    actual field status
+/*! \brief draw the playback status in place of the latency, when it changed.
+*/
+static void viewer_draw(void)
+{
+    char status[sizeof(viewer.status)];
+    uint32_t ms = (uint32_t)(viewer.clock_ns / 1000000);
+    uint32_t total = viewer.replay.events > 0 ? replay_event_time(&viewer.replay, viewer.replay.events - 1) : 0;
+
+    (void)snprintf(status, sizeof(status), "%s %u.%us/%u.%us %ux %s", viewer.replay.header.name,
+            ms / 1000, (ms % 1000) / 100, total / 1000, (total % 1000) / 100, viewer.speed,
+            viewer.playing ? "playing" : "paused");
+    if(screen.valid && strcmp(status, viewer.status) == 0)
+    {
+        return;
+    }
+    if(mvprintw(LATENCY_POS_Y, 0, "%s", status) == ERR)
+    {
+        perror("mvprintw()");
+        finish(NCURSES_ERR);
+    }
+    clrtoeol();
+    memcpy(viewer.status, status, sizeof(status));
+}
+
+/*! \brief Create the window holding the tetris field, kept for the whole session.
     \return WINDOW pointer
 */
-WINDOW *field_draw(const char field[FIELD_HEIGHT][FIELD_WIDTH])
+WINDOW *field_create(void)
 {
     WINDOW *local_win = newwin(FIELD_HEIGHT + 2, FIELD_WIDTH + 2, WIN_POS_X, WIN_POS_Y);
+    if(local_win == NULL)
+    {
+        perror("newwin()");
+        exit(EXIT_FAILURE);
+    }
 	box(local_win, 0, 0);
+
+    return local_win;
+}
+
+/*! \brief Draw the cells of the field which changed since the last call.
+    \param  win      window created by field_create()
+    \param  field    actual field status
+*/
+void field_draw(WINDOW *win, const char field[FIELD_HEIGHT][FIELD_WIDTH])
+{
     for(size_t i = 0; i < FIELD_HEIGHT; i++)
     {
         for(size_t j = 0; j < FIELD_WIDTH; j++)
         {
-            if(mvwaddch(local_win, i + 1, j + 1, field[i][j]) == ERR)
+            if(screen.valid && screen.field[i][j] == field[i][j])
+            {
+                continue;
+            }
+            if(mvwaddch(win, i + 1, j + 1, field[i][j]) == ERR)
             {
                 perror("mvwaddch()");
                 exit(EXIT_FAILURE);
             }
+            screen.field[i][j] = field[i][j];
         }
     }
-	if(wrefresh(local_win) == ERR)
+	if(wnoutrefresh(win) == ERR)
     {
-        perror("wrefresh()");
+        perror("wnoutrefresh()");
         exit(EXIT_FAILURE);
     }
-
-    return local_win;
 }
 
 /*! \brief  restore terminal 
@@ -404,17 +1325,24 @@ WINDOW *field_draw(const char field[FIELD_HEIGHT][FIELD_WIDTH])
 static void finish(int sig)
 {
     const char user_input = 'q';
-    if(send(sock, &user_input, 1, 0) < 0)
+    if(sock != -1 && !viewer.active && send(sock, &user_input, 1, 0) < 0)
     {
         perror("send()");
         exit(EXIT_FAILURE);
     }
 
-    close(sock);
+    if(sock != -1)
+    {
+        close(sock);
+    }
 
     delwin(my_win);
     endwin();
 
+    if(viewer.active)
+    {
+        exit(0);
+    }
     (void)printf("You %s with %u points in level %u.\n", gs.phase == TET_WIN ? "won" : "lose", gs.points, gs.level);
     if(sig == NCURSES_ERR)
     {
@@ -2,7 +2,9 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <pthread.h>
-#include <sys/time.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
 #include <stdbool.h>
 #include "game.h"
 #include "common.h"
@@ -10,25 +12,6 @@
 static uint8_t clients_in_use[CLIENTS_MAX] = {0};
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void bubble_sort(uint32_t list[], size_t n)
-{
-    uint32_t c, d, t;
-
-    for (c = 0 ; c < ( n - 1 ); c++)
-    {
-        for (d = 0 ; d < n - c - 1; d++)
-        {
-            if (list[d] < list[d+1])
-            {
-            /* Swapping */
-            t         = list[d];
-            list[d]   = list[d+1];
-            list[d+1] = t;
-            }
-        }
-    }
-}
-
 int get_client_id(void)
 {
     int next_client_id = INVALID_CLIENT_ID;
@@ -75,14 +58,103 @@ void release_client_id(uint32_t client_id)
     }
 }
 
-uint32_t time_in_ms(void)
+uint64_t epoch_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + ((uint64_t)ts.tv_nsec / 1000000);
+}
+
+uint64_t mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t player_id(const char *name)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for(size_t i = 0; i < PLAYER_NAME_LEN && name[i] != '\0'; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash != 0 ? hash : 1;
+}
+
+void clean_player_name(char name[PLAYER_NAME_LEN])
 {
-    struct timeval tv;
-    gettimeofday(&tv,NULL);
-    return (uint32_t)(((long long)tv.tv_sec)*1000)+(tv.tv_usec/1000);
+    name[PLAYER_NAME_LEN - 1] = '\0';
+    for(size_t i = 0; name[i] != '\0'; i++)
+    {
+        if(name[i] <= ' ' || name[i] > '~')
+        {
+            name[i] = '_';
+        }
+    }
+    if(name[0] == '\0')
+    {
+        (void)snprintf(name, PLAYER_NAME_LEN, "anonymous");
+    }
+}
+
+void put_u16(char *buf, uint16_t value)
+{
+    buf[0] = (char)value;
+    buf[1] = (char)(value >> 8);
+}
+
+void put_u32(char *buf, uint32_t value)
+{
+    put_u16(buf, (uint16_t)value);
+    put_u16(buf + 2, (uint16_t)(value >> 16));
+}
+
+void put_u64(char *buf, uint64_t value)
+{
+    put_u32(buf, (uint32_t)value);
+    put_u32(buf + 4, (uint32_t)(value >> 32));
+}
+
+uint16_t get_u16(const char *buf)
+{
+    return (uint16_t)((unsigned char)buf[0] | ((unsigned char)buf[1] << 8));
+}
+
+uint32_t get_u32(const char *buf)
+{
+    return get_u16(buf) | ((uint32_t)get_u16(buf + 2) << 16);
+}
+
+uint64_t get_u64(const char *buf)
+{
+    return get_u32(buf) | ((uint64_t)get_u32(buf + 4) << 32);
+}
+
+void put_msg_header(char buf[MSG_HEADER_SIZE], enum msg_type type, uint16_t len)
+{
+    buf[0] = (char)type;
+    buf[1] = 0;
+    put_u16(buf + 2, len);
+}
+
+int recv_all(int sock, void *buf, size_t len)
+{
+    ssize_t n = recv(sock, buf, len, MSG_WAITALL);
+
+    if(n < 0)
+    {
+        perror("recv()");
+        return 1;
+    }
+
+    return (size_t)n == len ? 0 : 1;
 }
 
-void serialize_data(char data[FIELD_SIZE + 16], struct game_state *gs)
+void serialize_data(char data[FRAME_SIZE], struct game_state *gs)
 {
     char *ptr = &(*gs->field)[0][0];
 
@@ -106,7 +178,7 @@ void serialize_data(char data[FIELD_SIZE + 16], struct game_state *gs)
     data[14] = (char)(gs->togo >> 16);
     data[15] = (char)(gs->togo >> 24);
 
-    for(size_t i = 0; i <= FIELD_SIZE; i++)
+    for(size_t i = 0; i < FIELD_SIZE; i++)
     {
         data[i + 16] = *ptr;
         ptr++;
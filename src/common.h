@@ -2,16 +2,61 @@
 #define _COMMON_H_
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include "game.h"
 
 #define INVALID_CLIENT_ID (-1)
 
-/*  \brief bubble sorting, biggest elements will be put first in array.
-    \param  list    array to sort.
-    \param  n       size of the array.
-    \remark from: http://www.programmingsimplified.com/c/source-code/c-program-bubble-sort
-*/
-void bubble_sort(uint32_t list[], size_t n);
+/* Longest player name, including the terminating zero */
+#define PLAYER_NAME_LEN (16)
+
+/* Every message from the server starts with a header holding its type,
+   flags and the length of the payload which follows (little endian). */
+#define MSG_HEADER_SIZE (4)
+#define FRAME_SIZE (FIELD_SIZE + 16)
+/* MSG_FRAME payload: the rendered frame (FRAME_SIZE), u32 sequence number
+   of the last game input applied, u64 timestamp the client sent with that
+   input (0 if none) and the game snapshot (GAME_SNAPSHOT_SIZE), cf. save_game(). */
+#define FRAME_ACK_OFFSET (FRAME_SIZE)
+#define FRAME_ECHO_OFFSET (FRAME_SIZE + 4)
+#define FRAME_SNAPSHOT_OFFSET (FRAME_SIZE + 12)
+#define FRAME_MSG_SIZE (FRAME_SNAPSHOT_OFFSET + GAME_SNAPSHOT_SIZE)
+
+enum msg_type {
+    MSG_HIGH_SCORES = 1,    /* best scores, same layout as MSG_SCORES_RANGE */
+    MSG_FRAME = 2,          /* game state, cf. FRAME_MSG_SIZE */
+    MSG_RANK = 3,           /* u32 rank (0: unranked), u32 entries, one entry */
+    MSG_SCORES_RANGE = 4,   /* u32 rank of the first entry, u32 count, entries */
+    MSG_SESSION = 5,        /* session parameters, cf. SESSION_SIZE */
+    MSG_PONG = 6,           /* u64 timestamp of the REQ_PING answered */
+    MSG_REPLAY = 7,         /* u64 size of the recording (0: not found), its content follows */
+};
+
+/* MSG_SESSION payload: u32 session id, u16 field width, u16 field height,
+   u32 substep interval in ms, u32 initial step time in ms, u64 seed of
+   the block generator of the game (cf. seed_game()), u64 reconnect token.
+   A session opens with MSG_HIGH_SCORES, MSG_SESSION and the first
+   MSG_FRAME sent in one flight as answer to REQ_HELLO, and resumes with
+   the same flight, its frame the current state, as answer to REQ_RESUME. */
+#define SESSION_SIZE (32)
+
+/* Bytes sent by the client are either an enum tet_input value or one of
+   these requests, followed by their payload. Game inputs sent as a
+   single byte are numbered implicitly from 1 in the order they are sent,
+   REQ_INPUT numbers them explicitly. Timestamps are the client's
+   monotonic clock in ns, the server only echoes them. */
+enum req_type {
+    REQ_HELLO = 0x80,       /* PLAYER_NAME_LEN bytes of player name, first request of a session */
+    REQ_RANK = 0x81,        /* rank of the session's player */
+    REQ_AROUND = 0x82,      /* u16 radius: scores around the session's player */
+    REQ_TOP = 0x83,         /* u32 first rank, u16 count: range of best scores */
+    REQ_INPUT = 0x84,       /* u8 enum tet_input, u32 sequence number, u64 timestamp */
+    REQ_PING = 0x85,        /* u64 timestamp, answered by MSG_PONG */
+    REQ_REPLAY = 0x86,      /* REPLAY_NAME_LEN bytes of recording name, instead of REQ_HELLO */
+    REQ_VERSUS = 0x87,      /* u8 players, then like REQ_HELLO: opens a session in a versus room */
+    REQ_RESUME = 0x88,      /* u32 session id, u64 reconnect token, instead of REQ_HELLO: takes a parked session over */
+};
 
 /*! \brief Get an available client session.
     \return     client id or error
@@ -23,15 +68,57 @@ int get_client_id(void);
 */
 void release_client_id(uint32_t client_id);
 
-/*! \brief Get the actual time and convert it into milliseconds.
-    \return The actual time in ms.
+/*! \brief Get the wall clock time.
+    \return milliseconds since the epoch.
+*/
+uint64_t epoch_ms(void);
+
+/*! \brief Get the monotonic time.
+    \return nanoseconds since an arbitrary point, never goes backwards.
+*/
+uint64_t mono_ns(void);
+
+/*! \brief Derive the player id from a player name (FNV-1a).
+    \param name     zero terminated player name.
+    \return player id, never 0.
+*/
+uint64_t player_id(const char *name);
+
+/*! \brief Clean a player name up the way the server stores it: cut to
+    PLAYER_NAME_LEN - 1 characters, spaces and non printable characters
+    replaced by '_', "anonymous" if empty.
+    \param name[in,out]    PLAYER_NAME_LEN bytes of player name.
+*/
+void clean_player_name(char name[PLAYER_NAME_LEN]);
+
+/*! \brief little endian encoding helpers.
+*/
+void put_u16(char *buf, uint16_t value);
+void put_u32(char *buf, uint32_t value);
+void put_u64(char *buf, uint64_t value);
+uint16_t get_u16(const char *buf);
+uint32_t get_u32(const char *buf);
+uint64_t get_u64(const char *buf);
+
+/*! \brief write a message header.
+    \param buf[out]     MSG_HEADER_SIZE bytes.
+    \param type         enum msg_type.
+    \param len          payload length.
+*/
+void put_msg_header(char buf[MSG_HEADER_SIZE], enum msg_type type, uint16_t len);
+
+/*! \brief receive exactly len bytes.
+    \param sock     socket to read from.
+    \param buf      destination.
+    \param len      bytes to read.
+    \return 0 on success, 1 on error or closed connection.
 */
-uint32_t time_in_ms(void);
+int recv_all(int sock, void *buf, size_t len);
 
 /*! \brief serialize data to send it through a socket.
     \param data[out]    serialized data array.
     \param gs[in]       game structure to serialize.
 */
-void serialize_data(char data[FIELD_SIZE + 16], struct game_state *gs);
+void serialize_data(char data[FRAME_SIZE], struct game_state *gs);
 
 #endif
\ No newline at end of file
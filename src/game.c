@@ -1,9 +1,30 @@
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include "game.h"
 
+/* Number of games advanced together by one vector operation. */
+#define GAME_LANES (8u)
+/* Game slots of the store, padded to a whole number of vectors. */
+#define GAME_SLOTS ((CLIENTS_MAX + GAME_LANES - 1) / GAME_LANES * GAME_LANES)
+#define CACHE_LINE (64)
+
+/* Bitboard rows per game: the field, a floor of FLOOR_ROWS solid rows
+ * (so that collision tests never need a bounds check) and padding up to
+ * one cache line. Bit j of a row is column j, bits past FIELD_WIDTH are
+ * set and act as the right wall. */
+#define BOARD_ROWS (32u)
+#define FLOOR_ROWS (4u)
+#define ROW_FULL ((uint16_t)((1u << FIELD_WIDTH) - 1u))
+#define ROW_WALLS ((uint16_t)~ROW_FULL)
+#define ROW_BITS (16u)
+
+typedef uint32_t u32_lanes __attribute__((vector_size(GAME_LANES * sizeof(uint32_t))));
+typedef uint64_t u64_lanes __attribute__((vector_size(GAME_LANES * sizeof(uint64_t))));
+
 struct block {
     char *name;
     size_t cols;
@@ -11,23 +32,45 @@ struct block {
     char *m;
 };
 
+/* A block in one of its four rotations, as up to four bitboard rows
+ * (row 0 in the lowest 16 bits) aligned to column 0. */
+struct block_shape {
+    uint64_t mask;
+    uint8_t width;
+    uint8_t height;
+};
+
 struct block_state {
-    struct block cur_block;
-    signed int block_rot;
-    size_t block_x;
-    size_t block_y;
+    uint8_t id;
+    uint8_t rot;
+    uint8_t x;
+    uint8_t y;
 };
 
-struct game_state_int {
-    struct game_state gs;
-    unsigned int step_time_cur;
-    unsigned int step_time_next;
-    struct block_state block_state;
-    char field[FIELD_HEIGHT][FIELD_WIDTH];
-    char canvas[FIELD_HEIGHT][FIELD_WIDTH];
+/* Structure-of-arrays store for all games. The arrays touched by every
+ * gravity tick (timers, piece positions, bitboards) are kept apart from
+ * the data that is only read when a state is handed out to a caller. */
+struct game_store {
+    uint32_t step_time_cur[GAME_SLOTS] __attribute__((aligned(CACHE_LINE)));
+    uint32_t step_time_next[GAME_SLOTS] __attribute__((aligned(CACHE_LINE)));
+    /* All bits set while the game is in progress, zero otherwise. */
+    uint32_t ticking[GAME_SLOTS] __attribute__((aligned(CACHE_LINE)));
+    uint8_t block_id[GAME_SLOTS] __attribute__((aligned(CACHE_LINE)));
+    uint8_t block_rot[GAME_SLOTS];
+    uint8_t block_x[GAME_SLOTS];
+    uint8_t block_y[GAME_SLOTS];
+    uint16_t rows[GAME_SLOTS][BOARD_ROWS] __attribute__((aligned(CACHE_LINE)));
+
+    /* Cold data */
+    uint64_t rng[GAME_SLOTS] __attribute__((aligned(CACHE_LINE)));
+    /* Garbage earned by line clears, not part of the game state, cf. take_garbage() */
+    unsigned int garbage[GAME_SLOTS];
+    struct game_state gs[GAME_SLOTS];
+    char canvas[GAME_SLOTS][FIELD_HEIGHT][FIELD_WIDTH];
 };
 
-static struct game_state_int gstates[CLIENTS_MAX] = {0};
+static struct game_store store;
+static uint32_t granularity = STEP_TIME_GRANULARITY;
 
 static const struct block blocks[] = {
     {
@@ -90,238 +133,382 @@ static const struct block blocks[] = {
         },
     },
 };
-static const size_t num_blocks = sizeof(blocks)/sizeof(struct block);
+#define NUM_BLOCKS (sizeof(blocks)/sizeof(struct block))
 
-static void clear_field(char field[FIELD_HEIGHT][FIELD_WIDTH]) {
-    memset(field, ' ', FIELD_SIZE);
-}
+static struct block_shape shapes[NUM_BLOCKS][4];
+static pthread_once_t shapes_once = PTHREAD_ONCE_INIT;
 
-static bool draw_block(struct game_state_int *gsi, const struct block_state *new_bs, char tmpfield[FIELD_HEIGHT][FIELD_WIDTH]) {
-    const struct block *block = &new_bs->cur_block;
+/* Precompute the bitboard masks of every block and rotation. */
+static void build_shapes(void) {
+    for (size_t b = 0; b < NUM_BLOCKS; b++) {
+        const struct block *block = &blocks[b];
+        for (unsigned int rot = 0; rot < 4; rot++) {
+            size_t cur_height = rot % 2 ? block->cols : block->rows;
+            size_t cur_width  = rot % 2 ? block->rows : block->cols;
+            uint64_t mask = 0;
 
-    size_t cur_height = new_bs->block_rot % 2 ? block->cols : block->rows;
-    /* Avoid falling through the floor */
-    if (new_bs->block_y+cur_height > FIELD_HEIGHT) {
-        return 1;
-    }
-
-    size_t cur_width  = new_bs->block_rot % 2 ? block->rows : block->cols;
-
-    for (size_t cur_row = 0; cur_row < cur_height; cur_row++) {
-        for (size_t cur_col = 0; cur_col < cur_width; cur_col++) {
-            size_t src_col;
-            size_t src_row;
-            switch (new_bs->block_rot) {
-                case 0:
-                    src_col = cur_col;
-                    src_row = cur_row;
-                    break;
-                case 2:
-                    src_col = block->cols - 1 - cur_col;
-                    src_row = block->rows - 1 - cur_row;
-                    break;
-                case 3:
-                    src_col = block->cols - 1 - cur_row;
-                    src_row = cur_col;
-                    break;
-                case 1:
-                    src_col = cur_row;
-                    src_row = block->rows - 1 - cur_col;
-                    break;
-                default:
-                    fprintf(stderr, "Unknown block rotation: %d\n", new_bs->block_rot);
-                    exit(EXIT_FAILURE);
+            for (size_t cur_row = 0; cur_row < cur_height; cur_row++) {
+                for (size_t cur_col = 0; cur_col < cur_width; cur_col++) {
+                    size_t src_col;
+                    size_t src_row;
+                    switch (rot) {
+                        case 0:
+                            src_col = cur_col;
+                            src_row = cur_row;
+                            break;
+                        case 2:
+                            src_col = block->cols - 1 - cur_col;
+                            src_row = block->rows - 1 - cur_row;
+                            break;
+                        case 3:
+                            src_col = block->cols - 1 - cur_row;
+                            src_row = cur_col;
+                            break;
+                        default:
+                            src_col = cur_row;
+                            src_row = block->rows - 1 - cur_col;
+                            break;
+                    }
+                    /* Ignore "empty" block pixels */
+                    if (*(block->m + src_row * block->cols + src_col) != ' ')
+                        mask |= UINT64_C(1) << (cur_row * ROW_BITS + cur_col);
+                }
             }
-            char c = *(block->m + src_row * block->cols + src_col);
-            /* Ignore "empty" block pixels */
-            if (c == ' ')
-                continue;
-
-            /* Detect collision with existing blocks */
-            if (gsi->field[new_bs->block_y+cur_row][new_bs->block_x+cur_col] != ' ')
-                return 1;
-
-            /* Render onto field if requested */
-            if (tmpfield != NULL)
-                tmpfield[new_bs->block_y+cur_row][new_bs->block_x+cur_col] = c;
+            shapes[b][rot].mask = mask;
+            shapes[b][rot].width = (uint8_t)cur_width;
+            shapes[b][rot].height = (uint8_t)cur_height;
         }
     }
-    return 0;
 }
 
-static void change_step_time (struct game_state_int *gsi, float factor) {
-    gsi->step_time_next *= factor;
-    if (gsi->step_time_next < STEP_TIME_GRANULARITY)
-        gsi->step_time_next = STEP_TIME_GRANULARITY;
-    else if (gsi->step_time_next > 2000)
-        gsi->step_time_next = 2000;
+static void set_phase(size_t i, enum tet_phase phase) {
+    store.gs[i].phase = phase;
+    store.ticking[i] = phase == TET_IN_PROG ? UINT32_MAX : 0;
+}
+
+static struct block_state load_block(size_t i) {
+    struct block_state bs = {
+        .id = store.block_id[i],
+        .rot = store.block_rot[i],
+        .x = store.block_x[i],
+        .y = store.block_y[i],
+    };
+    return bs;
+}
+
+static void store_block(size_t i, const struct block_state *bs) {
+    store.block_id[i] = bs->id;
+    store.block_rot[i] = bs->rot;
+    store.block_x[i] = bs->x;
+    store.block_y[i] = bs->y;
+}
+
+static uint64_t piece_mask(const struct block_state *bs) {
+    return shapes[bs->id][bs->rot].mask << bs->x;
+}
+
+/* Four consecutive bitboard rows starting at row y, packed like a block mask. */
+static uint64_t board_window(size_t i, size_t y) {
+    const uint16_t *r = &store.rows[i][y];
+    return (uint64_t)r[0] | (uint64_t)r[1] << 16 | (uint64_t)r[2] << 32 | (uint64_t)r[3] << 48;
+}
+
+/* Detect collision with existing blocks, the walls and the floor */
+static bool collides(size_t i, const struct block_state *bs) {
+    return (board_window(i, bs->y) & piece_mask(bs)) != 0;
+}
+
+static void clear_board(size_t i) {
+    for (size_t r = 0; r < BOARD_ROWS; r++)
+        store.rows[i][r] = r < FIELD_HEIGHT ? ROW_WALLS : UINT16_MAX;
+}
+
+/* Make the current block permanent by merging it into the bitboard. */
+static void lock_block(size_t i) {
+    struct block_state bs = load_block(i);
+    uint64_t mask = piece_mask(&bs);
+    for (size_t k = 0; k < 4 && bs.y + k < FIELD_HEIGHT; k++)
+        store.rows[i][bs.y + k] |= (uint16_t)(mask >> (k * ROW_BITS));
+}
+
+/* Expand the bitboard and the current block into the character canvas
+ * handed out through struct game_state. */
+static void render_canvas(size_t i) {
+    uint16_t rows[FIELD_HEIGHT];
+    struct block_state bs = load_block(i);
+    uint64_t mask = piece_mask(&bs);
+
+    memcpy(rows, store.rows[i], sizeof(rows));
+    for (size_t k = 0; k < 4 && bs.y + k < FIELD_HEIGHT; k++)
+        rows[bs.y + k] |= (uint16_t)(mask >> (k * ROW_BITS));
+    for (size_t r = 0; r < FIELD_HEIGHT; r++) {
+        for (size_t c = 0; c < FIELD_WIDTH; c++)
+            store.canvas[i][r][c] = (rows[r] >> c) & 1u ? '#' : ' ';
+    }
+}
+
+static void change_step_time (size_t i, float factor) {
+    store.step_time_next[i] *= factor;
+    if (store.step_time_next[i] < granularity)
+        store.step_time_next[i] = granularity;
+    else if (store.step_time_next[i] > 2000)
+        store.step_time_next[i] = 2000;
+}
+
+/* Block generator of game i (splitmix64), independent of the other games. */
+static uint32_t next_random(size_t i) {
+    uint64_t z = (store.rng[i] += UINT64_C(0x9E3779B97F4A7C15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return (uint32_t)((z ^ (z >> 31)) >> 32);
 }
 
-static int new_block(struct game_state_int *gsi) {
-    gsi->block_state.cur_block = blocks[rand() % num_blocks];
+static int new_block(size_t i) {
+    struct block_state bs;
+    bs.id = next_random(i) % NUM_BLOCKS;
     /* TODO: more advanced random generator, cf.
      * https://harddrop.com/wiki/Random_Generator
      * https://harddrop.com/wiki/Tetris_(Game_Boy)#Randomizer */
     /* Confine spawns within field widths */
-    gsi->block_state.block_x = rand() % (FIELD_WIDTH - gsi->block_state.cur_block.cols);
-    gsi->block_state.block_y = 0;
-    gsi->block_state.block_rot = 0;
-    return draw_block(gsi, &gsi->block_state, gsi->canvas);
+    bs.x = next_random(i) % (FIELD_WIDTH - blocks[bs.id].cols);
+    bs.y = 0;
+    bs.rot = 0;
+    store_block(i, &bs);
+    return collides(i, &bs);
 }
 
 void init_game (size_t i) {
-    gstates[i].step_time_cur = STEP_TIME_INIT;
-    gstates[i].step_time_next = STEP_TIME_INIT;
-    clear_field(gstates[i].field);
-    memcpy(gstates[i].canvas, gstates[i].field, FIELD_SIZE);
-    new_block(&gstates[i]);
-    gstates[i].gs.phase = TET_IN_PROG;
-    gstates[i].gs.points = 0;
-    gstates[i].gs.level = 1;
-    gstates[i].gs.togo = INIT_LINES_PER_LEVEL;
-    gstates[i].gs.field = &gstates[i].field;
-}
-
-static void test_remove_lines(struct game_state_int *gsi) {
+    pthread_once(&shapes_once, build_shapes);
+    store.step_time_cur[i] = STEP_TIME_INIT;
+    store.step_time_next[i] = STEP_TIME_INIT;
+    store.garbage[i] = 0;
+    clear_board(i);
+    new_block(i);
+    set_phase(i, TET_IN_PROG);
+    store.gs[i].points = 0;
+    store.gs[i].level = 1;
+    store.gs[i].togo = INIT_LINES_PER_LEVEL;
+    store.gs[i].lines = 0;
+    store.gs[i].field = &store.canvas[i];
+    render_canvas(i);
+}
+
+int set_step_granularity(uint32_t ms) {
+    if (ms < STEP_TIME_GRANULARITY_MIN || ms > STEP_TIME_INIT)
+        return 1;
+    granularity = ms;
+    return 0;
+}
+
+uint32_t step_granularity(void) {
+    return granularity;
+}
+
+void seed_game(size_t i, uint64_t seed) {
+    store.rng[i] = seed;
+}
+
+static unsigned char *put_le(unsigned char *p, uint64_t value, size_t bytes) {
+    for (size_t k = 0; k < bytes; k++)
+        *p++ = (unsigned char)(value >> (8 * k));
+    return p;
+}
+
+static uint64_t get_le(const unsigned char **p, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t k = 0; k < bytes; k++)
+        value |= (uint64_t)(*p)[k] << (8 * k);
+    *p += bytes;
+    return value;
+}
+
+/* Layout: phase, block id, rotation, x, y (1 byte each), the locked
+ * rows of the field (2 bytes each), current and next step time, block
+ * generator state, points, level, lines to go and lines cleared. */
+void save_game(size_t i, unsigned char snapshot[GAME_SNAPSHOT_SIZE]) {
+    const struct game_state *gs = &store.gs[i];
+    unsigned char *p = snapshot;
+
+    p = put_le(p, (uint8_t)(int8_t)gs->phase, 1);
+    p = put_le(p, store.block_id[i], 1);
+    p = put_le(p, store.block_rot[i], 1);
+    p = put_le(p, store.block_x[i], 1);
+    p = put_le(p, store.block_y[i], 1);
+    for (size_t r = 0; r < FIELD_HEIGHT; r++)
+        p = put_le(p, store.rows[i][r] & ROW_FULL, 2);
+    p = put_le(p, store.step_time_cur[i], 4);
+    p = put_le(p, store.step_time_next[i], 4);
+    p = put_le(p, store.rng[i], 8);
+    p = put_le(p, gs->points, 4);
+    p = put_le(p, gs->level, 4);
+    p = put_le(p, gs->togo, 4);
+    (void)put_le(p, gs->lines, 4);
+}
+
+struct game_state *load_game(size_t i, const unsigned char snapshot[GAME_SNAPSHOT_SIZE]) {
+    const unsigned char *p = snapshot;
+    enum tet_phase phase = (enum tet_phase)(int8_t)get_le(&p, 1);
+    struct block_state bs;
+
+    pthread_once(&shapes_once, build_shapes);
+    bs.id = (uint8_t)get_le(&p, 1);
+    bs.rot = (uint8_t)get_le(&p, 1);
+    bs.x = (uint8_t)get_le(&p, 1);
+    bs.y = (uint8_t)get_le(&p, 1);
+    if (phase < TET_LOSE || phase > TET_IN_PROG || bs.id >= NUM_BLOCKS || bs.rot >= 4 ||
+            bs.x >= FIELD_WIDTH || bs.y >= FIELD_HEIGHT)
+        return NULL;
+
+    clear_board(i);
+    for (size_t r = 0; r < FIELD_HEIGHT; r++)
+        store.rows[i][r] |= (uint16_t)get_le(&p, 2);
+    store_block(i, &bs);
+    set_phase(i, phase);
+    store.step_time_cur[i] = (uint32_t)get_le(&p, 4);
+    store.step_time_next[i] = (uint32_t)get_le(&p, 4);
+    store.rng[i] = get_le(&p, 8);
+    store.gs[i].points = (unsigned int)get_le(&p, 4);
+    store.gs[i].level = (unsigned int)get_le(&p, 4);
+    store.gs[i].togo = (unsigned int)get_le(&p, 4);
+    store.gs[i].lines = (unsigned int)get_le(&p, 4);
+    store.gs[i].field = &store.canvas[i];
+    render_canvas(i);
+    return &store.gs[i];
+}
+
+static const unsigned int garbage_per_clear[] = GARBAGE_PER_CLEAR;
+
+static void test_remove_lines(size_t i) {
+    uint16_t *rows = store.rows[i];
+    struct game_state *gs = &store.gs[i];
     ssize_t lines[4] = { -1, -1, -1, -1 };
     size_t idx = 0;
     unsigned int lines_cleared = 0;
     /* Look for full lines and save their index in lines. */
-    for (ssize_t i = FIELD_HEIGHT - 1; i >= 0; i--) {
-        bool is_line_full = true;
-        for (size_t j = 0; j < FIELD_WIDTH; j++) {
-            if (gsi->field[i][j] == ' ') {
-                is_line_full = false;
-                break;
-            }
-        }
-        if (is_line_full) {
+    for (ssize_t r = FIELD_HEIGHT - 1; r >= 0 && idx < 4; r--) {
+        if ((rows[r] & ROW_FULL) == ROW_FULL) {
             lines_cleared++;
-            lines[idx++] = i;
+            lines[idx++] = r;
         }
     }
 
     /* Move field above cleared lines down, starting from the top, and
      * count consecutive lines. */
     unsigned int max_consecutive_lines_cleared = 0;
-    for (ssize_t i = idx - 1; i >= 0; i--) {
-        if (lines[i] < 0)
+    for (ssize_t l = idx - 1; l >= 0; l--) {
+        if (lines[l] < 0)
             break;
 
-        memmove(gsi->field[1], gsi->field[0], FIELD_WIDTH * lines[i]);
+        memmove(&rows[1], &rows[0], sizeof(rows[0]) * lines[l]);
         /* Test if the next found line matches the directly adjacent line (lower field index). */
-        if (i < 3 && lines[i+1] == (lines[i]-1))
+        if (l < 3 && lines[l+1] == (lines[l]-1))
             max_consecutive_lines_cleared++;
     }
     if (lines_cleared > 0) {
-        /* Overwrite lines that have been moved down with spaces. */
-        memset(gsi->field[0], ' ', FIELD_WIDTH * lines_cleared);
+        /* Overwrite lines that have been moved down with empty rows. */
+        for (size_t r = 0; r < lines_cleared; r++)
+            rows[r] = ROW_WALLS;
         max_consecutive_lines_cleared++;
         unsigned int cur_points  = (1 << (max_consecutive_lines_cleared-1)) + lines_cleared;
-        gsi->gs.points += cur_points * gsi->gs.level;
+        gs->points += cur_points * gs->level;
+        gs->lines += lines_cleared;
+        store.garbage[i] += garbage_per_clear[lines_cleared];
 
-        if (gsi->gs.togo <= lines_cleared) {
+        if (gs->togo <= lines_cleared) {
             /* Level up */
-            if (gsi->gs.level >= MAX_LEVEL) {
-                gsi->gs.phase = TET_WIN;
+            if (gs->level >= MAX_LEVEL) {
+                set_phase(i, TET_WIN);
                 return;
             }
-            gsi->gs.level++;
-            gsi->gs.togo = gsi->gs.level * INIT_LINES_PER_LEVEL;
-            gsi->step_time_next *= TIME_FACTOR_PER_LEVEL;
-            fprintf(stderr, "new level %u with interval %u\n", gsi->gs.level, gsi->step_time_next);
+            gs->level++;
+            gs->togo = gs->level * INIT_LINES_PER_LEVEL;
+            store.step_time_next[i] *= TIME_FACTOR_PER_LEVEL;
+            fprintf(stderr, "new level %u with interval %u\n", gs->level, store.step_time_next[i]);
         } else {
-            gsi->gs.togo -= lines_cleared;
+            gs->togo -= lines_cleared;
         }
     }
 }
 
-static struct game_state *update_state(struct game_state_int *gsi, struct block_state *new_bs, bool down_movement) {
+/* Apply the outcome of a collision test for game i. */
+static struct game_state *commit_state(size_t i, const struct block_state *new_bs, bool collision, bool down_movement) {
     /* If there is a collision we refrain from accepting the move in general.
      * However, in the case of a down movement the current placement of
-     * the block is made permanent by rendering it into the field. */
-    if (draw_block(gsi, new_bs, NULL) != 0) {
+     * the block is made permanent by merging it into the bitboard. */
+    if (collision) {
         if (down_movement) {
-            draw_block(gsi, &gsi->block_state, gsi->field);
-            test_remove_lines(gsi);
-            /* Keep the canvas in sync with the field. */
-            memcpy(gsi->canvas, gsi->field, FIELD_SIZE);
-            if (new_block(gsi) != 0) {
-                gsi->gs.phase = TET_LOSE;
+            lock_block(i);
+            test_remove_lines(i);
+            if (new_block(i) != 0) {
+                set_phase(i, TET_LOSE);
             }
-            gsi->gs.field = &gsi->field;
-        } else {
-            gsi->gs.field = &gsi->canvas;
+            render_canvas(i);
         }
     } else {
-        /* If there is no collision, the new block state is to be
-         * committed but the rendered field is only to be sent to the
-         * client thus we draw onto the canvas only
-         * (which first gets cloned from the field). */
-        gsi->block_state = *new_bs;
-        memcpy(gsi->canvas, gsi->field, FIELD_SIZE);
-        draw_block(gsi, new_bs, gsi->canvas);
-        gsi->gs.field = &gsi->canvas;
+        /* If there is no collision, the new block state is committed
+         * and rendered onto the canvas for the client. */
+        store_block(i, new_bs);
+        render_canvas(i);
     }
-    return &gsi->gs;
+    return &store.gs[i];
+}
+
+static struct game_state *update_state(size_t i, const struct block_state *new_bs, bool down_movement) {
+    return commit_state(i, new_bs, collides(i, new_bs), down_movement);
 }
 
-static void check_set_rotation(struct block_state *new_bs, int new_rot) {
+static void check_set_rotation(struct block_state *new_bs, unsigned int new_rot) {
     /* While rotating a block might get to wide to fit into the field.
      * If that's the case we ignore the respective input.
-     * NB: rotating through the floor is catched by the generic check in draw_block(). */
-    size_t new_width = new_rot % 2 ? new_bs->cur_block.rows : new_bs->cur_block.cols;
-    if (new_bs->block_x + new_width <= FIELD_WIDTH)
-        new_bs->block_rot = new_rot;
+     * NB: rotating through the floor is catched by the generic collision test. */
+    if (new_bs->x + shapes[new_bs->id][new_rot].width <= FIELD_WIDTH)
+        new_bs->rot = new_rot;
 }
 
 struct game_state *handle_input(size_t client_id, enum tet_input in) {
-    struct game_state_int *gsi = &gstates[client_id];
-    struct block_state new_bs = gsi->block_state;
+    struct game_state *gs = &store.gs[client_id];
+    struct block_state new_bs = load_block(client_id);
 
     /* Ignore all but pause toggle inputs while paused */
-    if (gsi->gs.phase == TET_STOPPED && in != TET_PAUSE) {
+    if (gs->phase == TET_STOPPED && in != TET_PAUSE) {
         return NULL;
     }
 
     bool down_movement = false;
     switch (in) {
         case TET_DOWN: {
-            new_bs.block_y++;
+            new_bs.y++;
             down_movement = true;
             break;
         }
         case TET_LEFT: {
-            if (new_bs.block_x != 0)
-                new_bs.block_x--;
+            if (new_bs.x != 0)
+                new_bs.x--;
             break;
         }
         case TET_RIGHT: {
-            size_t cur_width = new_bs.block_rot % 2 ? new_bs.cur_block.rows : new_bs.cur_block.cols;
-            if (new_bs.block_x + cur_width < FIELD_WIDTH)
-                new_bs.block_x++;
+            if (new_bs.x + shapes[new_bs.id][new_bs.rot].width < FIELD_WIDTH)
+                new_bs.x++;
             break;
         }
         case TET_FASTER: {
-            change_step_time(gsi, 0.5f);
+            change_step_time(client_id, 0.5f);
             break;
         }
         case TET_SLOWER: {
-            change_step_time(gsi, 2.f);
+            change_step_time(client_id, 2.f);
             break;
         }
         case TET_CLOCK: {
-            int new_rot = (new_bs.block_rot + 1) % 4;
-            check_set_rotation(&new_bs, new_rot);
+            check_set_rotation(&new_bs, (new_bs.rot + 1) % 4);
             break;
         }
         case TET_CCLOCK: {
-            int new_rot = new_bs.block_rot == 0 ? 3 : (new_bs.block_rot - 1);
-            check_set_rotation(&new_bs, new_rot);
+            check_set_rotation(&new_bs, new_bs.rot == 0 ? 3 : (new_bs.rot - 1));
             break;
         }
         case TET_CHEAT: {
-            new_bs.cur_block = blocks[rand() % num_blocks];
+            new_bs.id = next_random(client_id) % NUM_BLOCKS;
             break;
         }
         case TET_RESTART: {
@@ -329,19 +516,19 @@ struct game_state *handle_input(size_t client_id, enum tet_input in) {
             return NULL;
         }
         case TET_PAUSE: {
-            if (gsi->gs.phase == TET_IN_PROG) {
-                gsi->gs.phase = TET_STOPPED;
+            if (gs->phase == TET_IN_PROG) {
+                set_phase(client_id, TET_STOPPED);
                 return NULL;
-            } else if (gsi->gs.phase == TET_STOPPED) {
-                gsi->gs.phase = TET_IN_PROG;
+            } else if (gs->phase == TET_STOPPED) {
+                set_phase(client_id, TET_IN_PROG);
             }
             break;
         }
         case TET_DOWN_INSTANT: {
             do {
-                new_bs.block_y++;
-            } while (draw_block(gsi, &new_bs, NULL) == 0);
-            gsi->block_state.block_y = new_bs.block_y-1;
+                new_bs.y++;
+            } while (!collides(client_id, &new_bs));
+            store.block_y[client_id] = new_bs.y - 1;
             down_movement = true;
             break;
         }
@@ -354,28 +541,128 @@ struct game_state *handle_input(size_t client_id, enum tet_input in) {
         }
     }
 
-    return update_state(gsi, &new_bs, down_movement);
+    return update_state(client_id, &new_bs, down_movement);
 }
 
-struct game_state *handle_substep(size_t client_id){
-    struct game_state_int *gsi = &gstates[client_id];
+unsigned int take_garbage(size_t i) {
+    unsigned int rows = store.garbage[i];
+    store.garbage[i] = 0;
+    return rows;
+}
+
+struct game_state *add_garbage(size_t i, unsigned int rows, unsigned int hole) {
+    uint16_t *r = store.rows[i];
+    struct block_state bs = load_block(i);
+    bool top_out = false;
 
-    /* Ignore timing while paused */
-    if (gsi->gs.phase == TET_STOPPED) {
+    if (store.gs[i].phase != TET_IN_PROG && store.gs[i].phase != TET_STOPPED)
         return NULL;
+    if (rows > FIELD_HEIGHT)
+        rows = FIELD_HEIGHT;
+    /* Rows pushed out of the top of the field */
+    for (size_t k = 0; k < rows; k++)
+        top_out |= (r[k] & ROW_FULL) != 0;
+    memmove(&r[0], &r[rows], sizeof(r[0]) * (FIELD_HEIGHT - rows));
+    for (size_t k = FIELD_HEIGHT - rows; k < FIELD_HEIGHT; k++)
+        r[k] = ROW_WALLS | (ROW_FULL & (uint16_t)~(1u << (hole % FIELD_WIDTH)));
+    while (collides(i, &bs) && bs.y > 0)
+        bs.y--;
+    store_block(i, &bs);
+    if (top_out || collides(i, &bs))
+        set_phase(i, TET_LOSE);
+    render_canvas(i);
+    return &store.gs[i];
+}
+
+/* Advance the gravity timers of GAME_LANES games starting at slot i and
+ * flag the lanes whose block has to move down one row in due. */
+static void tick_timers(size_t i, uint32_t due_out[GAME_LANES]) {
+    u32_lanes cur, next, live;
+
+    memcpy(&cur, &store.step_time_cur[i], sizeof(cur));
+    memcpy(&next, &store.step_time_next[i], sizeof(next));
+    memcpy(&live, &store.ticking[i], sizeof(live));
+
+    u32_lanes due = (u32_lanes)(cur <= granularity) & live;
+    u32_lanes dec = cur - (live & granularity);
+    cur = (next & due) | (dec & ~due);
+
+    memcpy(&store.step_time_cur[i], &cur, sizeof(cur));
+    memcpy(due_out, &due, sizeof(due));
+}
+
+/* Test the move one row down of GAME_LANES games starting at slot i. */
+static void test_gravity(size_t i, uint64_t hit_out[GAME_LANES]) {
+    u64_lanes window, piece;
+
+    for (size_t l = 0; l < GAME_LANES; l++) {
+        struct block_state bs = load_block(i + l);
+        window[l] = board_window(i + l, bs.y + 1u);
+        piece[l] = piece_mask(&bs);
     }
+    u64_lanes hit = (u64_lanes)((window & piece) != 0);
+    memcpy(hit_out, &hit, sizeof(hit));
+}
 
-    if (gsi->step_time_cur > STEP_TIME_GRANULARITY) {
-        gsi->step_time_cur -= STEP_TIME_GRANULARITY;
-        gsi->gs.field = &gsi->canvas;
-        return &gsi->gs;
-    } else {
-        gsi->step_time_cur = gsi->step_time_next;
+static struct game_state *substep_result(size_t i, bool due, bool collision) {
+    if (store.gs[i].phase == TET_STOPPED)
+        return NULL;
+    /* Nothing moved, the state sent last is still the current one */
+    if (!due)
+        return NULL;
+
+    struct block_state new_bs = load_block(i);
+    new_bs.y++;
+    return commit_state(i, &new_bs, collision, true);
+}
 
-        /* Move down */
-        struct block_state new_bs = gsi->block_state;
-        new_bs.block_y++;
+size_t handle_substeps(size_t first, size_t count, struct game_state *states[]) {
+    size_t moved = 0;
+    size_t i = first;
 
-        return update_state(gsi, &new_bs, true);
+    for (; i + GAME_LANES <= first + count; i += GAME_LANES) {
+        uint32_t due[GAME_LANES];
+        uint64_t hit[GAME_LANES];
+
+        tick_timers(i, due);
+        /* Most substeps move no block, test the collisions only when one is due */
+        uint32_t any = 0;
+        for (size_t l = 0; l < GAME_LANES; l++)
+            any |= due[l];
+        if (any != 0)
+            test_gravity(i, hit);
+        else
+            memset(hit, 0, sizeof(hit));
+        for (size_t l = 0; l < GAME_LANES; l++) {
+            states[i - first + l] = substep_result(i + l, due[l] != 0, hit[l] != 0);
+            moved += due[l] != 0;
+        }
+    }
+    /* Remaining games that do not fill a whole vector */
+    for (; i < first + count; i++) {
+        bool due = false;
+        if (store.ticking[i]) {
+            if (store.step_time_cur[i] > granularity) {
+                store.step_time_cur[i] -= granularity;
+            } else {
+                store.step_time_cur[i] = store.step_time_next[i];
+                due = true;
+            }
+        }
+        struct block_state bs = load_block(i);
+        bs.y++;
+        states[i - first] = substep_result(i, due, due && collides(i, &bs));
+        moved += due;
     }
-}
\ No newline at end of file
+    return moved;
+}
+
+struct game_state *peek_game(size_t i) {
+    return &store.gs[i];
+}
+
+struct game_state *handle_substep(size_t client_id) {
+    struct game_state *gs = NULL;
+    handle_substeps(client_id, 1, &gs);
+    return gs;
+}
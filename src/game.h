@@ -1,6 +1,9 @@
 #ifndef GAME_H
 #define GAME_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 /***********************************************************************
  * Interface to an implementation of a Tetris game logic.
  * It supports up to CLIENTS_MAX parallel games that have to be
@@ -8,30 +11,47 @@
  * At the start of each game you have to call init_game() with the ID
  * of the game (0..CLIENTS_MAX-1).
  * After that until the end of the game you have to execute
- * handle_substep() at equidistant intervals of STEP_TIME_GRANULARITY
- * milliseconds.
+ * handle_substep() at equidistant intervals of step_granularity()
+ * milliseconds, STEP_TIME_GRANULARITY unless set_step_granularity() set
+ * another one for all games. The finer it is, the faster the gravity can
+ * get and the less its timing is quantised.
+ * Instead of calling handle_substep() per game, a scheduler owning many
+ * games can advance a contiguous range of them with handle_substeps(),
+ * which ticks their gravity timers and runs their collision tests with
+ * vector instructions.
  * Additionally, you need to inform the implementation about user
  * interaction by calling handle_input() for each user action.
  * Both functions return a pointer to struct game_state that contains
  * information of the current state of the respective game such as
  * achieved points or if the player has won or lost (cf. enum tet_phase)
+ * A game only depends on its seed (cf. seed_game()) and its inputs, and
+ * save_game()/load_game() copy its complete state, so that another
+ * process can take a game over or replay inputs on top of it.
  ***********************************************************************/
 
-/* Maximum number of concurrent games */
+/* Maximum number of concurrent games, can be raised at build time */
+#ifndef CLIENTS_MAX
 #define CLIENTS_MAX (5)
+#endif
 
 /* Various constants used for difficulty, scoring and timing */
 #define MAX_LEVEL (5)
 #define INIT_LINES_PER_LEVEL (1)
 #define TIME_FACTOR_PER_LEVEL (0.7f)
 #define STEP_TIME_GRANULARITY (100)
+#define STEP_TIME_GRANULARITY_MIN (1)
 #define STEP_TIME_INIT (1000)
+/* Garbage rows a clear of 1, 2, 3 and 4 lines sends to an opponent */
+#define GARBAGE_PER_CLEAR { 0, 0, 1, 2, 4 }
 
 /* Field dimensions */
 #define FIELD_WIDTH (10u)
 #define FIELD_HEIGHT (18u)
 #define FIELD_SIZE (FIELD_WIDTH * FIELD_HEIGHT)
 
+/* Size of the complete state of a game, cf. save_game() */
+#define GAME_SNAPSHOT_SIZE (73)
+
 /* The game supports the following input "keys" */
 enum tet_input {
     TET_VOID,         /* This key is simply ignored */
@@ -61,6 +81,7 @@ struct game_state {
     unsigned int points;  /* The current game points a player got */
     unsigned int level;   /* The current level of the game */
     unsigned int togo;    /* The number of lines to clear till next level */
+    unsigned int lines;   /* The number of lines cleared since the start */
     /* A point to the two-dimensional array representing the play field */
     char (*field)[FIELD_HEIGHT][FIELD_WIDTH];
 };
@@ -68,10 +89,45 @@ struct game_state {
 /* Initializes/restarts game i */
 void init_game (size_t i);
 
+/* Seeds the block generator of game i, call it before init_game() */
+void seed_game(size_t i, uint64_t seed);
+
+/* Writes the complete state of game i, little endian */
+void save_game(size_t i, unsigned char snapshot[GAME_SNAPSHOT_SIZE]);
+
+/* Replaces game i by a state written by save_game(), NULL if the snapshot is invalid */
+struct game_state *load_game(size_t i, const unsigned char snapshot[GAME_SNAPSHOT_SIZE]);
+
 /* Updates the state of game client_id according to the input in */
 struct game_state *handle_input(size_t client_id, enum tet_input in);
 
-/* Handle the timing of the game and needs to be called every STEP_TIME_GRANULARITY milliseconds */
+/* Returns the garbage rows the line clears of game i earned since the last call */
+unsigned int take_garbage(size_t i);
+
+/* Raises the stack of game i by rows of garbage, full but for column hole.
+ * The current block is pushed up out of the way, the game is lost if the
+ * stack or the block tops out. Returns NULL if the game is over */
+struct game_state *add_garbage(size_t i, unsigned int rows, unsigned int hole);
+
+/* Sets the interval of substeps of all games in ms, from STEP_TIME_GRANULARITY_MIN
+ * to STEP_TIME_INIT, call it before any game starts. Returns 0 on success */
+int set_step_granularity(uint32_t ms);
+
+/* Interval of substeps in ms */
+uint32_t step_granularity(void);
+
+/* Returns the current state of game i without changing it */
+struct game_state *peek_game(size_t i);
+
+/* Handle the timing of the game and needs to be called every step_granularity() milliseconds
+ * while the game is in progress. Returns NULL if the game did not change, so that only
+ * substeps moving the block need a new frame. Substeps of a paused game change nothing
+ * and can be skipped until it is unpaused. */
 struct game_state *handle_substep(size_t client_id);
 
+/* Handle the timing of games first..first+count-1 at once, states[k] receives the
+ * result handle_substep() would have returned for game first+k.
+ * Returns the number of games whose block was due to move down. */
+size_t handle_substeps(size_t first, size_t count, struct game_state *states[]);
+
 #endif // GAME_H
\ No newline at end of file
@@ -49,7 +49,8 @@ int main (void)
          * Thus for every step right/left above, do up to two steps down. */
         for (size_t i = 0; i < substeps; i++) 
         {
-            gs = handle_substep(CLIENT_ID);
+            struct game_state *next = handle_substep(CLIENT_ID);
+            gs = next != NULL ? next : gs;
         }
         draw_field((const char (*)[FIELD_WIDTH])gs->field);
         if (gs->phase == TET_LOSE || gs->phase == TET_WIN) 
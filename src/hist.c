@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "hist.h"
+
+#define HIST_HALF (1u << (HIST_SUB_BITS - 1))
+
+static size_t bucket_of(uint64_t value)
+{
+    if(value < (UINT64_C(1) << HIST_SUB_BITS))
+    {
+        return (size_t)value;
+    }
+    /* keep the HIST_SUB_BITS top bits of the value, the shift selects the power of two */
+    unsigned int shift = (63u - (unsigned int)__builtin_clzll(value)) - (HIST_SUB_BITS - 1);
+
+    return ((size_t)shift * HIST_HALF) + (size_t)(value >> shift);
+}
+
+/* highest value falling into bucket b */
+static uint64_t bucket_max(size_t b)
+{
+    if(b < (1u << HIST_SUB_BITS))
+    {
+        return b;
+    }
+    unsigned int shift = (unsigned int)(b / HIST_HALF) - 1;
+    uint64_t mantissa = (b % HIST_HALF) + HIST_HALF;
+
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void hist_reset(struct hist *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void hist_record(struct hist *h, uint64_t value)
+{
+    h->buckets[bucket_of(value)]++;
+    h->count++;
+    h->sum += value;
+    h->max = value > h->max ? value : h->max;
+}
+
+void hist_merge(struct hist *into, const struct hist *from)
+{
+    for(size_t b = 0; b < HIST_BUCKETS; b++)
+    {
+        into->buckets[b] += from->buckets[b];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    into->max = from->max > into->max ? from->max : into->max;
+}
+
+uint64_t hist_percentile(const struct hist *h, double p)
+{
+    uint64_t seen = 0;
+
+    if(h->count == 0)
+    {
+        return 0;
+    }
+    p = p < 0.0 ? 0.0 : (p > 100.0 ? 100.0 : p);
+    uint64_t rank = (uint64_t)((p / 100.0) * (double)h->count + 0.5);
+    rank = rank == 0 ? 1 : rank;
+    for(size_t b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += h->buckets[b];
+        if(seen >= rank)
+        {
+            uint64_t value = bucket_max(b);
+            return value < h->max ? value : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+int hist_write(FILE *fp, const struct hist *h, const char *name, double scale)
+{
+    uint64_t seen = 0;
+
+    (void)fprintf(fp, "# %s\n%12s %14s %10s %14s\n\n", name, "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+    for(size_t b = 0; b < HIST_BUCKETS && h->count != 0; b++)
+    {
+        if(h->buckets[b] == 0)
+        {
+            continue;
+        }
+        seen += h->buckets[b];
+        double pct = (double)seen / (double)h->count;
+        uint64_t value = bucket_max(b);
+        value = value < h->max ? value : h->max;
+        if(seen < h->count)
+        {
+            (void)fprintf(fp, "%12.3f %14.12f %10llu %14.2f\n", (double)value / scale, pct, (unsigned long long)seen, 1.0 / (1.0 - pct));
+        }
+        else
+        {
+            (void)fprintf(fp, "%12.3f %14.12f %10llu\n", (double)value / scale, pct, (unsigned long long)seen);
+        }
+    }
+    (void)fprintf(fp, "#[Mean    = %12.3f, Max = %12.3f]\n#[Total count    = %12llu]\n\n",
+            h->count != 0 ? ((double)h->sum / (double)h->count) / scale : 0.0,
+            (double)h->max / scale, (unsigned long long)h->count);
+
+    return ferror(fp) ? 1 : 0;
+}
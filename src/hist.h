@@ -0,0 +1,55 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Log-linear histogram in the spirit of HdrHistogram: values below
+   2^HIST_SUB_BITS have their own bucket, above that every power of two
+   is split into 2^(HIST_SUB_BITS-1) buckets, so a recorded value is
+   known within 1/2^(HIST_SUB_BITS-1) (about 3 %) over the whole u64 range. */
+#define HIST_SUB_BITS (6)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 2) << (HIST_SUB_BITS - 1))
+
+struct hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+/*! \brief empty a histogram.
+    \param h    histogram.
+*/
+void hist_reset(struct hist *h);
+
+/*! \brief record one value.
+    \param h        histogram.
+    \param value    value, e.g. a duration in ns.
+*/
+void hist_record(struct hist *h, uint64_t value);
+
+/*! \brief add all values of a histogram to another one.
+    \param into     histogram to add to.
+    \param from     histogram to add.
+*/
+void hist_merge(struct hist *into, const struct hist *from);
+
+/*! \brief value at a percentile.
+    \param h    histogram.
+    \param p    percentile, 0 to 100.
+    \return highest value of the bucket holding the percentile, 0 if empty.
+*/
+uint64_t hist_percentile(const struct hist *h, double p);
+
+/*! \brief write the percentile distribution in the text format of HdrHistogram.
+    \param fp       file to write to.
+    \param h        histogram.
+    \param name     title of the distribution.
+    \param scale    divider applied to the values, e.g. 1e6 for ns shown in ms.
+    \return 0 on success, 1 on error.
+*/
+int hist_write(FILE *fp, const struct hist *h, const char *name, double scale);
+
+#endif
@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "history.h"
+
+#define SCAN_LANES (8u)
+#define PATH_LEN (256)
+
+typedef uint32_t u32_lanes __attribute__((vector_size(SCAN_LANES * sizeof(uint32_t))));
+typedef uint64_t u64_lanes __attribute__((vector_size(SCAN_LANES * sizeof(uint64_t))));
+
+static const struct {
+    const char *name;
+    size_t size;
+} columns[HIST_COLUMNS] = {
+    [HIST_PLAYER] = { "player.u64", sizeof(uint64_t) },
+    [HIST_START] = { "start.u64", sizeof(uint64_t) },
+    [HIST_DURATION] = { "duration.u32", sizeof(uint32_t) },
+    [HIST_POINTS] = { "points.u32", sizeof(uint32_t) },
+    [HIST_LEVEL] = { "level.u32", sizeof(uint32_t) },
+    [HIST_LINES] = { "lines.u32", sizeof(uint32_t) },
+    [HIST_INPUTS] = { "inputs.u32", sizeof(uint32_t) },
+};
+
+static int column_fd[HIST_COLUMNS] = { -1, -1, -1, -1, -1, -1, -1 };
+
+static void column_path(char path[PATH_LEN], const char *dir, enum history_column col)
+{
+    (void)snprintf(path, PATH_LEN, "%s/%s", dir, columns[col].name);
+}
+
+int history_open(const char *dir)
+{
+    char path[PATH_LEN];
+    size_t rows = SIZE_MAX;
+    struct stat st;
+
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST)
+    {
+        perror("mkdir()");
+        return 1;
+    }
+    for(size_t col = 0; col < HIST_COLUMNS; col++)
+    {
+        column_path(path, dir, col);
+        column_fd[col] = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if(column_fd[col] < 0 || fstat(column_fd[col], &st) != 0)
+        {
+            perror("open()");
+            return 1;
+        }
+        size_t n = (size_t)st.st_size / columns[col].size;
+        rows = n < rows ? n : rows;
+    }
+    /* a crash during an append may leave some columns longer than the others */
+    for(size_t col = 0; col < HIST_COLUMNS; col++)
+    {
+        if(ftruncate(column_fd[col], rows * columns[col].size) != 0)
+        {
+            perror("ftruncate()");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int append_column(enum history_column col, const void *values, size_t len)
+{
+    if(write(column_fd[col], values, len) != (ssize_t)len)
+    {
+        perror("write()");
+        return 1;
+    }
+    return 0;
+}
+
+int history_append(const struct game_result *results, size_t n)
+{
+    uint64_t u64[n];
+    uint32_t u32[n];
+    int rc = 0;
+
+    if(n == 0 || column_fd[0] < 0)
+    {
+        return 0;
+    }
+    for(size_t i = 0; i < n; i++)
+    {
+        u64[i] = results[i].player;
+    }
+    rc |= append_column(HIST_PLAYER, u64, sizeof(u64));
+    for(size_t i = 0; i < n; i++)
+    {
+        u64[i] = results[i].start;
+    }
+    rc |= append_column(HIST_START, u64, sizeof(u64));
+    for(size_t i = 0; i < n; i++)
+    {
+        u32[i] = (uint32_t)(results[i].timestamp - results[i].start);
+    }
+    rc |= append_column(HIST_DURATION, u32, sizeof(u32));
+    for(size_t i = 0; i < n; i++)
+    {
+        u32[i] = results[i].points;
+    }
+    rc |= append_column(HIST_POINTS, u32, sizeof(u32));
+    for(size_t i = 0; i < n; i++)
+    {
+        u32[i] = results[i].level;
+    }
+    rc |= append_column(HIST_LEVEL, u32, sizeof(u32));
+    for(size_t i = 0; i < n; i++)
+    {
+        u32[i] = results[i].lines;
+    }
+    rc |= append_column(HIST_LINES, u32, sizeof(u32));
+    for(size_t i = 0; i < n; i++)
+    {
+        u32[i] = results[i].inputs;
+    }
+    rc |= append_column(HIST_INPUTS, u32, sizeof(u32));
+
+    return rc;
+}
+
+int history_map(const char *dir, struct history_view *v)
+{
+    char path[PATH_LEN];
+    const void *maps[HIST_COLUMNS] = {0};
+    size_t rows = SIZE_MAX;
+    struct stat st;
+
+    memset(v, 0, sizeof(*v));
+    for(size_t col = 0; col < HIST_COLUMNS; col++)
+    {
+        column_path(path, dir, col);
+        int fd = open(path, O_RDONLY);
+        if(fd < 0 || fstat(fd, &st) != 0)
+        {
+            perror(path);
+            if(fd >= 0)
+            {
+                close(fd);
+            }
+            history_unmap(v);
+            return 1;
+        }
+        size_t n = (size_t)st.st_size / columns[col].size;
+        rows = n < rows ? n : rows;
+        if(st.st_size > 0)
+        {
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(map == MAP_FAILED)
+            {
+                perror("mmap()");
+                close(fd);
+                history_unmap(v);
+                return 1;
+            }
+            maps[col] = map;
+            v->map_len[col] = st.st_size;
+        }
+        close(fd);
+        v->player = maps[HIST_PLAYER];
+        v->start = maps[HIST_START];
+        v->duration = maps[HIST_DURATION];
+        v->points = maps[HIST_POINTS];
+        v->level = maps[HIST_LEVEL];
+        v->lines = maps[HIST_LINES];
+        v->inputs = maps[HIST_INPUTS];
+    }
+    v->rows = rows;
+
+    return 0;
+}
+
+void history_unmap(struct history_view *v)
+{
+    const void *maps[HIST_COLUMNS] = {
+        v->player, v->start, v->duration, v->points, v->level, v->lines, v->inputs,
+    };
+
+    for(size_t col = 0; col < HIST_COLUMNS; col++)
+    {
+        if(maps[col] != NULL)
+        {
+            munmap((void *)maps[col], v->map_len[col]);
+        }
+    }
+    memset(v, 0, sizeof(*v));
+}
+
+/* sum and number of points of the games of player (0: all) which ended in level */
+static void scan_level(const struct history_view *v, uint64_t player, uint32_t level, uint64_t *sum, uint64_t *games)
+{
+    u64_lanes vsum = {0};
+    u64_lanes vgames = {0};
+    size_t i = 0;
+
+    for(; i + SCAN_LANES <= v->rows; i += SCAN_LANES)
+    {
+        u64_lanes who;
+        u32_lanes lvl, pts;
+
+        memcpy(&who, v->player + i, sizeof(who));
+        memcpy(&lvl, v->level + i, sizeof(lvl));
+        memcpy(&pts, v->points + i, sizeof(pts));
+
+        u64_lanes mask = (u64_lanes)(__builtin_convertvector(lvl, u64_lanes) == level);
+        if(player != 0)
+        {
+            mask &= (u64_lanes)(who == player);
+        }
+        vsum += __builtin_convertvector(pts, u64_lanes) & mask;
+        vgames += mask & 1;
+    }
+    *sum = 0;
+    *games = 0;
+    for(size_t l = 0; l < SCAN_LANES; l++)
+    {
+        *sum += vsum[l];
+        *games += vgames[l];
+    }
+    for(; i < v->rows; i++)
+    {
+        if(v->level[i] == level && (player == 0 || v->player[i] == player))
+        {
+            *sum += v->points[i];
+            (*games)++;
+        }
+    }
+}
+
+void history_avg_by_level(const struct history_view *v, uint64_t player, double avg[MAX_LEVEL + 1], uint64_t games[MAX_LEVEL + 1])
+{
+    for(uint32_t level = 0; level <= MAX_LEVEL; level++)
+    {
+        uint64_t sum = 0;
+
+        scan_level(v, player, level, &sum, &games[level]);
+        avg[level] = games[level] != 0 ? (double)sum / (double)games[level] : 0.0;
+    }
+}
+
+/* k-th smallest value, reorders values */
+static uint32_t select_kth(uint32_t *values, size_t n, size_t k)
+{
+    size_t lo = 0;
+    size_t hi = n - 1;
+
+    while(lo < hi)
+    {
+        uint32_t pivot = values[lo + ((hi - lo) / 2)];
+        size_t i = lo;
+        size_t j = hi;
+        while(i <= j)
+        {
+            while(values[i] < pivot)
+            {
+                i++;
+            }
+            while(values[j] > pivot)
+            {
+                j--;
+            }
+            if(i <= j)
+            {
+                uint32_t t = values[i];
+                values[i] = values[j];
+                values[j] = t;
+                i++;
+                if(j == 0)
+                {
+                    break;
+                }
+                j--;
+            }
+        }
+        if(k <= j)
+        {
+            hi = j;
+        }
+        else if(k >= i)
+        {
+            lo = i;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return values[k];
+}
+
+int history_percentile(const struct history_view *v, uint64_t player, double p, uint32_t *value)
+{
+    size_t n = 0;
+    uint32_t *values = malloc((v->rows + 1) * sizeof(*values));
+
+    if(values == NULL)
+    {
+        perror("malloc()");
+        return 1;
+    }
+    for(size_t i = 0; i < v->rows; i++)
+    {
+        values[n] = v->points[i];
+        n += player == 0 || v->player[i] == player;
+    }
+    if(n == 0)
+    {
+        free(values);
+        return 1;
+    }
+    p = p < 0.0 ? 0.0 : (p > 100.0 ? 100.0 : p);
+    *value = select_kth(values, n, (size_t)((p / 100.0) * (double)(n - 1) + 0.5));
+    free(values);
+
+    return 0;
+}
+
+int history_trend(const struct history_view *v, uint64_t player, struct history_trend *t)
+{
+    double sx = 0.0, sy = 0.0, sxy = 0.0, sxx = 0.0;
+
+    memset(t, 0, sizeof(*t));
+    for(size_t i = 0; i < v->rows; i++)
+    {
+        if(v->player[i] != player)
+        {
+            continue;
+        }
+        double x = (double)t->games;
+        double y = (double)v->points[i];
+        sx += x;
+        sy += y;
+        sxy += x * y;
+        sxx += x * x;
+        if(t->games == 0)
+        {
+            t->first = v->start[i];
+        }
+        t->last = v->start[i];
+        t->best = v->points[i] > t->best ? v->points[i] : t->best;
+        t->games++;
+    }
+    if(t->games == 0)
+    {
+        return 1;
+    }
+
+    double n = (double)t->games;
+    t->mean = sy / n;
+    if(t->games > 1)
+    {
+        t->slope = ((n * sxy) - (sx * sy)) / ((n * sxx) - (sx * sx));
+    }
+
+    return 0;
+}
@@ -0,0 +1,96 @@
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "game.h"
+#include "queues.h"
+
+/* Every finished game is one row of the history. Each column is stored
+   in its own append-only file of fixed size values inside the history
+   directory, so that queries only map and scan the columns they need. */
+enum history_column {
+    HIST_PLAYER,    /* u64 player id */
+    HIST_START,     /* u64 start of the game, ms since the epoch */
+    HIST_DURATION,  /* u32 ms */
+    HIST_POINTS,    /* u32 */
+    HIST_LEVEL,     /* u32 */
+    HIST_LINES,     /* u32 */
+    HIST_INPUTS,    /* u32 */
+    HIST_COLUMNS
+};
+
+/* Read-only mapping of the whole history */
+struct history_view {
+    size_t rows;
+    const uint64_t *player;
+    const uint64_t *start;
+    const uint32_t *duration;
+    const uint32_t *points;
+    const uint32_t *level;
+    const uint32_t *lines;
+    const uint32_t *inputs;
+    size_t map_len[HIST_COLUMNS];
+};
+
+/* Score trend of a player over its games in the history */
+struct history_trend {
+    size_t games;
+    double mean;        /* average points */
+    double slope;       /* least squares change of points per game played */
+    uint32_t best;
+    uint64_t first;     /* start of the first and the last game */
+    uint64_t last;
+};
+
+/*! \brief open the history for appending, created if missing.
+    \param dir      history directory.
+    \return 0 on success, 1 on error.
+*/
+int history_open(const char *dir);
+
+/*! \brief append finished games to the history.
+    \param results  finished games.
+    \param n        number of results.
+    \return 0 on success, 1 on error.
+*/
+int history_append(const struct game_result *results, size_t n);
+
+/*! \brief map the history for queries.
+    \param dir      history directory.
+    \param v[out]   mapped columns.
+    \return 0 on success, 1 on error.
+*/
+int history_map(const char *dir, struct history_view *v);
+
+/*! \brief release a mapping.
+    \param v        mapped columns.
+*/
+void history_unmap(struct history_view *v);
+
+/*! \brief average points of the games which ended in each level.
+    \param v            mapped columns.
+    \param player       player id, 0 for all players.
+    \param avg[out]     average points, indexed by level.
+    \param games[out]   number of games, indexed by level.
+*/
+void history_avg_by_level(const struct history_view *v, uint64_t player, double avg[MAX_LEVEL + 1], uint64_t games[MAX_LEVEL + 1]);
+
+/*! \brief points percentile.
+    \param v            mapped columns.
+    \param player       player id, 0 for all players.
+    \param p            percentile, 0 to 100.
+    \param value[out]   points at the percentile.
+    \return 0 on success, 1 if there is no game or on error.
+*/
+int history_percentile(const struct history_view *v, uint64_t player, double p, uint32_t *value);
+
+/*! \brief score trend of a player.
+    \param v            mapped columns.
+    \param player       player id.
+    \param t[out]       trend.
+    \return 0 on success, 1 if the player has no game.
+*/
+int history_trend(const struct history_view *v, uint64_t player, struct history_trend *t);
+
+#endif
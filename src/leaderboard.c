@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "leaderboard.h"
+
+#define NIL (0u)
+
+/* Order statistic tree: a treap where every node knows the size of its subtree. */
+struct lb_node {
+    struct lb_entry e;
+    uint32_t left;
+    uint32_t right;
+    uint32_t size;
+    uint32_t prio;
+};
+
+/* Open addressing map from player id to the node holding its best result */
+struct lb_slot {
+    uint64_t player;
+    uint32_t node;
+};
+
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct lb_node *nodes = NULL;    /* nodes[0] is the NIL node */
+static uint32_t nb_nodes = 0;
+static uint32_t cap_nodes = 0;
+static uint32_t root = NIL;
+static struct lb_slot *slots = NULL;
+static size_t nb_slots = 0;             /* power of two */
+static uint32_t prio_state = 0x9E3779B9u;
+
+static uint32_t next_prio(void)
+{
+    /* xorshift32 */
+    prio_state ^= prio_state << 13;
+    prio_state ^= prio_state >> 17;
+    prio_state ^= prio_state << 5;
+    return prio_state;
+}
+
+/* true if a is ranked before b */
+static bool before(const struct lb_entry *a, const struct lb_entry *b)
+{
+    if(a->score != b->score)
+    {
+        return a->score > b->score;
+    }
+    if(a->timestamp != b->timestamp)
+    {
+        return a->timestamp < b->timestamp;
+    }
+    return a->player < b->player;
+}
+
+static void update_size(uint32_t t)
+{
+    nodes[t].size = nodes[nodes[t].left].size + nodes[nodes[t].right].size + 1;
+}
+
+/* split t into the nodes ranked before e and the others */
+static void split(uint32_t t, const struct lb_entry *e, uint32_t *l, uint32_t *r)
+{
+    if(t == NIL)
+    {
+        *l = *r = NIL;
+    }
+    else if(before(&nodes[t].e, e))
+    {
+        split(nodes[t].right, e, &nodes[t].right, r);
+        *l = t;
+        update_size(t);
+    }
+    else
+    {
+        split(nodes[t].left, e, l, &nodes[t].left);
+        *r = t;
+        update_size(t);
+    }
+}
+
+static uint32_t merge(uint32_t l, uint32_t r)
+{
+    if(l == NIL || r == NIL)
+    {
+        return l != NIL ? l : r;
+    }
+    if(nodes[l].prio > nodes[r].prio)
+    {
+        nodes[l].right = merge(nodes[l].right, r);
+        update_size(l);
+        return l;
+    }
+    nodes[r].left = merge(l, nodes[r].left);
+    update_size(r);
+    return r;
+}
+
+static uint32_t erase(uint32_t t, const struct lb_entry *e)
+{
+    if(t == NIL)
+    {
+        return NIL;
+    }
+    if(before(e, &nodes[t].e))
+    {
+        nodes[t].left = erase(nodes[t].left, e);
+    }
+    else if(before(&nodes[t].e, e))
+    {
+        nodes[t].right = erase(nodes[t].right, e);
+    }
+    else
+    {
+        return merge(nodes[t].left, nodes[t].right);
+    }
+    update_size(t);
+    return t;
+}
+
+/* number of nodes ranked before e */
+static uint32_t count_before(const struct lb_entry *e)
+{
+    uint32_t t = root;
+    uint32_t n = 0;
+
+    while(t != NIL)
+    {
+        if(before(&nodes[t].e, e))
+        {
+            n += nodes[nodes[t].left].size + 1;
+            t = nodes[t].right;
+        }
+        else
+        {
+            t = nodes[t].left;
+        }
+    }
+
+    return n;
+}
+
+/* copy nodes with zero based rank in [lo, hi) of subtree t, whose first node has rank base */
+static void collect(uint32_t t, uint32_t base, uint32_t lo, uint32_t hi, struct lb_entry out[])
+{
+    if(t == NIL || base >= hi || base + nodes[t].size <= lo)
+    {
+        return;
+    }
+    collect(nodes[t].left, base, lo, hi, out);
+    uint32_t idx = base + nodes[nodes[t].left].size;
+    if(idx >= lo && idx < hi)
+    {
+        out[idx - lo] = nodes[t].e;
+    }
+    collect(nodes[t].right, idx + 1, lo, hi, out);
+}
+
+static struct lb_slot *find_slot(struct lb_slot *table, size_t size, uint64_t player)
+{
+    size_t i = (size_t)(player ^ (player >> 29)) & (size - 1);
+
+    while(table[i].player != 0 && table[i].player != player)
+    {
+        i = (i + 1) & (size - 1);
+    }
+
+    return &table[i];
+}
+
+static int grow_slots(void)
+{
+    size_t size = nb_slots * 2;
+    struct lb_slot *table = calloc(size, sizeof(*table));
+
+    if(table == NULL)
+    {
+        perror("calloc()");
+        return 1;
+    }
+    for(size_t i = 0; i < nb_slots; i++)
+    {
+        if(slots[i].player != 0)
+        {
+            *find_slot(table, size, slots[i].player) = slots[i];
+        }
+    }
+    free(slots);
+    slots = table;
+    nb_slots = size;
+
+    return 0;
+}
+
+static int grow_nodes(void)
+{
+    uint32_t cap = cap_nodes * 2;
+    struct lb_node *tmp = realloc(nodes, cap * sizeof(*nodes));
+
+    if(tmp == NULL)
+    {
+        perror("realloc()");
+        return 1;
+    }
+    nodes = tmp;
+    cap_nodes = cap;
+
+    return 0;
+}
+
+int lb_init(size_t capacity)
+{
+    cap_nodes = 16;
+    while(cap_nodes < capacity + 1)
+    {
+        cap_nodes *= 2;
+    }
+    nb_slots = (size_t)cap_nodes * 2;
+
+    nodes = calloc(cap_nodes, sizeof(*nodes));
+    slots = calloc(nb_slots, sizeof(*slots));
+    if(nodes == NULL || slots == NULL)
+    {
+        perror("calloc()");
+        return 1;
+    }
+    nb_nodes = 1;
+    root = NIL;
+
+    return 0;
+}
+
+/* lb_insert() with the write lock held */
+static int insert_locked(const struct lb_entry *e, uint32_t *rank)
+{
+    uint32_t l, r;
+    struct lb_slot *slot = find_slot(slots, nb_slots, e->player);
+    uint32_t t = slot->node;
+
+    if(slot->player != 0)
+    {
+        if(nodes[t].e.score >= e->score)
+        {
+            /* keep the previous best result */
+            return 0;
+        }
+        root = erase(root, &nodes[t].e);
+    }
+    else
+    {
+        if((nb_nodes + 1) * 2 > nb_slots && grow_slots() != 0)
+        {
+            return 1;
+        }
+        if(nb_nodes == cap_nodes && grow_nodes() != 0)
+        {
+            return 1;
+        }
+        t = nb_nodes++;
+        slot = find_slot(slots, nb_slots, e->player);
+        slot->player = e->player;
+        slot->node = t;
+    }
+
+    nodes[t].e = *e;
+    nodes[t].left = nodes[t].right = NIL;
+    nodes[t].size = 1;
+    nodes[t].prio = next_prio();
+    split(root, e, &l, &r);
+    *rank = nodes[l].size + 1;
+    root = merge(merge(l, t), r);
+
+    return 0;
+}
+
+int lb_insert(const struct lb_entry *e, uint32_t *rank)
+{
+    *rank = 0;
+    if(pthread_rwlock_wrlock(&lock) != 0)
+    {
+        perror("pthread_rwlock_wrlock()");
+        return 1;
+    }
+    int rc = insert_locked(e, rank);
+    if(pthread_rwlock_unlock(&lock) != 0)
+    {
+        perror("pthread_rwlock_unlock()");
+        return 1;
+    }
+
+    return rc;
+}
+
+int lb_rank(uint64_t player, uint32_t *rank, struct lb_entry *e)
+{
+    int rc = 1;
+
+    if(pthread_rwlock_rdlock(&lock) != 0)
+    {
+        perror("pthread_rwlock_rdlock()");
+        return 1;
+    }
+    struct lb_slot *slot = find_slot(slots, nb_slots, player);
+    if(slot->player != 0)
+    {
+        *rank = count_before(&nodes[slot->node].e) + 1;
+        if(e != NULL)
+        {
+            *e = nodes[slot->node].e;
+        }
+        rc = 0;
+    }
+    (void)pthread_rwlock_unlock(&lock);
+
+    return rc;
+}
+
+size_t lb_range(uint32_t first_rank, size_t count, struct lb_entry out[])
+{
+    size_t n = 0;
+
+    if(first_rank == 0)
+    {
+        first_rank = 1;
+    }
+    if(pthread_rwlock_rdlock(&lock) != 0)
+    {
+        perror("pthread_rwlock_rdlock()");
+        return 0;
+    }
+    uint32_t total = nodes[root].size;
+    if(first_rank <= total)
+    {
+        n = total - (first_rank - 1);
+        n = n < count ? n : count;
+        collect(root, 0, first_rank - 1, first_rank - 1 + (uint32_t)n, out);
+    }
+    (void)pthread_rwlock_unlock(&lock);
+
+    return n;
+}
+
+size_t lb_around(uint64_t player, size_t radius, size_t max, struct lb_entry out[], uint32_t *first_rank)
+{
+    size_t n = 0;
+
+    if(pthread_rwlock_rdlock(&lock) != 0)
+    {
+        perror("pthread_rwlock_rdlock()");
+        return 0;
+    }
+    struct lb_slot *slot = find_slot(slots, nb_slots, player);
+    if(slot->player != 0)
+    {
+        uint32_t pos = count_before(&nodes[slot->node].e);
+        uint32_t lo = pos > radius ? pos - (uint32_t)radius : 0;
+        uint32_t hi = pos + (uint32_t)radius + 1;
+        if(hi > nodes[root].size)
+        {
+            hi = nodes[root].size;
+        }
+        if(hi - lo > max)
+        {
+            hi = lo + (uint32_t)max;
+        }
+        collect(root, 0, lo, hi, out);
+        *first_rank = lo + 1;
+        n = hi - lo;
+    }
+    (void)pthread_rwlock_unlock(&lock);
+
+    return n;
+}
+
+size_t lb_size(void)
+{
+    size_t n = 0;
+
+    if(pthread_rwlock_rdlock(&lock) == 0)
+    {
+        n = nodes[root].size;
+        (void)pthread_rwlock_unlock(&lock);
+    }
+
+    return n;
+}
+
+void lb_entry_encode(char buf[LB_ENTRY_WIRE_SIZE], const struct lb_entry *e)
+{
+    put_u32(buf, e->score);
+    put_u64(buf + 4, e->timestamp);
+    memcpy(buf + 12, e->name, PLAYER_NAME_LEN);
+    buf[12 + PLAYER_NAME_LEN - 1] = '\0';
+}
+
+void lb_entry_decode(struct lb_entry *e, const char buf[LB_ENTRY_WIRE_SIZE])
+{
+    e->player = 0;
+    e->score = get_u32(buf);
+    e->timestamp = get_u64(buf + 4);
+    memcpy(e->name, buf + 12, PLAYER_NAME_LEN);
+    e->name[PLAYER_NAME_LEN - 1] = '\0';
+}
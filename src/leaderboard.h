@@ -0,0 +1,76 @@
+#ifndef _LEADERBOARD_H_
+#define _LEADERBOARD_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "common.h"
+
+/* Size of an entry on the wire: u32 score, u64 timestamp, player name */
+#define LB_ENTRY_WIRE_SIZE (4 + 8 + PLAYER_NAME_LEN)
+
+/* Best result of a player. Entries are ranked by score, ties go to the
+   earlier timestamp and then to the smaller player id. */
+struct lb_entry {
+    uint64_t player;                /* player id, cf. player_id() */
+    uint64_t timestamp;             /* end of the game, ms since the epoch */
+    uint32_t score;
+    char name[PLAYER_NAME_LEN];
+};
+
+/*! \brief initialize the leaderboard.
+    \param capacity     number of entries to reserve memory for.
+    \return 0 on success, 1 on error.
+*/
+int lb_init(size_t capacity);
+
+/*! \brief add a result, only the best result of each player is kept.
+    \param e[in]        result to add.
+    \param rank[out]    new rank of the player, 0 if the previous best result is kept.
+    \return 0 on success, 1 on error.
+*/
+int lb_insert(const struct lb_entry *e, uint32_t *rank);
+
+/*! \brief get the rank of a player.
+    \param player       player id.
+    \param rank[out]    rank, starting at 1.
+    \param e[out]       best result of the player, may be NULL.
+    \return 0 on success, 1 if the player has no entry.
+*/
+int lb_rank(uint64_t player, uint32_t *rank, struct lb_entry *e);
+
+/*! \brief get a range of entries by rank.
+    \param first_rank   rank of the first entry, starting at 1.
+    \param count        maximum number of entries.
+    \param out[out]     entries.
+    \return number of entries stored in out.
+*/
+size_t lb_range(uint32_t first_rank, size_t count, struct lb_entry out[]);
+
+/*! \brief get the entries ranked around a player.
+    \param player           player id.
+    \param radius           entries to return on each side of the player.
+    \param max              maximum number of entries, the ones ranked last are cut.
+    \param out[out]         up to min(2 * radius + 1, max) entries.
+    \param first_rank[out]  rank of out[0].
+    \return number of entries stored in out, 0 if the player has no entry.
+*/
+size_t lb_around(uint64_t player, size_t radius, size_t max, struct lb_entry out[], uint32_t *first_rank);
+
+/*! \brief get the number of ranked players.
+    \return number of entries.
+*/
+size_t lb_size(void);
+
+/*! \brief encode an entry for the wire.
+    \param buf[out]     LB_ENTRY_WIRE_SIZE bytes.
+    \param e[in]        entry.
+*/
+void lb_entry_encode(char buf[LB_ENTRY_WIRE_SIZE], const struct lb_entry *e);
+
+/*! \brief decode an entry received from the wire (player id is not transmitted).
+    \param e[out]       entry.
+    \param buf[in]      LB_ENTRY_WIRE_SIZE bytes.
+*/
+void lb_entry_decode(struct lb_entry *e, const char buf[LB_ENTRY_WIRE_SIZE]);
+
+#endif
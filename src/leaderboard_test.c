@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "leaderboard.h"
+
+#define PLAYERS (60)
+#define RANGE_MAX (50)
+
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+    if(!ok)
+    {
+        (void)printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+int main(void)
+{
+    /* one slot past the range, to catch writes beyond it */
+    struct lb_entry out[RANGE_MAX + 1];
+    uint32_t first_rank = 0;
+    size_t n = 0;
+
+    if(lb_init(PLAYERS) != 0)
+    {
+        return 1;
+    }
+    /* player p scores p, ranked PLAYERS + 1 - p */
+    for(uint64_t p = 1; p <= PLAYERS; p++)
+    {
+        struct lb_entry e = { .player = p, .timestamp = p, .score = (uint32_t)p };
+        uint32_t rank = 0;
+        (void)snprintf(e.name, sizeof(e.name), "player%u", (unsigned int)p);
+        check(lb_insert(&e, &rank) == 0, "insert");
+    }
+    check(lb_size() == PLAYERS, "size");
+
+    /* a radius at the limit fills the range exactly, centered on the player */
+    memset(&out[RANGE_MAX], 0xA5, sizeof(out[RANGE_MAX]));
+    n = lb_around(30, (RANGE_MAX - 1) / 2, RANGE_MAX, out, &first_rank);
+    check(n == 2 * ((RANGE_MAX - 1) / 2) + 1, "around: entries at the radius limit");
+    check(first_rank == 31 - (RANGE_MAX - 1) / 2, "around: first rank at the radius limit");
+    check(out[(RANGE_MAX - 1) / 2].player == 30, "around: player in the middle");
+
+    /* a radius past the limit is cut to max entries, nothing is written past them */
+    n = lb_around(30, RANGE_MAX / 2, RANGE_MAX, out, &first_rank);
+    check(n == RANGE_MAX, "around: entries past the radius limit");
+    check(out[RANGE_MAX].player == UINT64_C(0xA5A5A5A5A5A5A5A5), "around: no write past max");
+    for(size_t i = 1; i < n; i++)
+    {
+        check(out[i].score < out[i - 1].score, "around: entries in rank order");
+    }
+
+    /* the window is cut at the end of the board */
+    n = lb_around(1, (RANGE_MAX - 1) / 2, RANGE_MAX, out, &first_rank);
+    check(n == (RANGE_MAX - 1) / 2 + 1 && out[n - 1].player == 1, "around: last ranked player");
+    check(lb_around(PLAYERS + 1, 1, RANGE_MAX, out, &first_rank) == 0, "around: unranked player");
+
+    if(failures != 0)
+    {
+        return 1;
+    }
+    (void)printf("leaderboard: all checks passed\n");
+
+    return 0;
+}
@@ -0,0 +1,866 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "game.h"
+#include "common.h"
+#include "hist.h"
+
+#define SERVER_DEFAULT_PORT "30001"
+#define SERVER_DEFAULT_IP   "127.0.0.1"
+#define DEFAULT_CONNECTIONS (100)
+#define DEFAULT_RATE        (10)
+#define DEFAULT_DURATION    (10)
+#define RX_SIZE             (4096)
+#define EVENTS_MAX          (256)
+#define NS_PER_S            (UINT64_C(1000000000))
+#define DEFAULT_P99_LIMIT   (50)
+#define STEPS_MAX           (32)
+#define SERVER_START_MS     (5000)
+#define SESSION_DRAIN_MS    (500)
+
+#ifndef LOADGEN_REVISION
+#define LOADGEN_REVISION "unknown"
+#endif
+
+enum conn_state {
+    CONN_IDLE,          /* not connected, (re)connects at next_input */
+    CONN_CONNECTING,    /* waiting for the connection to complete */
+    CONN_HANDSHAKE,     /* hello sent, waiting for the first frame */
+    CONN_PLAYING,       /* sending inputs */
+};
+
+/* one simulated player */
+struct conn {
+    int fd;
+    enum conn_state state;
+    size_t rx_len;
+    uint32_t sent;          /* sequence number of the last input sent */
+    uint32_t acked;         /* sequence number of the last input applied by the server */
+    uint64_t next_input;    /* when the next input is due, or the next connection attempt */
+    size_t script_pos;
+    char rx[RX_SIZE];
+};
+
+/* totals of the whole run, rates are computed from their difference per second */
+struct stats {
+    uint64_t sessions;      /* sessions which reached the end of their game */
+    uint64_t failed;        /* connections refused or closed before the first frame */
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t inputs;
+};
+
+static struct addrinfo *server = NULL;
+static struct conn *conns = NULL;
+static size_t nb_conns = DEFAULT_CONNECTIONS;
+static uint64_t input_interval = NS_PER_S / DEFAULT_RATE;
+static const char *script = NULL;
+static unsigned int versus_players = 0;
+static int epfd = -1;
+/* one load level of a sweep, measured after its warm-up */
+struct step {
+    size_t conns;
+    size_t playing;         /* players in a game at the end of the step */
+    double elapsed;         /* s */
+    double server_cpu;      /* s of CPU used by the server, negative if unknown */
+    struct stats stats;
+    uint64_t latency[5];    /* ns: p50, p99, p999, max, inputs acknowledged */
+};
+
+static struct stats stats = {0};
+static struct hist latency;
+static volatile sig_atomic_t stop = 0;
+static pid_t server_pid = -1;
+
+static void print_usage(const char *prog_name);
+static void on_signal(int sig);
+static void raise_fd_limit(size_t needed);
+static int conn_open(struct conn *c);
+static void conn_close(struct conn *c, uint64_t now, bool failed);
+static void conn_readable(struct conn *c, uint64_t now);
+static int conn_message(struct conn *c, enum msg_type type, const char *data, uint16_t len, uint64_t now);
+static int conn_send_input(struct conn *c, uint64_t now);
+static char next_input(struct conn *c);
+static void print_stats(double elapsed, const struct stats *prev, double period);
+static int run_load(size_t count, unsigned int warmup, unsigned int duration, bool verbose, struct step *out);
+static void close_all(void);
+static pid_t spawn_server(const char *path, const char *port);
+static double process_cpu(pid_t pid);
+static int write_report(const char *path, const struct step *steps, size_t count, double input_rate);
+
+int main(int argc, char *argv[])
+{
+    int c = 0;
+    const char *server_ip = SERVER_DEFAULT_IP;
+    const char *server_port = SERVER_DEFAULT_PORT;
+    const char *server_path = NULL;
+    const char *report = NULL;
+    unsigned int duration = DEFAULT_DURATION;
+    unsigned int input_rate = DEFAULT_RATE;
+    size_t sweep_max = 0;
+    double p99_limit = DEFAULT_P99_LIMIT;
+    struct addrinfo hints;
+
+    while ( (c = getopt(argc, argv, "hi:p:c:r:d:s:v:S:N:L:o:")) != -1 ) {
+        switch ( c ) {
+            case 'i':
+                server_ip = optarg;
+                break;
+
+            case 'p':
+                server_port = optarg;
+                break;
+
+            case 'c':
+                /* user passed the number of simulated players */
+                nb_conns = strtoul(optarg, NULL, 10);
+                if(nb_conns == 0)
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'r':
+                /* user passed the inputs per second of each player */
+                input_rate = atoi(optarg) > 0 ? (unsigned int)atoi(optarg) : 0;
+                if(input_rate == 0)
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                input_interval = NS_PER_S / input_rate;
+                break;
+
+            case 'd':
+                duration = (unsigned int)atoi(optarg);
+                break;
+
+            case 's':
+                /* user passed the inputs to play in a loop */
+                script = optarg;
+                break;
+
+            case 'v':
+                /* user wants the players in versus rooms of this size */
+                versus_players = (unsigned int)atoi(optarg);
+                if(versus_players < 2 || versus_players > UINT8_MAX)
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'S':
+                /* user wants the server started and watched by the load generator */
+                server_path = optarg;
+                break;
+
+            case 'N':
+                /* user wants a sweep of the number of players */
+                sweep_max = strtoul(optarg, NULL, 10);
+                if(sweep_max == 0)
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'L':
+                /* user passed the p99 latency which ends a sweep */
+                p99_limit = atof(optarg);
+                break;
+
+            case 'o':
+                /* user passed where to write the report */
+                report = optarg;
+                break;
+
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+
+            case '?':
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int s = getaddrinfo(server_ip, server_port, &hints, &server);
+    if(s != 0)
+    {
+        (void)fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+        return 1;
+    }
+
+    if(signal(SIGINT, on_signal) == SIG_ERR || signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        perror("signal()");
+        return 1;
+    }
+    size_t max_conns = sweep_max > nb_conns ? sweep_max : nb_conns;
+    raise_fd_limit(max_conns + 16);
+
+    conns = calloc(max_conns, sizeof(*conns));
+    epfd = epoll_create1(0);
+    if(conns == NULL || epfd < 0)
+    {
+        perror("setup");
+        return 1;
+    }
+    for(size_t i = 0; i < max_conns; i++)
+    {
+        conns[i].fd = -1;
+    }
+    if(server_path != NULL && (server_pid = spawn_server(server_path, server_port)) < 0)
+    {
+        return 1;
+    }
+
+    struct step steps[STEPS_MAX];
+    size_t nb_steps = 0;
+    int rc = 0;
+    if(sweep_max == 0)
+    {
+        /* a single run, reported every second */
+        rc = run_load(nb_conns, 0, duration, true, &steps[nb_steps++]);
+        struct stats none = {0};
+        (void)printf("total: ");
+        print_stats(steps[0].elapsed, &none, steps[0].elapsed);
+        (void)printf("input latency ms: p50 %.3f p90 %.3f p99 %.3f p999 %.3f max %.3f (%llu inputs acknowledged)\n",
+                hist_percentile(&latency, 50) / 1e6, hist_percentile(&latency, 90) / 1e6,
+                hist_percentile(&latency, 99) / 1e6, hist_percentile(&latency, 99.9) / 1e6,
+                latency.max / 1e6, (unsigned long long)latency.count);
+    }
+    else
+    {
+        /* double the players until the server refuses some or the tail latency gets too long */
+        for(size_t n = 1; !stop && nb_steps < STEPS_MAX; n = (n * 2 > sweep_max) ? sweep_max : n * 2)
+        {
+            struct step *st = &steps[nb_steps++];
+            if((rc = run_load(n, 1, duration, false, st)) != 0)
+            {
+                break;
+            }
+            (void)printf("players=%zu playing=%zu frames/s=%.0f inputs/s=%.0f failed=%llu latency ms p50 %.3f p99 %.3f p999 %.3f server cpu %.1f%%\n",
+                    n, st->playing, (double)st->stats.frames / st->elapsed, (double)st->stats.inputs / st->elapsed,
+                    (unsigned long long)st->stats.failed, st->latency[0] / 1e6, st->latency[1] / 1e6, st->latency[2] / 1e6,
+                    st->server_cpu >= 0 ? 100 * st->server_cpu / st->elapsed : -1.0);
+            (void)fflush(stdout);
+            if(n >= sweep_max || st->stats.failed != 0 || st->latency[1] / 1e6 > p99_limit)
+            {
+                break;
+            }
+        }
+    }
+
+    if(report != NULL && write_report(report, steps, nb_steps, input_rate) != 0)
+    {
+        rc = 1;
+    }
+    if(server_pid > 0)
+    {
+        (void)kill(server_pid, SIGINT);
+        (void)waitpid(server_pid, NULL, 0);
+    }
+    freeaddrinfo(server);
+    free(conns);
+    close(epfd);
+
+    return rc;
+}
+
+/*! \brief run a number of players against the server.
+    \param count        players.
+    \param warmup       s before the measure starts, to let every player connect.
+    \param duration     s of measure.
+    \param verbose      print the activity every second.
+    \param out[out]     measure, the latency histogram is left in latency.
+    \return 0 on success, 1 on error.
+*/
+static int run_load(size_t count, unsigned int warmup, unsigned int duration, bool verbose, struct step *out)
+{
+    struct epoll_event events[EVENTS_MAX];
+    int rc = 0;
+
+    nb_conns = count;
+    memset(&stats, 0, sizeof(stats));
+    hist_reset(&latency);
+
+    /* spread the connections and their inputs over the first input interval */
+    uint64_t start = mono_ns();
+    for(size_t i = 0; i < nb_conns; i++)
+    {
+        conns[i].fd = -1;
+        conns[i].state = CONN_IDLE;
+        conns[i].next_input = start + ((input_interval * i) / nb_conns);
+        conns[i].script_pos = i;
+    }
+
+    struct stats prev = stats;
+    uint64_t next_report = start + NS_PER_S;
+    uint64_t measure_start = start + ((uint64_t)warmup * NS_PER_S);
+    uint64_t end = measure_start + ((uint64_t)duration * NS_PER_S);
+    uint64_t now = start;
+    double cpu_start = process_cpu(server_pid);
+    bool measuring = warmup == 0;
+    while(!stop && now < end)
+    {
+        int n = epoll_wait(epfd, events, EVENTS_MAX, 1);
+        if(n < 0 && errno != EINTR)
+        {
+            perror("epoll_wait()");
+            rc = 1;
+            break;
+        }
+        now = mono_ns();
+        if(!measuring && now >= measure_start)
+        {
+            /* only what happens once every player had time to connect counts */
+            memset(&stats, 0, sizeof(stats));
+            hist_reset(&latency);
+            cpu_start = process_cpu(server_pid);
+            measuring = true;
+        }
+        for(int e = 0; e < n; e++)
+        {
+            struct conn *conn = &conns[events[e].data.u64];
+            if(conn->state == CONN_CONNECTING && (events[e].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0)
+            {
+                char hello[2 + PLAYER_NAME_LEN] = {0};
+                size_t hello_len = 0;
+                int err = 0;
+                socklen_t err_len = sizeof(err);
+
+                if(versus_players != 0)
+                {
+                    hello[hello_len++] = (char)REQ_VERSUS;
+                    hello[hello_len++] = (char)versus_players;
+                }
+                else
+                {
+                    hello[hello_len++] = (char)REQ_HELLO;
+                }
+                (void)snprintf(hello + hello_len, PLAYER_NAME_LEN, "load%zu", (size_t)events[e].data.u64);
+                hello_len += PLAYER_NAME_LEN;
+                if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0 || err != 0 ||
+                        send(conn->fd, hello, hello_len, MSG_NOSIGNAL) != (ssize_t)hello_len)
+                {
+                    conn_close(conn, now, true);
+                    continue;
+                }
+                conn->state = CONN_HANDSHAKE;
+                struct epoll_event ev = { .events = EPOLLIN, .data = events[e].data };
+                (void)epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+            }
+            else if(conn->state == CONN_HANDSHAKE || conn->state == CONN_PLAYING)
+            {
+                conn_readable(conn, now);
+            }
+        }
+
+        /* inputs and reconnections which are due */
+        for(size_t i = 0; i < nb_conns; i++)
+        {
+            struct conn *conn = &conns[i];
+            if(conn->next_input > now)
+            {
+                continue;
+            }
+            if(conn->state == CONN_IDLE)
+            {
+                conn->next_input = now + input_interval;
+                if(conn_open(conn) != 0)
+                {
+                    conn_close(conn, now, true);
+                }
+            }
+            else if(conn->state == CONN_PLAYING)
+            {
+                conn->next_input += input_interval;
+                if(conn->next_input <= now)
+                {
+                    /* do not burst to catch up after a stall */
+                    conn->next_input = now + input_interval;
+                }
+                if(conn_send_input(conn, now) != 0)
+                {
+                    conn_close(conn, now, true);
+                }
+            }
+        }
+
+        if(verbose && now >= next_report)
+        {
+            print_stats((double)(now - start) / NS_PER_S, &prev, 1.0);
+            prev = stats;
+            next_report += NS_PER_S;
+        }
+    }
+
+    double cpu_end = process_cpu(server_pid);
+    out->conns = count;
+    out->playing = 0;
+    for(size_t i = 0; i < nb_conns; i++)
+    {
+        out->playing += conns[i].state == CONN_PLAYING;
+    }
+    out->elapsed = (double)(now - (measuring ? measure_start : start)) / NS_PER_S;
+    out->server_cpu = cpu_start >= 0 && cpu_end >= 0 ? cpu_end - cpu_start : -1.0;
+    out->stats = stats;
+    out->latency[0] = hist_percentile(&latency, 50);
+    out->latency[1] = hist_percentile(&latency, 99);
+    out->latency[2] = hist_percentile(&latency, 99.9);
+    out->latency[3] = latency.max;
+    out->latency[4] = latency.count;
+    close_all();
+
+    return rc;
+}
+
+/*! \brief close every connection and give the server time to end their sessions.
+*/
+static void close_all(void)
+{
+    for(size_t i = 0; i < nb_conns; i++)
+    {
+        if(conns[i].fd >= 0)
+        {
+            close(conns[i].fd);
+            conns[i].fd = -1;
+        }
+        conns[i].state = CONN_IDLE;
+    }
+    (void)nanosleep(&(struct timespec){ .tv_nsec = SESSION_DRAIN_MS * 1000000L }, NULL);
+}
+
+/*! \brief print usage to sterr
+    \param prog_name    program name string
+*/
+static void print_usage(const char *prog_name)
+{
+    (void)fprintf(stderr, "Usage: %s [-i <server ip>] [-p <server port>] [-c <connections>] [-r <inputs/s>] [-d <s>] [-s <script>]\n"
+                    "       [-v <players>] [-S <server>] [-N <players>] [-L <ms>] [-o <report>] [-h]\n"
+                    "Options:\n"
+                    "  -i <server ip>\t\tIP adresse of the server.\n"
+                    "  -p <server port>\t\tServer port in use.\n"
+                    "  -c <connections>\t\tSimulated players (default %d).\n"
+                    "  -r <inputs/s>\t\t\tInputs per second of each player (default %d).\n"
+                    "  -d <s>\t\t\tDuration of the run (default %d s).\n"
+                    "  -s <script>\t\t\tInputs played in a loop instead of random ones:\n"
+                    "\t\t\t\th left, l right, j down, k rotate, m rotate back, i drop, . nothing.\n"
+                    "  -v <players>\t\t\tPlay in versus rooms of this many players.\n"
+                    "  -S <server>\t\t\tStart this server binary on the port and measure its CPU.\n"
+                    "  -N <players>\t\t\tSweep from 1 player, doubling up to this many or saturation,\n"
+                    "\t\t\t\teach step lasts 1 s of warm-up and the duration.\n"
+                    "  -L <ms>\t\t\tp99 input latency which ends a sweep (default %d ms).\n"
+                    "  -o <report>\t\t\tWrite the measures as JSON to a file.\n"
+                    "  -h\t\t\t\tPrint help and exit.\n",
+                    prog_name, DEFAULT_CONNECTIONS, DEFAULT_RATE, DEFAULT_DURATION, DEFAULT_P99_LIMIT);
+}
+
+/*! \brief stop the run and print the summary.
+    \param sig    signal which triggered this function.
+*/
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+/*! \brief start the server in a scratch directory and wait until it accepts connections.
+    \param path     server binary.
+    \param port     port to start it on.
+    \return pid of the server, -1 on error.
+*/
+static pid_t spawn_server(const char *path, const char *port)
+{
+    char binary[PATH_MAX];
+    char dir[] = "/tmp/loadgen.XXXXXX";
+
+    /* the server runs in another directory, a relative path has to be made absolute */
+    char cwd[PATH_MAX - 64] = "";
+    if((path[0] != '/' && getcwd(cwd, sizeof(cwd)) == NULL) || mkdtemp(dir) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    (void)snprintf(binary, sizeof(binary), "%s%s%s", cwd, cwd[0] != '\0' ? "/" : "", path);
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        perror("fork()");
+        return -1;
+    }
+    if(pid == 0)
+    {
+        /* its high score log, history and output stay out of the way */
+        int log = -1;
+        if(chdir(dir) != 0 || (log = open("server.log", O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+                dup2(log, STDOUT_FILENO) < 0 || dup2(log, STDERR_FILENO) < 0)
+        {
+            perror(dir);
+            _exit(1);
+        }
+        execl(binary, binary, "-p", port, (char *)NULL);
+        perror(binary);
+        _exit(1);
+    }
+    (void)printf("server %d started in %s\n", (int)pid, dir);
+
+    /* it is ready once a connection goes through */
+    for(int waited = 0; waited < SERVER_START_MS; waited += 20)
+    {
+        int fd = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+        int rc = fd >= 0 ? connect(fd, server->ai_addr, server->ai_addrlen) : -1;
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        if(rc == 0)
+        {
+            return pid;
+        }
+        if(waitpid(pid, NULL, WNOHANG) == pid)
+        {
+            break;
+        }
+        (void)nanosleep(&(struct timespec){ .tv_nsec = 20000000L }, NULL);
+    }
+    (void)fprintf(stderr, "server did not start, cf. %s/server.log\n", dir);
+    (void)kill(pid, SIGKILL);
+    (void)waitpid(pid, NULL, 0);
+
+    return -1;
+}
+
+/*! \brief CPU time used by a process so far, user and system.
+    \param pid  process, -1 if there is none to watch.
+    \return s of CPU, -1 if unknown.
+*/
+static double process_cpu(pid_t pid)
+{
+    char path[64];
+    unsigned long utime = 0;
+    unsigned long stime = 0;
+
+    if(pid <= 0)
+    {
+        return -1.0;
+    }
+    (void)snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL)
+    {
+        return -1.0;
+    }
+    /* fields 14 and 15, after the command name which may hold spaces */
+    int n = fscanf(fp, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    fclose(fp);
+
+    return n == 2 ? (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK) : -1.0;
+}
+
+/*! \brief write the measures of a run or a sweep as JSON.
+    \param path         report file.
+    \param steps        measures.
+    \param count        number of measures.
+    \param input_rate   inputs per second of each player.
+    \return 0 on success, 1 on error.
+*/
+static int write_report(const char *path, const struct step *steps, size_t count, double input_rate)
+{
+    FILE *fp = fopen(path, "w");
+    if(fp == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+    (void)fprintf(fp, "{\n  \"revision\": \"%s\",\n  \"timestamp_ms\": %llu,\n  \"inputs_per_s\": %.0f,\n  \"steps\": [\n",
+            LOADGEN_REVISION, (unsigned long long)epoch_ms(), input_rate);
+    for(size_t i = 0; i < count; i++)
+    {
+        const struct step *st = &steps[i];
+        /* without a server to watch the CPU measures are -1 */
+        double cpu = st->server_cpu;
+        (void)fprintf(fp, "    {\"players\": %zu, \"playing\": %zu, \"seconds\": %.3f, \"sessions\": %llu, \"failed\": %llu, "
+                "\"frames_per_s\": %.1f, \"inputs_per_s\": %.1f, \"bytes_per_s\": %.0f, "
+                "\"latency_ms\": {\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f, \"count\": %llu}, "
+                "\"server_cpu\": %.4f, \"cpu_us_per_session_s\": %.1f, \"cpu_us_per_frame\": %.2f}%s\n",
+                st->conns, st->playing, st->elapsed,
+                (unsigned long long)st->stats.sessions, (unsigned long long)st->stats.failed,
+                (double)st->stats.frames / st->elapsed, (double)st->stats.inputs / st->elapsed, (double)st->stats.bytes / st->elapsed,
+                st->latency[0] / 1e6, st->latency[1] / 1e6, st->latency[2] / 1e6, st->latency[3] / 1e6, (unsigned long long)st->latency[4],
+                cpu >= 0 ? cpu / st->elapsed : -1.0,
+                cpu >= 0 ? 1e6 * cpu / st->elapsed / (double)st->conns : -1.0,
+                cpu >= 0 && st->stats.frames != 0 ? 1e6 * cpu / (double)st->stats.frames : -1.0,
+                i + 1 < count ? "," : "");
+    }
+    (void)fprintf(fp, "  ]\n}\n");
+    if(fclose(fp) != 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*! \brief allow enough open files for all connections.
+    \param needed   file descriptors needed.
+*/
+static void raise_fd_limit(size_t needed)
+{
+    struct rlimit lim;
+
+    if(getrlimit(RLIMIT_NOFILE, &lim) != 0 || lim.rlim_cur >= needed)
+    {
+        return;
+    }
+    lim.rlim_cur = needed < lim.rlim_max ? needed : lim.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &lim) != 0 || lim.rlim_cur < needed)
+    {
+        (void)fprintf(stderr, "only %llu open files allowed\n", (unsigned long long)lim.rlim_cur);
+    }
+}
+
+/*! \brief start a non blocking connection to the server.
+    \param c    connection.
+    \return 0 on success, 1 on error.
+*/
+static int conn_open(struct conn *c)
+{
+    c->fd = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+    if(c->fd < 0)
+    {
+        return 1;
+    }
+    if(fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK) != 0 ||
+            setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) != 0)
+    {
+        return 1;
+    }
+    if(connect(c->fd, server->ai_addr, server->ai_addrlen) != 0 && errno != EINPROGRESS)
+    {
+        return 1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLOUT, .data.u64 = (uint64_t)(c - conns) };
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) != 0)
+    {
+        return 1;
+    }
+    c->state = CONN_CONNECTING;
+    c->rx_len = 0;
+    c->sent = 0;
+    c->acked = 0;
+
+    return 0;
+}
+
+/*! \brief close a connection, a new session is started after one input interval.
+    \param c        connection.
+    \param now      current time.
+    \param failed   the session did not end normally.
+*/
+static void conn_close(struct conn *c, uint64_t now, bool failed)
+{
+    if(c->fd >= 0)
+    {
+        close(c->fd);
+    }
+    if(failed)
+    {
+        stats.failed++;
+    }
+    c->fd = -1;
+    c->state = CONN_IDLE;
+    c->next_input = now + input_interval;
+}
+
+/*! \brief read and handle everything the server sent.
+    \param c    connection.
+    \param now  current time.
+*/
+static void conn_readable(struct conn *c, uint64_t now)
+{
+    while(1)
+    {
+        ssize_t n = recv(c->fd, c->rx + c->rx_len, RX_SIZE - c->rx_len, MSG_DONTWAIT);
+        if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            /* the server closes the connection at the end of the game */
+            conn_close(c, now, c->state != CONN_PLAYING);
+            return;
+        }
+        if(n < 0)
+        {
+            return;
+        }
+        stats.bytes += (uint64_t)n;
+        c->rx_len += (size_t)n;
+
+        size_t pos = 0;
+        while(c->rx_len - pos >= MSG_HEADER_SIZE)
+        {
+            uint16_t len = get_u16(c->rx + pos + 2);
+            if(c->rx_len - pos < MSG_HEADER_SIZE + (size_t)len)
+            {
+                break;
+            }
+            if(conn_message(c, (enum msg_type)c->rx[pos], c->rx + pos + MSG_HEADER_SIZE, len, now) != 0)
+            {
+                conn_close(c, now, c->state != CONN_PLAYING);
+                return;
+            }
+            if(c->state == CONN_IDLE)
+            {
+                return;
+            }
+            pos += MSG_HEADER_SIZE + len;
+        }
+        memmove(c->rx, c->rx + pos, c->rx_len - pos);
+        c->rx_len -= pos;
+    }
+}
+
+/*! \brief handle one message of the server.
+    \param c        connection.
+    \param type     message type.
+    \param data     payload.
+    \param len      payload length.
+    \param now      current time.
+    \return 0 to go on, 1 to close the connection.
+*/
+static int conn_message(struct conn *c, enum msg_type type, const char *data, uint16_t len, uint64_t now)
+{
+    if(type != MSG_FRAME || len < FRAME_MSG_SIZE)
+    {
+        return 0;
+    }
+    stats.frames++;
+
+    if(c->state == CONN_HANDSHAKE)
+    {
+        /* the first frame ends the handshake, any byte starts the game */
+        char start = (char)TET_VOID;
+        if(send(c->fd, &start, 1, MSG_NOSIGNAL) != 1)
+        {
+            return 1;
+        }
+        c->state = CONN_PLAYING;
+        return 0;
+    }
+
+    uint32_t acked = get_u32(data + FRAME_ACK_OFFSET);
+    uint64_t echo = get_u64(data + FRAME_ECHO_OFFSET);
+    if(acked != c->acked && echo != 0)
+    {
+        hist_record(&latency, now - echo);
+    }
+    c->acked = acked;
+
+    enum tet_phase phase = (enum tet_phase)(signed char)data[0];
+    if(phase == TET_LOSE || phase == TET_WIN)
+    {
+        stats.sessions++;
+        conn_close(c, now, false);
+    }
+
+    return 0;
+}
+
+/*! \brief send the next scripted or random input.
+    \param c    connection.
+    \param now  current time.
+    \return 0 on success, 1 on error.
+*/
+static int conn_send_input(struct conn *c, uint64_t now)
+{
+    char data[14];
+
+    data[0] = (char)REQ_INPUT;
+    data[1] = next_input(c);
+    put_u32(data + 2, ++c->sent);
+    put_u64(data + 6, now);
+    if(send(c->fd, data, sizeof(data), MSG_NOSIGNAL) != (ssize_t)sizeof(data))
+    {
+        return 1;
+    }
+    stats.inputs++;
+
+    return 0;
+}
+
+/*! \brief pick the next input of a player.
+    \param c    connection.
+    \return enum tet_input.
+*/
+static char next_input(struct conn *c)
+{
+    /* random players mostly move and turn, an instant drop now and then ends games */
+    static const char random_inputs[] = {
+        TET_LEFT, TET_LEFT, TET_RIGHT, TET_RIGHT, TET_CLOCK, TET_CCLOCK, TET_DOWN, TET_DOWN, TET_DOWN_INSTANT,
+    };
+
+    if(script == NULL || script[0] == '\0')
+    {
+        return random_inputs[(size_t)rand() % sizeof(random_inputs)];
+    }
+    switch(script[c->script_pos++ % strlen(script)])
+    {
+        case 'h':
+            return TET_LEFT;
+        case 'l':
+            return TET_RIGHT;
+        case 'j':
+            return TET_DOWN;
+        case 'k':
+            return TET_CLOCK;
+        case 'm':
+            return TET_CCLOCK;
+        case 'i':
+            return TET_DOWN_INSTANT;
+        default:
+            return TET_VOID;
+    }
+}
+
+/*! \brief print the activity since the previous report.
+    \param elapsed  seconds since the start of the run.
+    \param prev     totals at the previous report.
+    \param period   seconds since the previous report.
+*/
+static void print_stats(double elapsed, const struct stats *prev, double period)
+{
+    size_t playing = 0;
+
+    for(size_t i = 0; i < nb_conns; i++)
+    {
+        playing += conns[i].state == CONN_PLAYING;
+    }
+    (void)printf("t=%.1f playing=%zu sessions=%llu failed=%llu frames/s=%.0f bytes/s=%.0f inputs/s=%.0f\n",
+            elapsed, playing,
+            (unsigned long long)(stats.sessions - prev->sessions), (unsigned long long)(stats.failed - prev->failed),
+            (double)(stats.frames - prev->frames) / period, (double)(stats.bytes - prev->bytes) / period,
+            (double)(stats.inputs - prev->inputs) / period);
+    (void)fflush(stdout);
+}
@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "common.h"
+#include "history.h"
+#include "metrics.h"
+#include "lobby.h"
+
+#define LOBBY_RATING_WEIGHT (4u)    /* the last game counts for a quarter of the rating */
+
+/* players queued in a rating bucket, until the next batch takes them */
+struct shard {
+    pthread_mutex_t lock __attribute__((aligned(64)));
+    pthread_cond_t matched;         /* a ticket of the shard got its room */
+    struct lobby_ticket *queued;
+};
+
+static struct shard shards[LOBBY_SHARDS];
+
+/* owned by the matchmaker: players which were not matched yet, by bucket */
+static struct lobby_ticket *waiting[LOBBY_SHARDS];
+static struct lobby_ticket *batch[CLIENTS_MAX];
+static uint64_t batch_ns;
+static uint64_t budget_ns;
+
+/* players queued or waiting, the matchmaker sleeps while there is none */
+static uint32_t tickets = 0;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+/* written by the matchmaker only */
+static uint64_t rooms_formed = 0;
+static uint64_t rooms_partial = 0;
+static uint64_t players_matched = 0;
+static uint64_t players_widened = 0;
+static uint64_t players_gone = 0;
+static uint64_t wait_ms = 0;
+
+/* ratings, open addressing on the player id */
+static struct {
+    uint64_t player;    /* 0 while the entry is free */
+    uint32_t rating;
+} rated[LOBBY_RATED_PLAYERS];
+static pthread_rwlock_t rated_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void *matchmaker_task(void *ptr);
+
+/*! \brief fold the points of a game into the rating of its player, under the write lock.
+    \param player   player id.
+    \param points   points of the game.
+*/
+static void rate(uint64_t player, uint32_t points)
+{
+    for(size_t k = 0; k < LOBBY_RATED_PLAYERS; k++)
+    {
+        size_t i = (player + k) % LOBBY_RATED_PLAYERS;
+        if(rated[i].player == 0)
+        {
+            rated[i].player = player;
+            rated[i].rating = points;
+            return;
+        }
+        if(rated[i].player == player)
+        {
+            rated[i].rating = (uint32_t)(((uint64_t)rated[i].rating * (LOBBY_RATING_WEIGHT - 1) + points) / LOBBY_RATING_WEIGHT);
+            return;
+        }
+    }
+    /* the table is full, the player keeps the default rating */
+}
+
+int lobby_init(const char *history_dir, uint32_t batch_ms, uint32_t budget_ms)
+{
+    struct history_view v;
+    pthread_t thread;
+
+    if(history_map(history_dir, &v) != 0)
+    {
+        return 1;
+    }
+    for(size_t i = 0; i < v.rows; i++)
+    {
+        rate(v.player[i], v.points[i]);
+    }
+    history_unmap(&v);
+
+    for(size_t i = 0; i < LOBBY_SHARDS; i++)
+    {
+        if(pthread_mutex_init(&shards[i].lock, NULL) != 0 || pthread_cond_init(&shards[i].matched, NULL) != 0)
+        {
+            perror("pthread_mutex_init()");
+            return 1;
+        }
+    }
+    batch_ns = (uint64_t)batch_ms * 1000000;
+    budget_ns = (uint64_t)budget_ms * 1000000;
+    if(pthread_create(&thread, NULL, matchmaker_task, NULL) != 0)
+    {
+        perror("pthread_create()");
+        return 1;
+    }
+    (void)pthread_detach(thread);
+
+    return 0;
+}
+
+void lobby_rate(const struct game_result *results, size_t n)
+{
+    pthread_rwlock_wrlock(&rated_lock);
+    for(size_t i = 0; i < n; i++)
+    {
+        rate(results[i].player, results[i].points);
+    }
+    pthread_rwlock_unlock(&rated_lock);
+}
+
+uint32_t lobby_rating(uint64_t player)
+{
+    uint32_t rating = 0;
+
+    pthread_rwlock_rdlock(&rated_lock);
+    for(size_t k = 0; k < LOBBY_RATED_PLAYERS; k++)
+    {
+        size_t i = (player + k) % LOBBY_RATED_PLAYERS;
+        if(rated[i].player == player || rated[i].player == 0)
+        {
+            rating = rated[i].rating;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&rated_lock);
+
+    return rating;
+}
+
+/* bucket of a rating: its bit length, the last bucket takes the best players */
+static uint32_t rating_shard(uint32_t rating)
+{
+    uint32_t shard = 0;
+
+    while(rating != 0 && shard < LOBBY_SHARDS - 1)
+    {
+        rating >>= 1;
+        shard++;
+    }
+
+    return shard;
+}
+
+uint32_t lobby_play(struct lobby_ticket *t)
+{
+    if(t->size < 2 || t->size > ROOM_PLAYERS_MAX || t->size > CLIENTS_MAX)
+    {
+        return 0;
+    }
+    t->rating = lobby_rating(t->player);
+    t->shard = rating_shard(t->rating);
+    t->queued_at = mono_ns();
+    t->players = 0;
+    t->gone = false;
+
+    struct shard *s = &shards[t->shard];
+    pthread_mutex_lock(&s->lock);
+    t->next = s->queued;
+    s->queued = t;
+    pthread_mutex_unlock(&s->lock);
+
+    /* wake the matchmaker up if it was idle */
+    if(__atomic_fetch_add(&tickets, 1, __ATOMIC_RELAXED) == 0)
+    {
+        pthread_mutex_lock(&idle_lock);
+        (void)pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    while(t->players == 0 && !t->gone)
+    {
+        (void)pthread_cond_wait(&s->matched, &s->lock);
+    }
+    uint32_t players = t->players;
+    pthread_mutex_unlock(&s->lock);
+
+    return players;
+}
+
+/*! \brief start a room for matched players and wake them up.
+    \param members  tickets of the room.
+    \param players  number of tickets.
+    \param now      mono_ns() of the batch.
+*/
+static void form_room(struct lobby_ticket *const members[], uint32_t players, uint64_t now)
+{
+    struct versus *versus[ROOM_PLAYERS_MAX] = {NULL};
+
+    for(uint32_t i = 0; i < players; i++)
+    {
+        versus[i] = members[i]->versus;
+        __atomic_add_fetch(&wait_ms, (now - members[i]->queued_at) / 1000000, __ATOMIC_RELAXED);
+    }
+    (void)versus_start(versus, players);
+    __atomic_add_fetch(&rooms_formed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&players_matched, players, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&tickets, players, __ATOMIC_RELAXED);
+
+    for(uint32_t i = 0; i < players; i++)
+    {
+        /* the ticket belongs to its session again once players is set */
+        struct shard *s = &shards[members[i]->shard];
+        pthread_mutex_lock(&s->lock);
+        members[i]->players = players;
+        (void)pthread_cond_broadcast(&s->matched);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/* same room size, then closest ratings, then first come */
+static int ticket_order(const void *a, const void *b)
+{
+    const struct lobby_ticket *x = *(const struct lobby_ticket *const *)a;
+    const struct lobby_ticket *y = *(const struct lobby_ticket *const *)b;
+
+    if(x->size != y->size)
+    {
+        return x->size < y->size ? -1 : 1;
+    }
+    if(x->rating != y->rating)
+    {
+        return x->rating < y->rating ? -1 : 1;
+    }
+    return x->queued_at < y->queued_at ? -1 : x->queued_at > y->queued_at;
+}
+
+/*! \brief tell whether the connection of a waiting player closed.
+    \param t    ticket.
+    \return true on end of file or error, a player which sent data meanwhile still counts as there.
+*/
+static bool ticket_gone(const struct lobby_ticket *t)
+{
+    char c;
+    ssize_t rc = recv(t->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return rc == 0 || (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+/*! \brief drop the players whose connection closed from the batch and wake their sessions up.
+    \param n    tickets in the batch.
+    \return tickets left in the batch.
+*/
+static size_t drop_gone(size_t n)
+{
+    size_t kept = 0;
+
+    for(size_t i = 0; i < n; i++)
+    {
+        struct lobby_ticket *t = batch[i];
+        if(!ticket_gone(t))
+        {
+            batch[kept++] = t;
+            continue;
+        }
+        __atomic_sub_fetch(&tickets, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&players_gone, 1, __ATOMIC_RELAXED);
+        /* the ticket belongs to its session again once gone is set */
+        struct shard *s = &shards[t->shard];
+        pthread_mutex_lock(&s->lock);
+        t->gone = true;
+        (void)pthread_cond_broadcast(&s->matched);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return kept;
+}
+
+static size_t take_list(struct lobby_ticket *list, size_t n)
+{
+    for(; list != NULL; list = list->next)
+    {
+        batch[n++] = list;
+    }
+
+    return n;
+}
+
+/*! \brief form every room possible, bucket by bucket from the lowest ratings up.
+    \param now  mono_ns() of the batch.
+*/
+static void match(uint64_t now)
+{
+    struct lobby_ticket *carried = NULL;
+
+    for(uint32_t s = 0; s < LOBBY_SHARDS; s++)
+    {
+        pthread_mutex_lock(&shards[s].lock);
+        struct lobby_ticket *queued = shards[s].queued;
+        shards[s].queued = NULL;
+        pthread_mutex_unlock(&shards[s].lock);
+
+        size_t n = take_list(carried, take_list(queued, take_list(waiting[s], 0)));
+        waiting[s] = NULL;
+        carried = NULL;
+        n = drop_gone(n);
+        qsort(batch, n, sizeof(*batch), ticket_order);
+
+        for(size_t i = 0; i < n;)
+        {
+            uint32_t size = batch[i]->size;
+            size_t end = i;
+            uint64_t oldest = now;
+            while(end < n && batch[end]->size == size)
+            {
+                end++;
+            }
+            for(; end - i >= size; i += size)
+            {
+                form_room(&batch[i], size, now);
+            }
+            for(size_t k = i; k < end; k++)
+            {
+                oldest = batch[k]->queued_at < oldest ? batch[k]->queued_at : oldest;
+            }
+            /* the rest of the players have waited long enough, they play with fewer opponents */
+            if(i < end && now - oldest >= (uint64_t)ROOM_FORM_MS * 1000000)
+            {
+                form_room(&batch[i], (uint32_t)(end - i), now);
+                __atomic_add_fetch(&rooms_partial, 1, __ATOMIC_RELAXED);
+                i = end;
+            }
+            for(; i < end; i++)
+            {
+                struct lobby_ticket *t = batch[i];
+                /* one more bucket up for every budget waited */
+                uint64_t waited = now - t->queued_at;
+                uint64_t widen = waited < budget_ns ? 0 : 1 + (waited - budget_ns) / (budget_ns != 0 ? budget_ns : 1);
+                if(s + 1 < LOBBY_SHARDS && s + 1 <= t->shard + widen)
+                {
+                    __atomic_add_fetch(&players_widened, s == t->shard, __ATOMIC_RELAXED);
+                    t->next = carried;
+                    carried = t;
+                }
+                else
+                {
+                    t->next = waiting[s];
+                    waiting[s] = t;
+                }
+            }
+        }
+    }
+}
+
+/*! \brief matchmaker task, forms rooms in batches while players wait.
+    \param ptr    unused.
+*/
+static void *matchmaker_task(void *ptr)
+{
+    struct timespec interval = { .tv_sec = batch_ns / 1000000000, .tv_nsec = batch_ns % 1000000000 };
+
+    (void)ptr;
+
+    while(1)
+    {
+        pthread_mutex_lock(&idle_lock);
+        while(__atomic_load_n(&tickets, __ATOMIC_RELAXED) == 0)
+        {
+            (void)pthread_cond_wait(&idle_cond, &idle_lock);
+        }
+        pthread_mutex_unlock(&idle_lock);
+
+        /* let the joins of a whole interval pile up */
+        (void)nanosleep(&interval, NULL);
+        match(mono_ns());
+    }
+
+    return NULL;
+}
+
+void lobby_write_metrics(FILE *fp)
+{
+    metrics_write_one(fp, "lobby_players_waiting", "Versus players waiting for a room.", 1, __atomic_load_n(&tickets, __ATOMIC_RELAXED));
+    metrics_write_one(fp, "lobby_rooms_total", "Versus rooms formed.", 0, __atomic_load_n(&rooms_formed, __ATOMIC_RELAXED));
+    metrics_write_one(fp, "lobby_partial_rooms_total", "Versus rooms started before they were full.", 0, __atomic_load_n(&rooms_partial, __ATOMIC_RELAXED));
+    metrics_write_one(fp, "lobby_players_matched_total", "Versus players which got a room.", 0, __atomic_load_n(&players_matched, __ATOMIC_RELAXED));
+    metrics_write_one(fp, "lobby_players_widened_total", "Versus players whose search was widened past their rating bucket.", 0, __atomic_load_n(&players_widened, __ATOMIC_RELAXED));
+    metrics_write_one(fp, "lobby_players_gone_total", "Versus players whose connection closed while they waited.", 0, __atomic_load_n(&players_gone, __ATOMIC_RELAXED));
+    metrics_write_one(fp, "lobby_wait_ms_total", "Time matched versus players waited in the lobby.", 0, __atomic_load_n(&wait_ms, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,72 @@
+#ifndef _LOBBY_H_
+#define _LOBBY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "queues.h"
+#include "versus.h"
+
+/* Lobby of the versus players: a player queues with the room size it
+   wants and a rating, the average points of its last games. Queues are
+   sharded by rating bucket so that joins only contend with players of
+   a similar level. A matchmaker thread drains all the shards on a timer
+   and forms every room it can in one batch, from players of the same
+   bucket first. Players which waited longer than the latency budget are
+   also matched with the next bucket up, and after ROOM_FORM_MS a room
+   starts with the players it has. Players whose connection closed while
+   they waited are dropped before each batch. */
+#define LOBBY_SHARDS            (16u)       /* bucket of a rating: its bit length */
+#define LOBBY_BATCH_MS          (100u)
+#define LOBBY_BUDGET_MS         (2000u)
+#define ROOM_FORM_MS            (30000u)
+#define LOBBY_RATED_PLAYERS     (4096u)     /* players with a rating, the others rate 0 */
+
+/* a player waiting in the lobby, owned by its session until it is matched */
+struct lobby_ticket {
+    struct versus *versus;          /* versus state of the session, client id set */
+    int sock;                       /* connection of the player, only looked at */
+    uint64_t player;
+    uint32_t rating;
+    uint32_t size;                  /* players wanted, 2 to ROOM_PLAYERS_MAX */
+    uint32_t shard;
+    uint64_t queued_at;             /* mono_ns() */
+    uint32_t players;               /* 0 until matched, then players of the room */
+    bool gone;                      /* the connection closed before a room was found */
+    struct lobby_ticket *next;
+};
+
+/*! \brief rate the players of the history and start the matchmaker.
+    \param history_dir  history directory, already opened.
+    \param batch_ms     interval between two batches of matches.
+    \param budget_ms    wait after which a player is matched outside its bucket.
+    \return 0 on success, 1 on error.
+*/
+int lobby_init(const char *history_dir, uint32_t batch_ms, uint32_t budget_ms);
+
+/*! \brief update the ratings with finished games, only called by the history writer.
+    \param results  finished games.
+    \param n        number of results.
+*/
+void lobby_rate(const struct game_result *results, size_t n);
+
+/*! \brief rating of a player.
+    \param player   player id.
+    \return average points of its last games, 0 if it has none.
+*/
+uint32_t lobby_rating(uint64_t player);
+
+/*! \brief queue a player and wait until its room starts.
+    \param t    ticket, versus, sock, player and size set.
+    \return number of players the room starts with, 0 if the size is not possible
+            or the player is gone.
+*/
+uint32_t lobby_play(struct lobby_ticket *t);
+
+/*! \brief write the lobby metrics in the Prometheus text format.
+    \param fp   output.
+*/
+void lobby_write_metrics(FILE *fp);
+
+#endif
@@ -0,0 +1,64 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include "mailbox.h"
+
+void mailbox_init(struct mailbox *m)
+{
+    memset(m, 0, sizeof(*m));
+    for(uint64_t i = 0; i < MAILBOX_SIZE; i++)
+    {
+        m->cells[i].seq = i;
+    }
+}
+
+int mailbox_post(struct mailbox *m, const struct garbage *g)
+{
+    uint64_t pos = __atomic_load_n(&m->in, __ATOMIC_RELAXED);
+
+    while(1)
+    {
+        uint64_t seq = __atomic_load_n(&m->cells[pos & (MAILBOX_SIZE - 1)].seq, __ATOMIC_ACQUIRE);
+        if(seq == pos)
+        {
+            /* free for this lap, reserve it */
+            if(__atomic_compare_exchange_n(&m->in, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if(seq < pos)
+        {
+            /* still filled from the previous lap */
+            return 1;
+        }
+        else
+        {
+            pos = __atomic_load_n(&m->in, __ATOMIC_RELAXED);
+        }
+    }
+    m->cells[pos & (MAILBOX_SIZE - 1)].value = *g;
+    __atomic_store_n(&m->cells[pos & (MAILBOX_SIZE - 1)].seq, pos + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+size_t mailbox_take(struct mailbox *m, struct garbage *out, size_t max)
+{
+    size_t n = 0;
+
+    while(n < max)
+    {
+        uint64_t pos = m->out;
+        if(__atomic_load_n(&m->cells[pos & (MAILBOX_SIZE - 1)].seq, __ATOMIC_ACQUIRE) != pos + 1)
+        {
+            break;
+        }
+        out[n++] = m->cells[pos & (MAILBOX_SIZE - 1)].value;
+        /* free the cell for the next lap */
+        __atomic_store_n(&m->cells[pos & (MAILBOX_SIZE - 1)].seq, pos + MAILBOX_SIZE, __ATOMIC_RELEASE);
+        m->out = pos + 1;
+    }
+
+    return n;
+}
@@ -0,0 +1,51 @@
+#ifndef _MAILBOX_H_
+#define _MAILBOX_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MAILBOX_SIZE (64u) /* power of two */
+
+/* Garbage rows sent by a session to another one */
+struct garbage {
+    uint32_t room;      /* room of the sender, messages of another room are stale */
+    uint32_t from;      /* index of the sender in the room */
+    uint32_t seq;       /* attacks of the sender so far */
+    uint8_t rows;
+    uint8_t hole;       /* column left open in the rows */
+};
+
+/* Bounded lock-free queue with any number of producers and a single
+   consumer: producers reserve a cell with a compare-and-swap on in,
+   every cell carries the position it is free or filled for, so that
+   neither side ever takes a lock or waits on the other. */
+struct mailbox {
+    uint64_t in __attribute__((aligned(64)));   /* next position to post, shared by producers */
+    uint64_t out __attribute__((aligned(64)));  /* next position to take, owned by the consumer */
+    struct {
+        uint64_t seq;   /* position when free, position + 1 when filled */
+        struct garbage value;
+    } cells[MAILBOX_SIZE];
+};
+
+/*! \brief empty a mailbox, while no one posts to it.
+    \param m    mailbox.
+*/
+void mailbox_init(struct mailbox *m);
+
+/*! \brief post a message without waiting.
+    \param m    mailbox.
+    \param g    message.
+    \return 0 on success, 1 if the mailbox is full.
+*/
+int mailbox_post(struct mailbox *m, const struct garbage *g);
+
+/*! \brief take the messages posted so far, only called by the consumer.
+    \param m        mailbox.
+    \param out[out] messages in posting order.
+    \param max      size of out.
+    \return number of messages taken.
+*/
+size_t mailbox_take(struct mailbox *m, struct garbage *out, size_t max);
+
+#endif
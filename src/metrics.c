@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "metrics.h"
+
+#define METRICS_PREFIX ("tetris_")
+#define METRICS_BACKLOG (8)
+
+/* counters of one thread, alone on their cache lines */
+struct metrics_slot {
+    uint64_t v[METRIC_COUNT];
+} __attribute__((aligned(64)));
+
+enum metric_kind {
+    KIND_COUNTER,
+    KIND_GAUGE,     /* sum of the slots */
+    KIND_MAX,       /* maximum of the slots */
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    enum metric_kind kind;
+} defs[METRIC_COUNT] = {
+    [METRIC_SESSIONS_ACTIVE] = { "sessions_active", "Sessions in progress.", KIND_GAUGE },
+    [METRIC_SESSIONS] = { "sessions_total", "Sessions started.", KIND_COUNTER },
+    [METRIC_CONNECTIONS_REJECTED] = { "connections_rejected_total", "Connections closed for lack of a free session.", KIND_COUNTER },
+    [METRIC_TICKS] = { "ticks_total", "Substeps run.", KIND_COUNTER },
+    [METRIC_TICK_LAG_NS] = { "tick_lag_ns_total", "Delay of the substeps past their schedule.", KIND_COUNTER },
+    [METRIC_TICK_LAG_MAX_NS] = { "tick_lag_max_ns", "Worst delay of a substep in the running sessions.", KIND_MAX },
+    [METRIC_FRAMES_SENT] = { "frames_sent_total", "Frames sent.", KIND_COUNTER },
+    [METRIC_BYTES_SENT] = { "bytes_sent_total", "Bytes sent to the clients.", KIND_COUNTER },
+    [METRIC_INPUTS] = { "inputs_total", "Game inputs received.", KIND_COUNTER },
+    [METRIC_REQUESTS] = { "requests_total", "Leaderboard requests and pings received.", KIND_COUNTER },
+    [METRIC_LEADERBOARD_WRITES] = { "leaderboard_writes_total", "Results inserted into the leaderboard.", KIND_COUNTER },
+    [METRIC_GARBAGE_SENT] = { "garbage_rows_sent_total", "Garbage rows posted to versus opponents.", KIND_COUNTER },
+    [METRIC_GARBAGE_DROPPED] = { "garbage_dropped_total", "Garbage messages dropped because the mailbox of the opponent was full.", KIND_COUNTER },
+    [METRIC_GARBAGE_RECEIVED] = { "garbage_rows_received_total", "Garbage rows applied to versus games.", KIND_COUNTER },
+    [METRIC_SESSIONS_PARKED] = { "sessions_parked_total", "Sessions parked when their client was gone.", KIND_COUNTER },
+    [METRIC_SESSIONS_RESUMED] = { "sessions_resumed_total", "Parked sessions taken over by a reconnection.", KIND_COUNTER },
+    [METRIC_SESSIONS_EXPIRED] = { "sessions_expired_total", "Parked sessions which ended with their grace period.", KIND_COUNTER },
+    [METRIC_INPUTS_COALESCED] = { "inputs_coalesced_total", "Inputs over their rate limit folded into the same input before.", KIND_COUNTER },
+    [METRIC_INPUTS_DROPPED] = { "inputs_dropped_total", "Other inputs and requests over their rate limit.", KIND_COUNTER },
+    [METRIC_SESSIONS_FLOODING] = { "sessions_flooding_total", "Sessions closed for flooding inputs.", KIND_COUNTER },
+};
+
+static struct metrics_slot *slots = NULL;
+static size_t nb_slots = 0;
+static int listen_fd = -1;
+static void (*extra_metrics)(FILE *fp) = NULL;
+
+static void *metrics_task(void *ptr);
+
+int metrics_init(size_t threads)
+{
+    slots = calloc(threads, sizeof(*slots));
+    if(slots == NULL)
+    {
+        perror("calloc()");
+        return 1;
+    }
+    nb_slots = threads;
+
+    return 0;
+}
+
+void metrics_add(size_t slot, enum metric m, uint64_t n)
+{
+    uint64_t *v = &slots[slot].v[m];
+
+    /* single writer: no read-modify-write instruction needed */
+    __atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void metrics_max(size_t slot, enum metric m, uint64_t value)
+{
+    uint64_t *v = &slots[slot].v[m];
+
+    if(value > __atomic_load_n(v, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(v, value, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_set(size_t slot, enum metric m, uint64_t value)
+{
+    __atomic_store_n(&slots[slot].v[m], value, __ATOMIC_RELAXED);
+}
+
+void metrics_write_one(FILE *fp, const char *name, const char *help, int gauge, uint64_t value)
+{
+    (void)fprintf(fp, "# HELP %s%s %s\n# TYPE %s%s %s\n%s%s %llu\n",
+            METRICS_PREFIX, name, help, METRICS_PREFIX, name, gauge ? "gauge" : "counter",
+            METRICS_PREFIX, name, (unsigned long long)value);
+}
+
+void metrics_write(FILE *fp)
+{
+    for(size_t m = 0; m < METRIC_COUNT; m++)
+    {
+        uint64_t value = 0;
+        for(size_t s = 0; s < nb_slots; s++)
+        {
+            uint64_t v = __atomic_load_n(&slots[s].v[m], __ATOMIC_RELAXED);
+            value = defs[m].kind == KIND_MAX ? (v > value ? v : value) : value + v;
+        }
+        metrics_write_one(fp, defs[m].name, defs[m].help, defs[m].kind != KIND_COUNTER, value);
+    }
+    if(extra_metrics != NULL)
+    {
+        extra_metrics(fp);
+    }
+}
+
+int metrics_serve(const char *path, void (*extra)(FILE *fp))
+{
+    struct sockaddr_un addr;
+    pthread_t thread;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        (void)fprintf(stderr, "%s: path too long for a socket\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    (void)unlink(path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(listen_fd, METRICS_BACKLOG) != 0)
+    {
+        perror(path);
+        return 1;
+    }
+    extra_metrics = extra;
+    if(pthread_create(&thread, NULL, metrics_task, NULL) != 0)
+    {
+        perror("pthread_create()");
+        return 1;
+    }
+    (void)pthread_detach(thread);
+
+    return 0;
+}
+
+/*! \brief answer every scrape with an exposition of the metrics.
+    \param ptr    unused.
+*/
+static void *metrics_task(void *ptr)
+{
+    (void)ptr;
+
+    while(1)
+    {
+        char *text = NULL;
+        size_t len = 0;
+
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd == -1)
+        {
+            perror("accept()");
+            continue;
+        }
+        /* the exposition is built apart, a slow scraper only holds this thread */
+        FILE *fp = open_memstream(&text, &len);
+        if(fp != NULL)
+        {
+            metrics_write(fp);
+            fclose(fp);
+            for(size_t sent = 0; sent < len; )
+            {
+                ssize_t n = send(fd, text + sent, len - sent, MSG_NOSIGNAL);
+                if(n <= 0)
+                {
+                    break;
+                }
+                sent += (size_t)n;
+            }
+            free(text);
+        }
+        close(fd);
+    }
+
+    return NULL;
+}
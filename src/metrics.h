@@ -0,0 +1,86 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* Every thread owns a slot of counters which only it writes, with plain
+   relaxed stores: updating a metric costs no lock and no shared cache
+   line. A scrape sums (or takes the maximum of) the slots with relaxed
+   loads, the values of a scrape are not a consistent snapshot across
+   metrics but each one is exact. */
+enum metric {
+    METRIC_SESSIONS_ACTIVE,         /* gauge, sessions in progress */
+    METRIC_SESSIONS,                /* sessions started */
+    METRIC_CONNECTIONS_REJECTED,    /* connections closed for lack of a free session */
+    METRIC_TICKS,                   /* substeps run */
+    METRIC_TICK_LAG_NS,             /* sum of the delays of substeps past their schedule */
+    METRIC_TICK_LAG_MAX_NS,         /* gauge, worst delay of a substep in the running sessions */
+    METRIC_FRAMES_SENT,
+    METRIC_BYTES_SENT,
+    METRIC_INPUTS,                  /* game inputs received */
+    METRIC_REQUESTS,                /* leaderboard requests and pings received */
+    METRIC_LEADERBOARD_WRITES,      /* results inserted into the leaderboard */
+    METRIC_GARBAGE_SENT,            /* garbage rows posted to opponents */
+    METRIC_GARBAGE_DROPPED,         /* garbage messages dropped on a full mailbox */
+    METRIC_GARBAGE_RECEIVED,        /* garbage rows applied */
+    METRIC_SESSIONS_PARKED,         /* sessions parked when their client was gone */
+    METRIC_SESSIONS_RESUMED,        /* parked sessions taken over by a reconnection */
+    METRIC_SESSIONS_EXPIRED,        /* parked sessions which ended with their grace period */
+    METRIC_INPUTS_COALESCED,        /* inputs over their limit folded into the same input before */
+    METRIC_INPUTS_DROPPED,          /* other inputs and requests over their limit */
+    METRIC_SESSIONS_FLOODING,       /* sessions closed for flooding inputs */
+    METRIC_COUNT
+};
+
+/*! \brief allocate the slots.
+    \param threads  number of slots, one per thread updating metrics.
+    \return 0 on success, 1 on error.
+*/
+int metrics_init(size_t threads);
+
+/*! \brief add to a metric of a slot, only called by the thread owning the slot.
+    \param slot     slot of the calling thread.
+    \param m        metric.
+    \param n        amount, wraps around to subtract from gauges.
+*/
+void metrics_add(size_t slot, enum metric m, uint64_t n);
+
+/*! \brief raise a maximum gauge of a slot, only called by the thread owning the slot.
+    \param slot     slot of the calling thread.
+    \param m        metric.
+    \param value    new value, kept if larger.
+*/
+void metrics_max(size_t slot, enum metric m, uint64_t value);
+
+/*! \brief set a gauge of a slot, only called by the thread owning the slot.
+    \param slot     slot of the calling thread.
+    \param m        metric.
+    \param value    new value.
+*/
+void metrics_set(size_t slot, enum metric m, uint64_t value);
+
+/*! \brief write one metric in the text exposition format.
+    \param fp       destination.
+    \param name     metric name.
+    \param help     description.
+    \param gauge    gauge or counter.
+    \param value    value.
+*/
+void metrics_write_one(FILE *fp, const char *name, const char *help, int gauge, uint64_t value);
+
+/*! \brief write all the metrics, aggregated over the slots, in the text exposition format.
+    \param fp       destination.
+*/
+void metrics_write(FILE *fp);
+
+/*! \brief serve the metrics on a Unix domain socket from a thread of their own:
+    every connection gets one exposition and is closed.
+    \param path     socket path, replaced if it exists.
+    \param extra    writes metrics which are not kept in the slots, may be NULL.
+    \return 0 on success, 1 on error.
+*/
+int metrics_serve(const char *path, void (*extra)(FILE *fp));
+
+#endif
@@ -0,0 +1,165 @@
+/* MAP_ANONYMOUS and the Linux mapping flags */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "metrics.h"
+#include "pool.h"
+
+#define POOL_CACHE_LINE     (64u)
+#define POOL_HUGE_PAGE      (2u * 1024 * 1024)
+#define POOL_NONE           (UINT32_MAX)
+
+static size_t round_up(size_t n, size_t to)
+{
+    return (n + to - 1) / to * to;
+}
+
+/*! \brief map anonymous memory, on huge pages if asked and possible.
+    \param len[in,out]  bytes to map, rounded up to what was mapped.
+    \param flags        enum pool_flags.
+    \param huge[out]    2 on huge pages, 1 with transparent huge pages advised, 0 otherwise.
+    \return mapping, MAP_FAILED on error.
+*/
+static void *map_blocks(size_t *len, int flags, int *huge)
+{
+    int map_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *base = MAP_FAILED;
+
+    *huge = 0;
+#ifdef MAP_POPULATE
+    map_flags |= (flags & POOL_PREFAULT) ? MAP_POPULATE : MAP_NORESERVE;
+#endif
+#ifdef MAP_HUGETLB
+    /* only if huge pages were reserved, and guard pages need small ones */
+    if((flags & POOL_HUGE) && !(flags & POOL_GUARD))
+    {
+        size_t huge_len = round_up(*len, POOL_HUGE_PAGE);
+        base = mmap(NULL, huge_len, PROT_READ | PROT_WRITE, map_flags | MAP_HUGETLB, -1, 0);
+        if(base != MAP_FAILED)
+        {
+            *len = huge_len;
+            *huge = 2;
+            return base;
+        }
+    }
+#endif
+    base = mmap(NULL, *len, PROT_READ | PROT_WRITE, map_flags, -1, 0);
+#ifdef MADV_HUGEPAGE
+    if(base != MAP_FAILED && (flags & POOL_HUGE) && *len >= POOL_HUGE_PAGE &&
+            madvise(base, *len, MADV_HUGEPAGE) == 0)
+    {
+        *huge = 1;
+    }
+#endif
+
+    return base;
+}
+
+int pool_init(struct pool *p, const char *name, size_t size, uint32_t count, int flags)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    memset(p, 0, sizeof(*p));
+    p->name = name;
+    p->count = count;
+    p->size = round_up(size, (flags & POOL_GUARD) ? page : POOL_CACHE_LINE);
+    p->stride = p->size + ((flags & POOL_GUARD) ? page : 0);
+    p->map_len = p->stride * count;
+    p->next = calloc(count, sizeof(*p->next));
+    if(p->next == NULL)
+    {
+        perror("calloc()");
+        return 1;
+    }
+    p->base = map_blocks(&p->map_len, flags, &p->huge);
+    if(p->base == MAP_FAILED)
+    {
+        perror("mmap()");
+        free(p->next);
+        return 1;
+    }
+    for(uint32_t i = 0; i < count; i++)
+    {
+        /* stacks grow down, the guard page sits below the block */
+        if((flags & POOL_GUARD) && mprotect(p->base + i * p->stride, page, PROT_NONE) != 0)
+        {
+            perror("mprotect()");
+            return 1;
+        }
+        p->next[i] = i + 1 < count ? i + 1 : POOL_NONE;
+    }
+    p->free_head = count != 0 ? 0 : POOL_NONE;
+    if(pthread_mutex_init(&p->lock, NULL) != 0)
+    {
+        perror("pthread_mutex_init()");
+        return 1;
+    }
+
+    return 0;
+}
+
+void *pool_alloc(struct pool *p)
+{
+    void *block = NULL;
+
+    pthread_mutex_lock(&p->lock);
+    uint32_t i = p->free_head;
+    if(i != POOL_NONE)
+    {
+        p->free_head = p->next[i];
+        p->in_use++;
+        p->peak = p->in_use > p->peak ? p->in_use : p->peak;
+        block = p->base + i * p->stride + (p->stride - p->size);
+    }
+    else
+    {
+        p->exhausted++;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return block;
+}
+
+void pool_free(struct pool *p, void *block)
+{
+    if(block == NULL)
+    {
+        return;
+    }
+    uint32_t i = (uint32_t)(((unsigned char *)block - p->base) / p->stride);
+
+    pthread_mutex_lock(&p->lock);
+    p->next[i] = p->free_head;
+    p->free_head = i;
+    p->in_use--;
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pool_write_metrics(struct pool *p, FILE *fp)
+{
+    char name[64];
+
+    pthread_mutex_lock(&p->lock);
+    uint32_t in_use = p->in_use;
+    uint32_t peak = p->peak;
+    uint64_t exhausted = p->exhausted;
+    pthread_mutex_unlock(&p->lock);
+
+    (void)snprintf(name, sizeof(name), "pool_%s_blocks", p->name);
+    metrics_write_one(fp, name, "Blocks of the pool.", 1, p->count);
+    (void)snprintf(name, sizeof(name), "pool_%s_block_bytes", p->name);
+    metrics_write_one(fp, name, "Usable bytes of a block of the pool.", 1, p->size);
+    (void)snprintf(name, sizeof(name), "pool_%s_in_use", p->name);
+    metrics_write_one(fp, name, "Blocks of the pool in use.", 1, in_use);
+    (void)snprintf(name, sizeof(name), "pool_%s_in_use_peak", p->name);
+    metrics_write_one(fp, name, "Most blocks of the pool in use at once.", 1, peak);
+    (void)snprintf(name, sizeof(name), "pool_%s_exhausted_total", p->name);
+    metrics_write_one(fp, name, "Allocations which found the pool empty.", 0, exhausted);
+    (void)snprintf(name, sizeof(name), "pool_%s_huge_pages", p->name);
+    metrics_write_one(fp, name, "2 if the pool is mapped on huge pages, 1 if transparent huge pages were advised.", 1, (uint64_t)p->huge);
+}
@@ -0,0 +1,63 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* A pool hands out blocks of one size class from a single mapping made
+   at startup, so that sessions never call malloc() and the memory of a
+   session is known in advance. Allocation and release take a mutex,
+   they happen when sessions start and end, not on the hot path. */
+enum pool_flags {
+    POOL_HUGE = 1,      /* back the mapping with huge pages where available */
+    POOL_PREFAULT = 2,  /* touch all the pages at startup */
+    POOL_GUARD = 4,     /* leave an inaccessible page below every block, for stacks */
+};
+
+struct pool {
+    const char *name;
+    unsigned char *base;
+    size_t size;        /* usable bytes of a block */
+    size_t stride;      /* bytes between blocks, guard page included */
+    size_t map_len;
+    uint32_t count;
+    int huge;           /* 2 if mapped on huge pages, 1 if transparent huge pages were advised */
+    pthread_mutex_t lock;
+    uint32_t *next;     /* free list, one link per block */
+    uint32_t free_head;
+    uint32_t in_use;
+    uint32_t peak;
+    uint64_t exhausted; /* allocations which found the pool empty */
+};
+
+/*! \brief map the blocks of a pool.
+    \param p        pool.
+    \param name     name of the size class in the metrics.
+    \param size     usable bytes of a block, rounded up to a cache line (a page with POOL_GUARD).
+    \param count    number of blocks.
+    \param flags    enum pool_flags.
+    \return 0 on success, 1 on error.
+*/
+int pool_init(struct pool *p, const char *name, size_t size, uint32_t count, int flags);
+
+/*! \brief take a block.
+    \param p    pool.
+    \return block of p->size bytes, NULL if the pool is exhausted.
+*/
+void *pool_alloc(struct pool *p);
+
+/*! \brief give a block back.
+    \param p        pool.
+    \param block    block taken from p, may be NULL.
+*/
+void pool_free(struct pool *p, void *block);
+
+/*! \brief write the utilisation of a pool in the text exposition format.
+    \param p    pool.
+    \param fp   destination.
+*/
+void pool_write_metrics(struct pool *p, FILE *fp);
+
+#endif
@@ -3,83 +3,201 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
-#include "pthread.h"
+#include "queues.h"
 
-#define BUFFER_SIZE 50
+#define BUFFER_SIZE 64 // power of two
 
-static pthread_mutex_t lock;
-static pthread_cond_t nonempty;
-static pthread_cond_t nonfull;
-static uint32_t buffer[BUFFER_SIZE];
-static uint32_t in; // index of next produced item
-static uint32_t out; // index of next item to consume
+// one slot of the ring: seq == position when free, position + 1 when filled
+struct cell {
+  uint64_t seq;
+  struct game_result value;
+};
 
-uint32_t consume(uint32_t *retval) {
-  if(pthread_mutex_lock(&lock) != 0)
+// results which did not fit into the ring, pushed lock-free by producers
+struct spill_node {
+  struct spill_node *next;
+  struct game_result value;
+};
+
+static struct cell buffer[BUFFER_SIZE];
+static uint64_t in __attribute__((aligned(64))); // position of next produced item, shared by producers
+static uint64_t out __attribute__((aligned(64))); // position of next item to consume, owned by the consumer
+static uint32_t sleeping; // consumer waits on the eventfd
+static int wakeup_fd = -1;
+static enum queue_full_policy full_policy;
+static struct spill_node *spill;
+static struct spill_node *spill_fifo; // taken from spill, owned by the consumer
+static uint64_t dropped;
+static uint64_t spilled;
+
+static void wake_consumer(void)
+{
+  uint64_t one = 1;
+
+  // pairs with the fence in wait_nonempty(): either we see the consumer sleeping or it sees our item
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sleeping, __ATOMIC_RELAXED))
   {
-      return 1;
+    (void)write(wakeup_fd, &one, sizeof(one));
   }
-  // while buffer empty wait for 'nonempty'
-  while (in == out) {
-    if(pthread_cond_wait(&nonempty, &lock) != 0)
+}
+
+static void spill_push(const struct game_result *value)
+{
+  struct spill_node *node = malloc(sizeof(*node));
+
+  if (node == NULL)
+  {
+    __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  node->value = *value;
+  node->next = __atomic_load_n(&spill, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&spill, &node->next, node, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  __atomic_add_fetch(&spilled, 1, __ATOMIC_RELAXED);
+}
+
+// move the spilled results back in production order, only called by the consumer
+static size_t spill_drain(struct game_result *retval, size_t max)
+{
+  size_t n = 0;
+
+  if (spill_fifo == NULL)
+  {
+    // take the whole stack at once and reverse it
+    struct spill_node *list = __atomic_exchange_n(&spill, NULL, __ATOMIC_ACQUIRE);
+    while (list != NULL)
     {
-      return 1;
+      struct spill_node *next = list->next;
+      list->next = spill_fifo;
+      spill_fifo = list;
+      list = next;
     }
   }
-  *retval = buffer[out];
-  buffer[out] = 0; // consume element
-  out = (out + 1) % BUFFER_SIZE; // update out "pointer"
-  if(pthread_cond_signal(&nonfull) != 0)
+  while (spill_fifo != NULL && n < max)
   {
-      return 1;
+    struct spill_node *next = spill_fifo->next;
+    retval[n++] = spill_fifo->value;
+    free(spill_fifo);
+    spill_fifo = next;
   }
-  if(pthread_mutex_unlock(&lock) != 0)
+  return n;
+}
+
+static size_t ring_drain(struct game_result *retval, size_t max)
+{
+  size_t n = 0;
+
+  while (n < max)
   {
-      return 1;
+    struct cell *c = &buffer[out & (BUFFER_SIZE - 1)];
+    if (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != out + 1)
+    {
+      break;
+    }
+    retval[n++] = c->value;
+    __atomic_store_n(&c->seq, out + BUFFER_SIZE, __ATOMIC_RELEASE); // free slot for the next lap
+    out++;
   }
+  return n;
+}
 
-  return 0;
+static bool is_empty(void)
+{
+  const struct cell *c = &buffer[out & (BUFFER_SIZE - 1)];
+
+  return __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != out + 1 && spill_fifo == NULL &&
+         __atomic_load_n(&spill, __ATOMIC_ACQUIRE) == NULL;
 }
 
-uint32_t produce(uint32_t value) {
-  if(pthread_mutex_lock(&lock) != 0)
+// block on the eventfd until a producer wakes us up, only while there is nothing to consume
+static uint32_t wait_nonempty(void)
+{
+  uint64_t count;
+
+  __atomic_store_n(&sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  while (is_empty())
   {
-      return 1;
-  }
-  // Wait for non-full buffer
-  while ((in > out && (in - out) == BUFFER_SIZE - 1) ||
-         (in < out && (out - in) == 1)) {
-    if(pthread_cond_wait(&nonfull,&lock) != 0)
+    if (read(wakeup_fd, &count, sizeof(count)) < 0)
     {
+      __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
       return 1;
     }
   }
-  buffer[in] = value;
-  in = (in + 1) % BUFFER_SIZE; // update in "pointer"
-  if(pthread_cond_signal(&nonempty) != 0)
+  __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+  return 0;
+}
+
+uint32_t consume_batch(struct game_result *retval, size_t max, size_t *count) {
+  size_t n = 0;
+
+  while ((n = ring_drain(retval, max)) == 0 && (n = spill_drain(retval, max)) == 0)
   {
-      return 1;
-  }
-  if(pthread_mutex_unlock(&lock) != 0)
+    if (wait_nonempty() != 0)
     {
       return 1;
     }
-    return 0;
+  }
+  *count = n;
+
+  return 0;
 }
-// end::funcs[]
 
-uint32_t init_queue(void)
-{
-    if(pthread_mutex_init(&lock, NULL) != 0)
+uint32_t consume(struct game_result *retval) {
+  size_t n = 0;
+
+  return consume_batch(retval, 1, &n);
+}
+
+uint32_t produce(const struct game_result *value) {
+  while (1)
+  {
+    uint64_t pos = __atomic_load_n(&in, __ATOMIC_RELAXED);
+    struct cell *c = &buffer[pos & (BUFFER_SIZE - 1)];
+    if (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != pos)
     {
-      return 1;
+      if (__atomic_load_n(&in, __ATOMIC_RELAXED) != pos)
+      {
+        continue; // another producer moved on, retry
+      }
+      // ring full: never wait for the consumer
+      if (full_policy == QUEUE_FULL_SPILL)
+      {
+        spill_push(value);
+      }
+      else
+      {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+      }
+      break;
     }
-    if(pthread_cond_init(&nonempty, NULL) != 0)
+    if (__atomic_compare_exchange_n(&in, &pos, pos + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
     {
-      return 1;
+      c->value = *value;
+      __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+      break;
+    }
+  }
+  wake_consumer();
+
+  return 0;
+}
+
+uint32_t init_queue(enum queue_full_policy policy)
+{
+    for (size_t i = 0; i < BUFFER_SIZE; i++)
+    {
+      buffer[i].seq = i;
     }
-    if(pthread_cond_init(&nonfull, NULL) != 0)
+    in = 0;
+    out = 0;
+    full_policy = policy;
+    wakeup_fd = eventfd(0, 0);
+    if (wakeup_fd < 0)
     {
       return 1;
     }
@@ -88,17 +206,31 @@ uint32_t init_queue(void)
 
 uint32_t cleanup_queue(void)
 {
-    if(pthread_cond_destroy(&nonempty) != 0)
-    {
-      return 1;
-    }
-    if(pthread_cond_destroy(&nonfull) != 0)
+    struct game_result value;
+
+    while (spill_drain(&value, 1) > 0)
     {
-      return 1;
+      // drop what is left
     }
-    if(pthread_mutex_destroy(&lock) != 0)
+    if (close(wakeup_fd) != 0)
     {
       return 1;
     }
+    wakeup_fd = -1;
     return 0;
-}
\ No newline at end of file
+}
+
+uint64_t queue_dropped(void)
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+uint64_t queue_spilled(void)
+{
+    return __atomic_load_n(&spilled, __ATOMIC_RELAXED);
+}
+
+uint64_t queue_depth(void)
+{
+    return __atomic_load_n(&in, __ATOMIC_RELAXED) - __atomic_load_n(&out, __ATOMIC_RELAXED);
+}
@@ -2,27 +2,65 @@
 #define _QUEUE_H_
 
 #include <sys/types.h>
+#include <stdint.h>
+#include "common.h"
+
+/* Outcome of a finished game, handed from the game threads to the high score writer */
+struct game_result {
+    uint64_t player;                /* player id, cf. player_id() */
+    uint64_t timestamp;             /* end of the game, ms since the epoch */
+    uint64_t start;                 /* start of the game, ms since the epoch */
+    uint32_t points;                /* points at the end of the game */
+    uint32_t level;                 /* level reached */
+    uint32_t lines;                 /* lines cleared */
+    uint32_t inputs;                /* game inputs received from the player */
+    char name[PLAYER_NAME_LEN];     /* player name */
+};
+
+/* What producers do with results while the queue is full, they never wait */
+enum queue_full_policy {
+    QUEUE_FULL_DROP,    /* drop the result and count it, cf. queue_dropped() */
+    QUEUE_FULL_SPILL,   /* keep the result in an unbounded spill list, cf. queue_spilled() */
+};
 
 /*! \brief initialize a new queue.
+    \param policy   behaviour when the queue is full.
     \return 0 on success, 1 on error.
 */
-uint32_t init_queue(void);
+uint32_t init_queue(enum queue_full_policy policy);
 
 /*! \brief cleanup queue.
     \return 0 on success, 1 on error.
 */
 uint32_t cleanup_queue(void);
 
-/*! \brief get first element in queue.
+/*! \brief get first element in queue, sleeps while the queue is empty.
     \param retval[out]  point where the element will be stored.
     \return 0 on success, 1 on error.
+    \remark single consumer only.
 */
-uint32_t consume(uint32_t *retval);
+uint32_t consume(struct game_result *retval);
+
+/*! \brief get all available elements up to max, sleeps while the queue is empty.
+    \param retval[out]  array where the elements will be stored.
+    \param max          size of retval.
+    \param count[out]   number of elements stored, at least 1.
+    \return 0 on success, 1 on error.
+    \remark single consumer only.
+*/
+uint32_t consume_batch(struct game_result *retval, size_t max, size_t *count);
 
 /*! \brief add element to queue.
     \param value[in]  value to be added to queue.
     \return 0 on success, 1 on error.
 */
-uint32_t produce(uint32_t value);
+uint32_t produce(const struct game_result *value);
+
+/*! \brief statistics of the queue.
+    \return number of results dropped, spilled so far, and results waiting in the ring.
+*/
+uint64_t queue_dropped(void);
+uint64_t queue_spilled(void);
+uint64_t queue_depth(void);
 
 #endif
\ No newline at end of file
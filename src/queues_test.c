@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "queues.h"
+
+#define PRODUCERS   (4)
+#define RESULTS     (5000)      /* per producer */
+#define RING_SIZE   (64)
+#define BATCH       (16)
+#define PAUSE_EVERY (250)       /* results between pauses of a producer, the consumer falls asleep */
+#define WATCHDOG_S  (20)        /* a lost wake up hangs the consumer */
+
+static int failures = 0;
+static int pause_producers = 0;
+static uint8_t seen[PRODUCERS][RESULTS];
+
+static void check(int ok, const char *what)
+{
+    if(!ok)
+    {
+        (void)printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/* producer p sends results 0 to RESULTS - 1 in order, player p, points the rank of the result */
+static void *producer(void *arg)
+{
+    struct game_result r;
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = 200000 };
+
+    memset(&r, 0, sizeof(r));
+    r.player = (uint64_t)(uintptr_t)arg;
+    for(uint32_t k = 0; k < RESULTS; k++)
+    {
+        r.points = k;
+        if(produce(&r) != 0)
+        {
+            check(0, "produce");
+        }
+        if(pause_producers && k % PAUSE_EVERY == PAUSE_EVERY - 1)
+        {
+            (void)nanosleep(&pause, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+static int run_producers(pthread_t threads[PRODUCERS])
+{
+    for(uintptr_t p = 0; p < PRODUCERS; p++)
+    {
+        if(pthread_create(&threads[p], NULL, producer, (void *)p) != 0)
+        {
+            perror("pthread_create()");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void join_producers(pthread_t threads[PRODUCERS])
+{
+    for(size_t p = 0; p < PRODUCERS; p++)
+    {
+        (void)pthread_join(threads[p], NULL);
+    }
+}
+
+/*! \brief consume results until total were received, each exactly once.
+    \param total    results to receive.
+    \param ordered  results of a producer have to come in production order.
+*/
+static void consume_all(size_t total, int ordered)
+{
+    struct game_result batch[BATCH];
+    int64_t last[PRODUCERS];
+    size_t received = 0;
+
+    memset(seen, 0, sizeof(seen));
+    for(size_t p = 0; p < PRODUCERS; p++)
+    {
+        last[p] = -1;
+    }
+    while(received < total)
+    {
+        size_t n = 0;
+        if(consume_batch(batch, BATCH, &n) != 0 || n == 0 || n > BATCH)
+        {
+            check(0, "consume_batch");
+            return;
+        }
+        for(size_t i = 0; i < n; i++)
+        {
+            uint64_t p = batch[i].player;
+            uint32_t k = batch[i].points;
+            if(p >= PRODUCERS || k >= RESULTS || seen[p][k])
+            {
+                check(0, "result received once");
+                continue;
+            }
+            seen[p][k] = 1;
+            check(!ordered || (int64_t)k > last[p], "results of a producer in order");
+            last[p] = k;
+        }
+        received += n;
+    }
+}
+
+int main(void)
+{
+    pthread_t threads[PRODUCERS];
+    uint64_t spilled = 0, dropped = 0;
+
+    (void)alarm(WATCHDOG_S);
+
+    /* no consumer: the ring fills, everything else goes to the spill list */
+    check(init_queue(QUEUE_FULL_SPILL) == 0, "init spill");
+    spilled = queue_spilled();
+    if(run_producers(threads) != 0)
+    {
+        return 1;
+    }
+    join_producers(threads);
+    check(queue_depth() == RING_SIZE, "spill: ring full");
+    check(queue_spilled() - spilled == PRODUCERS * RESULTS - RING_SIZE, "spill: rest spilled");
+    consume_all(PRODUCERS * RESULTS, 1);
+    check(queue_depth() == 0, "spill: ring empty");
+    check(cleanup_queue() == 0, "cleanup spill");
+
+    /* the consumer keeps up and sleeps whenever the producers pause */
+    pause_producers = 1;
+    check(init_queue(QUEUE_FULL_SPILL) == 0, "init concurrent");
+    if(run_producers(threads) != 0)
+    {
+        return 1;
+    }
+    consume_all(PRODUCERS * RESULTS, 0);
+    join_producers(threads);
+    check(queue_depth() == 0, "concurrent: ring empty");
+    check(cleanup_queue() == 0, "cleanup concurrent");
+    pause_producers = 0;
+
+    /* no consumer: what does not fit into the ring is dropped */
+    check(init_queue(QUEUE_FULL_DROP) == 0, "init drop");
+    dropped = queue_dropped();
+    spilled = queue_spilled();
+    if(run_producers(threads) != 0)
+    {
+        return 1;
+    }
+    join_producers(threads);
+    check(queue_dropped() - dropped == PRODUCERS * RESULTS - RING_SIZE, "drop: rest dropped");
+    check(queue_spilled() == spilled, "drop: nothing spilled");
+    consume_all(RING_SIZE, 1);
+    check(cleanup_queue() == 0, "cleanup drop");
+
+    if(failures != 0)
+    {
+        return 1;
+    }
+    (void)printf("queues: all checks passed\n");
+
+    return 0;
+}
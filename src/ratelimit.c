@@ -0,0 +1,70 @@
+#include <stdint.h>
+#include "game.h"
+#include "common.h"
+#include "ratelimit.h"
+
+/* sustained inputs per second and burst of each class */
+static const struct {
+    uint32_t per_second;
+    uint32_t burst;
+} limits[INPUT_CLASSES] = {
+    [INPUT_MOVE] = { 40, 40 },
+    [INPUT_DROP] = { 10, 5 },
+    [INPUT_CONTROL] = { 4, 8 },
+    [INPUT_REQUEST] = { 10, 20 },
+    [INPUT_STRIKE] = { 50, 250 },
+};
+
+void rate_limit_init(struct rate_limit *l, uint64_t now)
+{
+    for(size_t c = 0; c < INPUT_CLASSES; c++)
+    {
+        l->credit[c] = (uint64_t)limits[c].burst * (1000000000 / limits[c].per_second);
+    }
+    l->last = now;
+}
+
+enum input_class input_class(unsigned char input)
+{
+    switch(input)
+    {
+        case TET_VOID:
+        case TET_LEFT:
+        case TET_RIGHT:
+        case TET_DOWN:
+        case TET_CLOCK:
+        case TET_CCLOCK:
+            return INPUT_MOVE;
+        case TET_DOWN_INSTANT:
+            return INPUT_DROP;
+        case REQ_RANK:
+        case REQ_AROUND:
+        case REQ_TOP:
+        case REQ_PING:
+            return INPUT_REQUEST;
+        default:
+            return INPUT_CONTROL;
+    }
+}
+
+int rate_limit_take(struct rate_limit *l, enum input_class c, uint64_t now)
+{
+    /* credit accrues for all the classes at once */
+    if(now > l->last)
+    {
+        for(size_t i = 0; i < INPUT_CLASSES; i++)
+        {
+            uint64_t cap = (uint64_t)limits[i].burst * (1000000000 / limits[i].per_second);
+            l->credit[i] = l->credit[i] + (now - l->last) < cap ? l->credit[i] + (now - l->last) : cap;
+        }
+        l->last = now;
+    }
+    uint64_t cost = 1000000000 / limits[c].per_second;
+    if(l->credit[c] < cost)
+    {
+        return 1;
+    }
+    l->credit[c] -= cost;
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Token buckets limiting what a client can make its session do, one per
+   class of input so that moving fast does not eat into the few restarts
+   or leaderboard requests a player needs. Buckets are kept as nanoseconds
+   of credit: time adds credit up to the burst, each input costs the
+   interval of its class. Inputs over their limit are not applied, and
+   each of them takes from a strike bucket which closes the session of a
+   client flooding long enough to only be an attack. */
+enum input_class {
+    INPUT_MOVE,         /* moves and rotations */
+    INPUT_DROP,         /* instant drops */
+    INPUT_CONTROL,      /* pause, restart, speed changes, cheat */
+    INPUT_REQUEST,      /* leaderboard requests and pings */
+    INPUT_STRIKE,       /* inputs over their limit */
+    INPUT_CLASSES
+};
+
+struct rate_limit {
+    uint64_t credit[INPUT_CLASSES];
+    uint64_t last;      /* when the credit was last topped up */
+};
+
+/*! \brief fill all the buckets.
+    \param l    limits of a session.
+    \param now  mono_ns().
+*/
+void rate_limit_init(struct rate_limit *l, uint64_t now);
+
+/*! \brief class of a game input or request byte.
+    \param input    enum tet_input or enum req_type.
+    \return input class.
+*/
+enum input_class input_class(unsigned char input);
+
+/*! \brief take an input from the bucket of its class.
+    \param l    limits of a session.
+    \param c    input class.
+    \param now  mono_ns(), the same for a whole batch of inputs is fine.
+    \return 0 if the input is within the limit, 1 otherwise.
+*/
+int rate_limit_take(struct rate_limit *l, enum input_class c, uint64_t now);
+
+#endif
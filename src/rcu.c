@@ -0,0 +1,42 @@
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include "rcu.h"
+
+void rcu_init(struct rcu *rcu, void *ptr)
+{
+    memset(rcu, 0, sizeof(*rcu));
+    rcu->epoch = 1;
+    __atomic_store_n(&rcu->ptr, ptr, __ATOMIC_SEQ_CST);
+}
+
+void *rcu_read_lock(struct rcu *rcu, size_t reader)
+{
+    /* announce the epoch we are reading in before looking at the pointer */
+    uint64_t epoch = __atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&rcu->readers[reader].epoch, epoch, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&rcu->ptr, __ATOMIC_SEQ_CST);
+}
+
+void rcu_read_unlock(struct rcu *rcu, size_t reader)
+{
+    __atomic_store_n(&rcu->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+void *rcu_publish(struct rcu *rcu, void *ptr)
+{
+    void *old = __atomic_exchange_n(&rcu->ptr, ptr, __ATOMIC_SEQ_CST);
+    uint64_t epoch = __atomic_add_fetch(&rcu->epoch, 1, __ATOMIC_SEQ_CST);
+
+    /* grace period: wait for readers which entered before the swap */
+    for(size_t i = 0; i < RCU_READERS_MAX; i++)
+    {
+        uint64_t seen;
+        while((seen = __atomic_load_n(&rcu->readers[i].epoch, __ATOMIC_SEQ_CST)) != 0 && seen < epoch)
+        {
+            (void)sched_yield();
+        }
+    }
+
+    return old;
+}
@@ -0,0 +1,50 @@
+#ifndef _RCU_H_
+#define _RCU_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "game.h"
+
+/* One reader slot per client session. */
+#define RCU_READERS_MAX (CLIENTS_MAX)
+
+struct rcu_reader {
+    uint64_t epoch;
+    char pad[64 - sizeof(uint64_t)];
+};
+
+/* A pointer published read-copy-update style: readers never block and
+   the single writer replaces the whole object it points to. */
+struct rcu {
+    void *ptr;
+    uint64_t epoch;
+    struct rcu_reader readers[RCU_READERS_MAX];
+};
+
+/*! \brief initialize a published pointer.
+    \param rcu      published pointer.
+    \param ptr      initial object.
+*/
+void rcu_init(struct rcu *rcu, void *ptr);
+
+/*! \brief enter a read section and get the current object.
+    \param rcu      published pointer.
+    \param reader   reader slot owned by the calling thread.
+    \return current object, valid until rcu_read_unlock().
+*/
+void *rcu_read_lock(struct rcu *rcu, size_t reader);
+
+/*! \brief leave a read section.
+    \param rcu      published pointer.
+    \param reader   reader slot owned by the calling thread.
+*/
+void rcu_read_unlock(struct rcu *rcu, size_t reader);
+
+/*! \brief swap in a new object and wait until no reader can still see the old one.
+    \param rcu      published pointer.
+    \param ptr      new object.
+    \return the old object, which can be freed by the caller.
+*/
+void *rcu_publish(struct rcu *rcu, void *ptr);
+
+#endif
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "replay.h"
+
+#define KEYFRAME_SNAPSHOT_OFFSET (8)
+
+static const unsigned char *segment(const struct replay *r, uint32_t seg)
+{
+    return r->data + REPLAY_HEADER_SIZE + ((size_t)seg * REPLAY_SEGMENT_SIZE);
+}
+
+static const unsigned char *event_at(const struct replay *r, uint32_t event)
+{
+    return segment(r, event / REPLAY_SEGMENT_EVENTS) + REPLAY_KEYFRAME_SIZE +
+            ((event % REPLAY_SEGMENT_EVENTS) * REPLAY_EVENT_SIZE);
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if(n < 0)
+        {
+            perror("write()");
+            return 1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+
+    return 0;
+}
+
+int replay_create(struct replay_writer *w, const char *path, const struct replay_header *h)
+{
+    char header[REPLAY_HEADER_SIZE] = {0};
+
+    w->events = 0;
+    w->len = 0;
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(w->fd == -1)
+    {
+        perror(path);
+        return 1;
+    }
+    memcpy(header, REPLAY_MAGIC, 8);
+    put_u32(header + 8, REPLAY_SEGMENT_EVENTS);
+    put_u32(header + 12, h->substep_ms);
+    put_u64(header + 16, h->seed);
+    put_u64(header + 24, h->start);
+    put_u16(header + 32, FIELD_WIDTH);
+    put_u16(header + 34, FIELD_HEIGHT);
+    memcpy(header + 36, h->name, PLAYER_NAME_LEN);
+    if(write_all(w->fd, (unsigned char *)header, sizeof(header)) != 0)
+    {
+        close(w->fd);
+        w->fd = -1;
+        return 1;
+    }
+
+    return 0;
+}
+
+int replay_record(struct replay_writer *w, size_t game, uint32_t ms, enum replay_event event, uint8_t input)
+{
+    if(w->fd == -1)
+    {
+        return 1;
+    }
+    /* a new segment starts with the snapshot of the game before its first event */
+    if(w->events % REPLAY_SEGMENT_EVENTS == 0)
+    {
+        if(w->len != 0 && write_all(w->fd, w->buf, w->len) != 0)
+        {
+            return 1;
+        }
+        memset(w->buf, 0, REPLAY_KEYFRAME_SIZE);
+        put_u32((char *)w->buf, ms);
+        put_u32((char *)w->buf + 4, w->events);
+        save_game(game, w->buf + KEYFRAME_SNAPSHOT_OFFSET);
+        w->len = REPLAY_KEYFRAME_SIZE;
+    }
+    unsigned char *e = w->buf + w->len;
+    memset(e, 0, REPLAY_EVENT_SIZE);
+    put_u32((char *)e, ms);
+    e[4] = (unsigned char)event;
+    e[5] = input;
+    w->len += REPLAY_EVENT_SIZE;
+    w->events++;
+
+    return 0;
+}
+
+int replay_close(struct replay_writer *w)
+{
+    int rc = 0;
+
+    if(w->fd == -1)
+    {
+        return 0;
+    }
+    if(w->len != 0)
+    {
+        rc = write_all(w->fd, w->buf, w->len);
+    }
+    if(close(w->fd) != 0)
+    {
+        perror("close()");
+        rc = 1;
+    }
+    w->fd = -1;
+
+    return rc;
+}
+
+int replay_from_buffer(struct replay *r, const unsigned char *data, size_t len)
+{
+    const char *header = (const char *)data;
+
+    if(len < REPLAY_HEADER_SIZE || memcmp(header, REPLAY_MAGIC, 8) != 0 ||
+            get_u32(header + 8) != REPLAY_SEGMENT_EVENTS ||
+            get_u16(header + 32) != FIELD_WIDTH || get_u16(header + 34) != FIELD_HEIGHT)
+    {
+        return 1;
+    }
+    r->data = data;
+    r->len = len;
+    r->mapped = false;
+    r->header.substep_ms = get_u32(header + 12);
+    r->header.seed = get_u64(header + 16);
+    r->header.start = get_u64(header + 24);
+    memcpy(r->header.name, header + 36, PLAYER_NAME_LEN);
+    r->header.name[PLAYER_NAME_LEN - 1] = '\0';
+
+    /* only complete events count, the tail of a cut recording is ignored */
+    size_t body = len - REPLAY_HEADER_SIZE;
+    size_t tail = body % REPLAY_SEGMENT_SIZE;
+    size_t events = (body / REPLAY_SEGMENT_SIZE) * REPLAY_SEGMENT_EVENTS;
+    if(tail > REPLAY_KEYFRAME_SIZE)
+    {
+        events += (tail - REPLAY_KEYFRAME_SIZE) / REPLAY_EVENT_SIZE;
+    }
+    r->events = events > UINT32_MAX ? UINT32_MAX : (uint32_t)events;
+
+    return 0;
+}
+
+int replay_open(struct replay *r, const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if(fd == -1)
+    {
+        perror(path);
+        return 1;
+    }
+    if(fstat(fd, &st) != 0)
+    {
+        perror("fstat()");
+        close(fd);
+        return 1;
+    }
+    if(st.st_size < REPLAY_HEADER_SIZE)
+    {
+        (void)fprintf(stderr, "%s: not a recording\n", path);
+        close(fd);
+        return 1;
+    }
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+    {
+        perror("mmap()");
+        return 1;
+    }
+    if(replay_from_buffer(r, data, (size_t)st.st_size) != 0)
+    {
+        (void)fprintf(stderr, "%s: not a recording\n", path);
+        munmap(data, (size_t)st.st_size);
+        return 1;
+    }
+    r->mapped = true;
+
+    return 0;
+}
+
+void replay_unmap(struct replay *r)
+{
+    if(r->mapped)
+    {
+        munmap((void *)r->data, r->len);
+    }
+    r->data = NULL;
+    r->len = 0;
+    r->events = 0;
+    r->mapped = false;
+}
+
+uint32_t replay_event_time(const struct replay *r, uint32_t event)
+{
+    return get_u32((const char *)event_at(r, event));
+}
+
+uint32_t replay_find(const struct replay *r, uint32_t ms)
+{
+    uint32_t lo = 0;
+    uint32_t hi = (r->events + REPLAY_SEGMENT_EVENTS - 1) / REPLAY_SEGMENT_EVENTS;
+
+    /* last segment starting at or before ms, by the time of its keyframe */
+    while(hi - lo > 1)
+    {
+        uint32_t mid = lo + ((hi - lo) / 2);
+        if(get_u32((const char *)segment(r, mid)) <= ms)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    uint32_t event = lo * REPLAY_SEGMENT_EVENTS;
+    while(event < r->events && replay_event_time(r, event) <= ms)
+    {
+        event++;
+    }
+
+    return event;
+}
+
+struct game_state *replay_seek(const struct replay *r, size_t game, uint32_t position)
+{
+    /* substeps replay at the granularity they were recorded with */
+    if(r->events == 0 || set_step_granularity(r->header.substep_ms) != 0)
+    {
+        return NULL;
+    }
+    position = position > r->events ? r->events : position;
+    uint32_t seg = position / REPLAY_SEGMENT_EVENTS;
+    uint32_t last = (r->events - 1) / REPLAY_SEGMENT_EVENTS;
+    seg = seg > last ? last : seg;
+
+    struct game_state *gs = load_game(game, segment(r, seg) + KEYFRAME_SNAPSHOT_OFFSET);
+    if(gs == NULL)
+    {
+        return NULL;
+    }
+    for(uint32_t event = seg * REPLAY_SEGMENT_EVENTS; event < position; event++)
+    {
+        (void)replay_step(r, game, event);
+    }
+
+    return gs;
+}
+
+struct game_state *replay_step(const struct replay *r, size_t game, uint32_t event)
+{
+    const unsigned char *e = event_at(r, event);
+
+    if(e[4] == REPLAY_SUBSTEP)
+    {
+        return handle_substep(game);
+    }
+    if(e[4] == REPLAY_INPUT && e[5] < TET_MAX)
+    {
+        return handle_input(game, (enum tet_input)e[5]);
+    }
+    if(e[4] == REPLAY_GARBAGE)
+    {
+        return add_garbage(game, e[5] & REPLAY_GARBAGE_ROWS_MAX, e[5] >> 4);
+    }
+
+    return NULL;
+}
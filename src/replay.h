@@ -0,0 +1,141 @@
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "game.h"
+#include "common.h"
+
+/* A recording holds every engine step of a game session: the inputs and
+   the substeps, in the order the server applied them. The file is a
+   header followed by fixed size segments, each one made of a keyframe
+   (game snapshot taken before its first event) and REPLAY_SEGMENT_EVENTS
+   events. The keyframe of any position is found by arithmetic on the
+   offset, seeking restores it and replays at most one segment of events.
+   The last segment may be partial, a recording cut by a crash stays
+   readable up to its last complete event. */
+#define REPLAY_MAGIC ("TETREC01")
+#define REPLAY_SEGMENT_EVENTS (64u)
+/* magic, u32 events per segment, u32 substep ms, u64 seed, u64 start of
+   the game in ms since the epoch, u16 field width, u16 field height,
+   player name, padding */
+#define REPLAY_HEADER_SIZE (64)
+/* u32 ms since the start of the game, u8 enum replay_event, u8 input, padding */
+#define REPLAY_EVENT_SIZE (8)
+/* u32 ms of the first event of the segment, u32 its number, snapshot, padding */
+#define REPLAY_KEYFRAME_SIZE (88)
+#define REPLAY_SEGMENT_SIZE (REPLAY_KEYFRAME_SIZE + (REPLAY_SEGMENT_EVENTS * REPLAY_EVENT_SIZE))
+/* Longest recording file name, including the terminating zero */
+#define REPLAY_NAME_LEN (64)
+
+enum replay_event {
+    REPLAY_INPUT = 1,       /* handle_input() with the recorded input */
+    REPLAY_SUBSTEP = 2,     /* handle_substep() */
+    REPLAY_GARBAGE = 3,     /* add_garbage() with the input of REPLAY_GARBAGE_INPUT() */
+};
+
+/* Garbage events carry up to REPLAY_GARBAGE_ROWS_MAX rows and their hole in the input byte */
+#define REPLAY_GARBAGE_ROWS_MAX (15u)
+#define REPLAY_GARBAGE_INPUT(rows, hole) ((uint8_t)((rows) | ((hole) << 4)))
+
+struct replay_header {
+    uint64_t seed;
+    uint64_t start;
+    uint32_t substep_ms;
+    char name[PLAYER_NAME_LEN];
+};
+
+/* Recording of a running session, events are buffered one segment at a time */
+struct replay_writer {
+    int fd;
+    uint32_t events;
+    size_t len;
+    unsigned char buf[REPLAY_SEGMENT_SIZE];
+};
+
+/* Read-only view of a recording, mapped from a file or received */
+struct replay {
+    const unsigned char *data;
+    size_t len;
+    bool mapped;
+    struct replay_header header;
+    uint32_t events;
+};
+
+/*! \brief create a recording.
+    \param w[out]   writer, its fd is -1 on error.
+    \param path     recording file, truncated if it exists.
+    \param h        session parameters.
+    \return 0 on success, 1 on error.
+*/
+int replay_create(struct replay_writer *w, const char *path, const struct replay_header *h);
+
+/*! \brief record an event, before it is applied to the game.
+    \param w        writer.
+    \param game     game slot of the session, snapshot at the start of each segment.
+    \param ms       time of the event since the start of the game.
+    \param event    enum replay_event.
+    \param input    enum tet_input of REPLAY_INPUT events, garbage of REPLAY_GARBAGE events.
+    \return 0 on success, 1 on error.
+*/
+int replay_record(struct replay_writer *w, size_t game, uint32_t ms, enum replay_event event, uint8_t input);
+
+/*! \brief write the buffered events and close the recording.
+    \param w        writer, ignored if it was not created.
+    \return 0 on success, 1 on error.
+*/
+int replay_close(struct replay_writer *w);
+
+/*! \brief map a recording file.
+    \param r[out]   recording.
+    \param path     recording file.
+    \return 0 on success, 1 on error.
+*/
+int replay_open(struct replay *r, const char *path);
+
+/*! \brief use a recording held in memory, the buffer must outlive it.
+    \param r[out]   recording.
+    \param data     content of a recording file.
+    \param len      its length.
+    \return 0 on success, 1 if it is not a recording.
+*/
+int replay_from_buffer(struct replay *r, const unsigned char *data, size_t len);
+
+/*! \brief unmap a recording opened with replay_open().
+    \param r    recording.
+*/
+void replay_unmap(struct replay *r);
+
+/*! \brief time of an event.
+    \param r        recording.
+    \param event    event number, less than r->events.
+    \return ms since the start of the game.
+*/
+uint32_t replay_event_time(const struct replay *r, uint32_t event);
+
+/*! \brief find the position reached at a time.
+    \param r    recording.
+    \param ms   time since the start of the game.
+    \return number of events recorded up to that time.
+*/
+uint32_t replay_find(const struct replay *r, uint32_t ms);
+
+/*! \brief restore the game after a number of events from the nearest keyframe,
+    and set the substep granularity of the recording.
+    \param r            recording.
+    \param game         game slot to play the recording in.
+    \param position     number of events applied, at most r->events.
+    \return game status, NULL if the recording is empty or corrupted.
+*/
+struct game_state *replay_seek(const struct replay *r, size_t game, uint32_t position);
+
+/*! \brief apply the next event to the game.
+    \param r        recording.
+    \param game     game slot, at the position of the event.
+    \param event    event number, less than r->events.
+    \return game status if the event changed it, NULL otherwise.
+*/
+struct game_state *replay_step(const struct replay *r, size_t game, uint32_t event);
+
+#endif
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "game.h"
+#include "common.h"
+
+#define SERVER_DEFAULT_PORT "30102"
+#define SERVER_START_MS     (5000)
+#define RECV_TIMEOUT_MS     (3000)
+#define SETTLE_MS           (200)
+#define MSG_MAX             (1024)
+#define MSGS_MAX            (16)
+
+static struct addrinfo *server = NULL;
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+    if(!ok)
+    {
+        (void)printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+    (void)nanosleep(&ts, NULL);
+}
+
+/*! \brief open a connection to the server, reads time out.
+    \return socket, -1 on error.
+*/
+static int open_connection(void)
+{
+    struct timeval tv = { .tv_sec = RECV_TIMEOUT_MS / 1000, .tv_usec = (RECV_TIMEOUT_MS % 1000) * 1000 };
+    int fd = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(connect(fd, server->ai_addr, server->ai_addrlen) != 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*! \brief start the server in a directory of its own and wait until it accepts connections.
+    \param path     server binary.
+    \param port     port to listen on.
+    \return pid of the server, -1 on error.
+*/
+static pid_t spawn_server(const char *path, const char *port)
+{
+    char binary[PATH_MAX];
+    char dir[] = "/tmp/resume_test.XXXXXX";
+
+    /* the server runs in another directory, a relative path has to be made absolute */
+    char cwd[PATH_MAX - 64] = "";
+    if((path[0] != '/' && getcwd(cwd, sizeof(cwd)) == NULL) || mkdtemp(dir) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    (void)snprintf(binary, sizeof(binary), "%s%s%s", cwd, cwd[0] != '\0' ? "/" : "", path);
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        perror("fork()");
+        return -1;
+    }
+    if(pid == 0)
+    {
+        int log = -1;
+        if(chdir(dir) != 0 || (log = open("server.log", O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+                dup2(log, STDOUT_FILENO) < 0 || dup2(log, STDERR_FILENO) < 0)
+        {
+            perror(dir);
+            _exit(1);
+        }
+        execl(binary, binary, "-p", port, "-d", "10000", (char *)NULL);
+        perror(binary);
+        _exit(1);
+    }
+
+    for(int waited = 0; waited < SERVER_START_MS; waited += 20)
+    {
+        int fd = open_connection();
+        if(fd >= 0)
+        {
+            close(fd);
+            return pid;
+        }
+        sleep_ms(20);
+    }
+    (void)kill(pid, SIGKILL);
+    (void)waitpid(pid, NULL, 0);
+    (void)fprintf(stderr, "server did not start\n");
+
+    return -1;
+}
+
+/*! \brief receive one message.
+    \param sock         socket.
+    \param type[out]    enum msg_type.
+    \param data[out]    MSG_MAX bytes of payload.
+    \return payload length, -1 on error, closed connection or timeout.
+*/
+static int recv_msg(int sock, enum msg_type *type, char data[MSG_MAX])
+{
+    char header[MSG_HEADER_SIZE];
+
+    if(recv_all(sock, header, sizeof(header)) != 0)
+    {
+        return -1;
+    }
+    uint16_t len = get_u16(header + 2);
+    if(len > MSG_MAX || recv_all(sock, data, len) != 0)
+    {
+        return -1;
+    }
+    *type = (enum msg_type)header[0];
+
+    return len;
+}
+
+/*! \brief skip messages until a frame of the given phase.
+    \return 0 once received, 1 otherwise.
+*/
+static int wait_phase(int sock, enum tet_phase phase)
+{
+    char data[MSG_MAX];
+    enum msg_type type;
+
+    for(int i = 0; i < MSGS_MAX; i++)
+    {
+        if(recv_msg(sock, &type, data) < 0)
+        {
+            return 1;
+        }
+        if(type == MSG_FRAME && (signed char)data[0] == phase)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*! \brief receive the flight answering REQ_HELLO or REQ_RESUME.
+    \param sock         socket.
+    \param id[out]      session id.
+    \param token[out]   reconnect token.
+    \param phase[out]   phase of the first frame.
+    \return 0 on success, 1 on error or closed connection.
+*/
+static int recv_flight(int sock, uint32_t *id, uint64_t *token, enum tet_phase *phase)
+{
+    char data[MSG_MAX];
+    enum msg_type type;
+
+    if(recv_msg(sock, &type, data) < 0 || type != MSG_HIGH_SCORES ||
+            recv_msg(sock, &type, data) < (int)SESSION_SIZE || type != MSG_SESSION)
+    {
+        return 1;
+    }
+    *id = get_u32(data);
+    *token = get_u64(data + 24);
+    if(recv_msg(sock, &type, data) < (int)FRAME_SIZE || type != MSG_FRAME)
+    {
+        return 1;
+    }
+    *phase = (enum tet_phase)(signed char)data[0];
+
+    return 0;
+}
+
+static int send_resume(int sock, uint32_t id, uint64_t token)
+{
+    char request[13];
+
+    request[0] = (char)REQ_RESUME;
+    put_u32(request + 1, id);
+    put_u64(request + 5, token);
+
+    return send(sock, request, sizeof(request), 0) != (ssize_t)sizeof(request);
+}
+
+int main(int argc, char *argv[])
+{
+    struct addrinfo hints;
+    char hello[1 + PLAYER_NAME_LEN] = { (char)REQ_HELLO, 'r', 'e', 's', 'u', 'm', 'e' };
+    const char *port = argc > 2 ? argv[2] : SERVER_DEFAULT_PORT;
+    uint32_t id = 0, resumed_id = 0;
+    uint64_t token = 0, resumed_token = 0;
+    enum tet_phase phase = TET_LOSE;
+    char byte = 0;
+    int status = 0;
+    int others[CLIENTS_MAX - 1];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(argc < 2 || getaddrinfo("localhost", port, &hints, &server) != 0)
+    {
+        (void)fprintf(stderr, "Usage: %s <server binary> [<port>]\n", argv[0]);
+        return 1;
+    }
+    if(signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        perror(0);
+        return 1;
+    }
+    pid_t pid = spawn_server(argv[1], port);
+    if(pid < 0)
+    {
+        return 1;
+    }
+
+    /* start a game and pause it */
+    int sock = open_connection();
+    check(sock >= 0 && send(sock, hello, sizeof(hello), 0) == (ssize_t)sizeof(hello), "hello");
+    check(recv_flight(sock, &id, &token, &phase) == 0 && token != 0, "session opened");
+    byte = TET_VOID;
+    check(send(sock, &byte, 1, 0) == 1, "game started");
+    byte = TET_PAUSE;
+    check(send(sock, &byte, 1, 0) == 1 && wait_phase(sock, TET_STOPPED) == 0, "game paused");
+
+    /* every client id is taken, the parked session keeps its own */
+    for(int i = 0; i < CLIENTS_MAX - 1; i++)
+    {
+        uint32_t other_id = 0;
+        uint64_t other_token = 0;
+        others[i] = open_connection();
+        check(others[i] >= 0 && send(others[i], hello, sizeof(hello), 0) == (ssize_t)sizeof(hello) &&
+                recv_flight(others[i], &other_id, &other_token, &phase) == 0, "other session opened");
+    }
+
+    /* drop the connection, the paused session is parked */
+    close(sock);
+    sleep_ms(SETTLE_MS);
+    sock = open_connection();
+    check(sock >= 0 && send_resume(sock, id, token) == 0, "resume sent");
+    check(recv_flight(sock, &resumed_id, &resumed_token, &phase) == 0, "paused session resumed");
+    check(resumed_id == id && resumed_token == token, "same session");
+    check(phase == TET_STOPPED, "resumed paused");
+    check(waitpid(pid, &status, WNOHANG) == 0, "server alive after the resume");
+    for(int i = 0; i < CLIENTS_MAX - 1; i++)
+    {
+        if(others[i] >= 0)
+        {
+            close(others[i]);
+        }
+    }
+
+    /* the game goes on once unpaused */
+    byte = TET_PAUSE;
+    check(send(sock, &byte, 1, 0) == 1 && wait_phase(sock, TET_IN_PROG) == 0, "game unpaused");
+
+    /* a client quitting ends its session, it is not parked, even once its control inputs are limited */
+    char quit[10];
+    memset(quit, TET_FASTER, sizeof(quit) - 1);
+    quit[sizeof(quit) - 1] = 'q';
+    check(send(sock, quit, sizeof(quit), 0) == (ssize_t)sizeof(quit), "quit sent");
+    close(sock);
+    sleep_ms(SETTLE_MS);
+    sock = open_connection();
+    check(sock >= 0 && send_resume(sock, id, token) == 0, "second resume sent");
+    check(recv_flight(sock, &resumed_id, &resumed_token, &phase) != 0, "session of a quitting client not parked");
+    if(sock >= 0)
+    {
+        close(sock);
+    }
+
+    check(waitpid(pid, &status, WNOHANG) == 0, "server alive");
+    (void)kill(pid, SIGKILL);
+    (void)waitpid(pid, NULL, 0);
+    freeaddrinfo(server);
+    if(failures != 0)
+    {
+        return 1;
+    }
+    (void)printf("resume: all checks passed\n");
+
+    return 0;
+}
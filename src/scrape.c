@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DEFAULT_SOCKET  ("./metrics.sock")
+#define TEXT_MAX        (65536)
+
+static void print_usage(const char *prog_name);
+static int scrape(const char *path, int samples_only);
+
+/* Stand-in for a metrics collector: reads the exposition the server
+   serves on its Unix domain socket, once or at an interval. */
+int main(int argc, char *argv[])
+{
+    int c = 0;
+    const char *path = DEFAULT_SOCKET;
+    unsigned int interval = 0;
+    unsigned int count = 1;
+    int samples_only = 0;
+
+    while ( (c = getopt(argc, argv, "hs:i:n:q")) != -1 ) {
+        switch ( c ) {
+            case 's':
+                path = optarg;
+                break;
+
+            case 'i':
+                /* user wants to scrape at an interval */
+                interval = (unsigned int)atoi(optarg);
+                count = 0;
+                break;
+
+            case 'n':
+                count = (unsigned int)atoi(optarg);
+                break;
+
+            case 'q':
+                /* user only wants the samples, not the comments */
+                samples_only = 1;
+                break;
+
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+
+            case '?':
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    for(unsigned int n = 0; count == 0 || n < count; n++)
+    {
+        if(n != 0)
+        {
+            (void)nanosleep(&(struct timespec){ .tv_sec = interval }, NULL);
+            (void)printf("\n");
+        }
+        if(scrape(path, samples_only) != 0)
+        {
+            return 1;
+        }
+        (void)fflush(stdout);
+    }
+
+    return 0;
+}
+
+/*! \brief print usage to sterr
+    \param prog_name    program name string
+*/
+static void print_usage(const char *prog_name)
+{
+    (void)fprintf(stderr, "Usage: %s [-s <socket>] [-i <s>] [-n <count>] [-q] [-h]\n"
+                    "Options:\n"
+                    "  -s <socket>\t\tMetrics socket of the server (default %s).\n"
+                    "  -i <s>\t\tScrape again at this interval.\n"
+                    "  -n <count>\t\tNumber of scrapes (default 1, unlimited with -i).\n"
+                    "  -q\t\t\tOnly print the samples.\n"
+                    "  -h\t\t\tPrint help and exit.\n",
+                    prog_name, DEFAULT_SOCKET);
+}
+
+/*! \brief read one exposition of the metrics and print it.
+    \param path             socket path.
+    \param samples_only     leave the HELP and TYPE comments out.
+    \return 0 on success, 1 on error.
+*/
+static int scrape(const char *path, int samples_only)
+{
+    struct sockaddr_un addr;
+    static char text[TEXT_MAX + 1];
+    size_t len = 0;
+    ssize_t n = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        perror(path);
+        if(fd != -1)
+        {
+            close(fd);
+        }
+        return 1;
+    }
+    /* the server closes the connection after the exposition */
+    while(len < TEXT_MAX && (n = recv(fd, text + len, TEXT_MAX - len, 0)) > 0)
+    {
+        len += (size_t)n;
+    }
+    close(fd);
+    if(n < 0)
+    {
+        perror("recv()");
+        return 1;
+    }
+    text[len] = '\0';
+
+    for(char *line = strtok(text, "\n"); line != NULL; line = strtok(NULL, "\n"))
+    {
+        if(!samples_only || line[0] != '#')
+        {
+            (void)printf("%s\n", line);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include "seqlock.h"
+
+void seqlock_write(struct seqlock *l, uint64_t *words, const void *src, size_t len)
+{
+    uint32_t seq = __atomic_load_n(&l->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&l->seq, seq + 1, __ATOMIC_RELAXED);
+    /* the odd sequence is visible before any of the words changes */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for(size_t i = 0; i < SEQLOCK_WORDS(len); i++)
+    {
+        uint64_t w = 0;
+        memcpy(&w, (const unsigned char *)src + i * sizeof(w), len - i * sizeof(w) < sizeof(w) ? len - i * sizeof(w) : sizeof(w));
+        __atomic_store_n(&words[i], w, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&l->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+uint32_t seqlock_read(const struct seqlock *l, const uint64_t *words, void *dst, size_t len)
+{
+    while(1)
+    {
+        uint32_t seq = __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE);
+        if(seq & 1)
+        {
+            /* the writer may have been preempted in the middle of an update */
+            (void)sched_yield();
+            continue;
+        }
+        for(size_t i = 0; i < SEQLOCK_WORDS(len); i++)
+        {
+            uint64_t w = __atomic_load_n(&words[i], __ATOMIC_RELAXED);
+            memcpy((unsigned char *)dst + i * sizeof(w), &w, len - i * sizeof(w) < sizeof(w) ? len - i * sizeof(w) : sizeof(w));
+        }
+        /* the words are read before the sequence is checked again */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&l->seq, __ATOMIC_RELAXED) == seq)
+        {
+            return seq;
+        }
+    }
+}
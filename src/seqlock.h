@@ -0,0 +1,34 @@
+#ifndef _SEQLOCK_H_
+#define _SEQLOCK_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Words published by a single writer which never waits: the sequence
+   is odd while the writer updates the words, readers copy them and
+   retry if the sequence was odd or moved meanwhile. Words are copied
+   one atomic access at a time, so a torn copy is only ever discarded. */
+#define SEQLOCK_WORDS(size) (((size) + sizeof(uint64_t) - 1) / sizeof(uint64_t))
+
+struct seqlock {
+    uint32_t seq;   /* 0 until the first write */
+};
+
+/*! \brief publish new content, only called by the writer.
+    \param l        seqlock.
+    \param words    published words, SEQLOCK_WORDS(len) of them.
+    \param src      new content.
+    \param len      content length.
+*/
+void seqlock_write(struct seqlock *l, uint64_t *words, const void *src, size_t len);
+
+/*! \brief copy a consistent version of the content, without blocking the writer.
+    \param l        seqlock.
+    \param words    published words, SEQLOCK_WORDS(len) of them.
+    \param dst[out] content.
+    \param len      content length.
+    \return sequence of the version copied, 0 if nothing was published yet.
+*/
+uint32_t seqlock_read(const struct seqlock *l, const uint64_t *words, void *dst, size_t len);
+
+#endif
@@ -3,73 +3,277 @@
 #include <getopt.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
 #include <pthread.h>
 #include <errno.h>
+#include <poll.h>
 #include "game.h"
 #include "queues.h"
 #include "common.h"
+#include "rcu.h"
+#include "leaderboard.h"
+#include "wal.h"
+#include "history.h"
+#include "hist.h"
+#include "replay.h"
+#include "metrics.h"
+#include "trace.h"
+#include "pool.h"
+#include "versus.h"
+#include "lobby.h"
+#include "seqlock.h"
+#include "ratelimit.h"
 
-#define DELAY_MS (10)
 #define NB_HIGH_SCORES_SHOWN (10)
 #define HIGH_SCORE_FILE ("./high_scores.txt")
+#define HIGH_SCORE_LOG  ("./high_scores.wal")
+#define HISTORY_DIR     ("./history")
+#define DEFAULT_SYNC_MS (1000)
+#define RESULTS_BATCH   (32)
 #define DEFAULT_PORT    30001
+#define LB_CAPACITY     (1024)
+#define LB_RANGE_MAX    (50)
+#define FASTOPEN_QUEUE  (16)
+#define LISTEN_BACKLOG  (1024)
+#define CATCHUP_MAX_MS  (100)
+#define DEFAULT_GRACE_MS (30000)
+#define RESUME_TIMEOUT_MS (1000)
+#define INPUTS_PER_WAKEUP (64)
+#define REQ_ARGS_MAX    (13)
+#define SESSION_STACK_SIZE (256 * 1024)
+/* metrics slots of the threads which are not session threads */
+#define METRICS_SLOT_WRITER (CLIENTS_MAX)
+#define METRICS_SLOT_MAIN   (CLIENTS_MAX + 1)
+#define METRICS_SLOTS       (CLIENTS_MAX + 2)
+#define SCORES_MSG_SIZE(count) (MSG_HEADER_SIZE + 8 + ((count) * LB_ENTRY_WIRE_SIZE))
+#define HANDSHAKE_SIZE  (SCORES_MSG_SIZE(NB_HIGH_SCORES_SHOWN) + MSG_HEADER_SIZE + SESSION_SIZE + MSG_HEADER_SIZE + FRAME_MSG_SIZE)
+/* largest message a session encodes into its output buffer */
+#define IO_BUFFER_SIZE  (HANDSHAKE_SIZE > SCORES_MSG_SIZE(LB_RANGE_MAX) ? HANDSHAKE_SIZE : SCORES_MSG_SIZE(LB_RANGE_MAX))
 
 struct client_data_t {
     int socket;
     uint32_t id;
     pthread_t thread;
+    void *stack;                /* stack of the thread, until it is joined */
 };
 
-static uint32_t high_score[NB_HIGH_SCORES_SHOWN] = {0};
-static pthread_mutex_t lock;
+/* state of a game session, owned by the thread of its client */
+struct session_t {
+    int sock;
+    uint32_t id;                /* client id, also the game slot */
+    uint32_t applied;           /* sequence number of the last game input applied */
+    uint64_t echo;              /* client timestamp of that input, echoed in frames */
+    uint64_t ready_at;          /* when the inputs being applied were received */
+    uint64_t applied_at;        /* when the first input not sent in a frame yet was applied */
+    uint64_t started_at;        /* when the game started, events are recorded relative to it */
+    uint32_t lines;             /* lines cleared as of the last engine call, to trace line clears */
+    uint64_t seed;              /* seed of the game */
+    uint64_t token;             /* reconnect token given to the client */
+    unsigned char last_input;   /* last game input applied, over the limit repeats of it are coalesced */
+    struct rate_limit limit;
+    char *out;                  /* IO_BUFFER_SIZE bytes, messages are encoded there */
+    struct versus versus;       /* room of a versus session */
+    struct replay_writer replay;
+    struct hist input_to_apply;
+    struct hist apply_to_send;
+    struct game_result result;
+};
+
+/* state of a session other threads can look at, cf. session_inspect() */
+struct session_view {
+    uint64_t player;
+    uint64_t start;             /* start of the game, ms since the epoch, 0 while no game is played */
+    uint32_t applied;           /* sequence number of the last game input applied */
+    int32_t phase;              /* enum tet_phase */
+    uint32_t points;
+    uint32_t level;
+    uint32_t lines;
+    char name[PLAYER_NAME_LEN];
+    unsigned char snapshot[GAME_SNAPSHOT_SIZE];
+};
+
+/* views published by the session of each client id at every frame, readers never hold it up */
+struct published_view {
+    struct seqlock lock;
+    uint64_t words[SEQLOCK_WORDS(sizeof(struct session_view))];
+} __attribute__((aligned(64)));
+
+static struct published_view views[CLIENTS_MAX];
+
+/* sessions whose client is gone, until a reconnection takes them over or their grace period ends */
+struct parked_t {
+    uint64_t token;             /* 0 while the session of the client id is not parked */
+    int sock;                   /* connection handed over to the session, -1 until then */
+};
+
+static struct parked_t parked[CLIENTS_MAX];
+static pthread_mutex_t parked_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parked_cond;
+static uint32_t grace_ms = DEFAULT_GRACE_MS;
+/* threads reading the request of a connection which came while every client id was taken */
+static uint32_t resumers = 0;
+static int urandom_fd = -1;
+
+/* latency of all finished sessions, exported to latency_file */
+static struct hist latency[2];
+static const char *latency_file = NULL;
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* size classes of the memory of the sessions, mapped at startup */
+static struct pool session_pool;
+static struct pool io_pool;
+static struct pool stack_pool;
+
+/* where sessions are recorded, NULL if they are not */
+static const char *replay_dir = NULL;
+
+/* best scores, encoded once per change as the MSG_HIGH_SCORES message */
+struct high_scores_t {
+    size_t len;
+    char msg[SCORES_MSG_SIZE(NB_HIGH_SCORES_SHOWN)];
+};
+
+/* current high scores, replaced as a whole by the high score writer */
+static struct rcu high_scores;
 
 void *high_score_writer_task(void *ptr);
 void *child_task(void *ptr);
+static void *resume_task(void *ptr);
 static void print_usage(const char *prog_name);
-static int send_data(int sock, struct game_state *gs);
-static int child_process(int sock, uint32_t client_id);
+static size_t encode_frame(char *data, const struct session_t *session, struct game_state *gs);
+static int send_data(struct session_t *session, struct game_state *gs);
+static void publish_view(struct session_t *session, const struct game_state *gs, const char *frame);
+static int session_inspect(uint32_t client_id, struct session_view *view);
+static int child_process(struct session_t *session);
+static int init_pools(void);
 static void finish(int sig);
-static int send_high_scores(int sock);
+static int load_high_scores(uint32_t sync_ms);
+static int replay_high_score(const struct lb_entry *e);
+static int import_high_score_file(void);
+static int publish_high_scores(void);
+static int send_handshake(struct session_t *session, uint64_t seed, struct game_state *gs);
+static int recv_hello(int sock, char name[PLAYER_NAME_LEN]);
+static size_t encode_scores_range(char *data, enum msg_type type, uint32_t first_rank, const struct lb_entry *entries, size_t count);
+static int send_scores_range(struct session_t *session, enum msg_type type, uint32_t first_rank, const struct lb_entry *entries, size_t count);
+static int handle_request(struct session_t *session, unsigned char req, const char *args);
+static int session_send(struct session_t *session, const char *data, size_t len);
+static void write_server_metrics(FILE *fp);
+static int recv_inputs(struct session_t *session, struct game_state **gs);
+static size_t request_args(unsigned char req);
+static int limit_input(struct session_t *session, unsigned char input);
+static int apply_input(struct session_t *session, unsigned char input, struct game_state **gs);
+static void export_latency(struct session_t *session);
+static void record_event(struct session_t *session, enum replay_event event, uint8_t input);
+static void trace_line_clear(struct session_t *session, uint64_t start, const struct game_state *gs);
+static void send_garbage(struct session_t *session);
+static void receive_garbage(struct session_t *session, struct game_state **gs);
+static int send_replay(int sock);
+static uint64_t new_token(uint64_t seed);
+static int park_session(struct session_t *session);
+static int resume_session(struct session_t *session);
+static bool hand_over(int sock, const char args[12]);
 
 int main(int argc, char *argv[])
 {
     char c = 0;
     int sockid = 0;
     int check_port = DEFAULT_PORT;
+    uint32_t sync_ms = DEFAULT_SYNC_MS;
+    enum queue_full_policy full_policy = QUEUE_FULL_SPILL;
     pthread_t thread1;
-    struct client_data_t worker_thread_data[CLIENTS_MAX];
+    const char *metrics_path = NULL;
+    const char *trace_path = NULL;
+    uint32_t batch_ms = LOBBY_BATCH_MS;
+    uint32_t budget_ms = LOBBY_BUDGET_MS;
+    struct client_data_t worker_thread_data[CLIENTS_MAX] = {0};
     struct sockaddr_in6 myaddr, clientaddr;
 
-    /* catch siginnt and cleanup before returning */
-    if (signal(SIGINT, finish) == SIG_ERR) {
-        perror(0);
-        exit(1);
-    }
+    while ( (c = getopt(argc, argv, "hp:s:q:l:r:m:t:g:b:w:d:")) != -1 ) {
+        switch ( c ) {
+            case 'q':
+                /* user passed what to do with results while the queue is full */
+                if(strcmp(optarg, "drop") == 0)
+                {
+                    full_policy = QUEUE_FULL_DROP;
+                }
+                else if(strcmp(optarg, "spill") == 0)
+                {
+                    full_policy = QUEUE_FULL_SPILL;
+                }
+                else
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
 
-    if(pthread_mutex_init(&lock, NULL) != 0)
-    {
-        perror("pthread_mutex_init()");
-        return 1;
-    }
+            case 'l':
+                /* user passed where to export latency histograms */
+                latency_file = optarg;
+                break;
 
-    if(init_queue() != 0)
-    {
-        perror("pthread error");
-        return 1;
-    }
-    int iret1 = pthread_create(&thread1, NULL, high_score_writer_task, NULL);
-    if(iret1 != 0)
-    {
-        perror("ptherad_create()");
-        return 1;
-    }
+            case 'm':
+                /* user passed where to serve the metrics */
+                metrics_path = optarg;
+                break;
+
+            case 'g':
+                /* user passed tick granularity */
+                if(set_step_granularity((uint32_t)atoi(optarg)) != 0)
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'b':
+                /* user passed matchmaking batch interval */
+                batch_ms = (uint32_t)atoi(optarg);
+                if(batch_ms == 0)
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'w':
+                /* user passed matchmaking latency budget */
+                budget_ms = (uint32_t)atoi(optarg);
+                break;
+
+            case 'd':
+                /* user passed how long sessions of disconnected clients are kept */
+                grace_ms = (uint32_t)atoi(optarg);
+                break;
+
+            case 't':
+                /* user passed where to dump traces */
+                trace_path = optarg;
+                break;
+
+            case 'r':
+                /* user passed where to record sessions */
+                replay_dir = optarg;
+                break;
+
+            case 's':
+                /* user passed high score log sync interval */
+                sync_ms = atoi(optarg);
+                if(sync_ms == 0)
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
 
-    while ( (c = getopt(argc, argv, "hp:")) != -1 ) {
-        switch ( c ) {
             case 'p':
                 /* user passed server port */
                 check_port = atoi(optarg);
@@ -93,6 +297,74 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* catch siginnt and cleanup before returning */
+    if (signal(SIGINT, finish) == SIG_ERR) {
+        perror(0);
+        exit(1);
+    }
+
+    /* before any thread is started, they all have to block the toggle signal */
+    if(trace_path != NULL && (trace_init(METRICS_SLOTS, trace_path) != 0 || trace_control() != 0))
+    {
+        return 1;
+    }
+    trace_name_thread(METRICS_SLOT_WRITER, "high score writer");
+    trace_name_thread(METRICS_SLOT_MAIN, "accept");
+
+    if(metrics_init(METRICS_SLOTS) != 0)
+    {
+        return 1;
+    }
+    if(metrics_path != NULL && metrics_serve(metrics_path, write_server_metrics) != 0)
+    {
+        return 1;
+    }
+
+    if(init_pools() != 0)
+    {
+        return 1;
+    }
+    versus_init();
+
+    /* grace periods are on the monotonic clock */
+    pthread_condattr_t cond_attr;
+    if(pthread_condattr_init(&cond_attr) != 0 || pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC) != 0 ||
+            pthread_cond_init(&parked_cond, &cond_attr) != 0)
+    {
+        perror("pthread_cond_init()");
+        return 1;
+    }
+    (void)pthread_condattr_destroy(&cond_attr);
+    urandom_fd = open("/dev/urandom", O_RDONLY);
+
+    if(load_high_scores(sync_ms) != 0)
+    {
+        return 1;
+    }
+
+    if(history_open(HISTORY_DIR) != 0 || lobby_init(HISTORY_DIR, batch_ms, budget_ms) != 0)
+    {
+        return 1;
+    }
+
+    if(replay_dir != NULL && mkdir(replay_dir, 0755) != 0 && errno != EEXIST)
+    {
+        perror(replay_dir);
+        return 1;
+    }
+
+    if(init_queue(full_policy) != 0)
+    {
+        perror("pthread error");
+        return 1;
+    }
+    int iret1 = pthread_create(&thread1, NULL, high_score_writer_task, NULL);
+    if(iret1 != 0)
+    {
+        perror("ptherad_create()");
+        return 1;
+    }
+
     sockid = socket(AF_INET6, SOCK_STREAM, 0);
     if(sockid==-1)
     {
@@ -105,17 +377,35 @@ int main(int argc, char *argv[])
     myaddr.sin6_port=htons(check_port);
     myaddr.sin6_addr=in6addr_any;
     socklen_t my_addr_len=sizeof(myaddr);
+    /* the port of a server which just stopped is still held by its closed connections */
+    if(setsockopt(sockid, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) != 0)
+    {
+        perror("setsockopt(SO_REUSEADDR)");
+    }
     if(bind(sockid, (struct sockaddr*)&myaddr, my_addr_len) == -1)
     {
         perror("bind");
         return 1;
     }
-    if(listen(sockid, 10) == -1)
+    /* let clients which know the server send their hello in the SYN */
+    if(setsockopt(sockid, IPPROTO_TCP, TCP_FASTOPEN, &(int){FASTOPEN_QUEUE}, sizeof(int)) != 0)
+    {
+        perror("setsockopt(TCP_FASTOPEN)");
+    }
+    /* joins come in bursts, do not drop SYNs while the sessions are being started */
+    if(listen(sockid, LISTEN_BACKLOG) == -1)
     {
         perror("listen");
         return 1;
     }
 
+    pthread_attr_t attr;
+    if(pthread_attr_init(&attr) != 0)
+    {
+        perror("pthread_attr_init()");
+        return 1;
+    }
+
     (void)printf("Ready for connection!\n");
 
     while(1)
@@ -126,21 +416,42 @@ int main(int argc, char *argv[])
         int client_id = get_client_id();
         if(client_id != INVALID_CLIENT_ID)
         {
-            worker_thread_data[client_id].socket = tmp_sock;
-            worker_thread_data[client_id].id = client_id;
+            struct client_data_t *data = &worker_thread_data[client_id];
+            /* the previous thread of the id released it on its way out, its stack is free once it is joined */
+            if(data->stack != NULL)
+            {
+                (void)pthread_join(data->thread, NULL);
+                pool_free(&stack_pool, data->stack);
+            }
+            data->socket = tmp_sock;
+            data->id = client_id;
+            data->stack = pool_alloc(&stack_pool);
 
             /* start a new thread for each new client until we reach CLIENTS_MAX */
-            if(pthread_create(&worker_thread_data[client_id].thread, NULL, child_task, &worker_thread_data[client_id]) != 0)
+            if(data->stack == NULL || pthread_attr_setstack(&attr, data->stack, stack_pool.size) != 0 ||
+                    pthread_create(&data->thread, &attr, child_task, data) != 0)
             {
-                close(worker_thread_data[client_id].socket);
+                close(data->socket);
                 perror("ptherad_create()");
                 return 1;
             }
         }
         else
         {
-            close(tmp_sock);
-            (void)printf("no more sessions available...\n");
+            /* parked sessions hold their client id, a client resuming one must not need another */
+            pthread_t thread;
+            if(__atomic_add_fetch(&resumers, 1, __ATOMIC_RELAXED) > CLIENTS_MAX ||
+                    pthread_create(&thread, NULL, resume_task, (void *)(intptr_t)tmp_sock) != 0)
+            {
+                __atomic_sub_fetch(&resumers, 1, __ATOMIC_RELAXED);
+                close(tmp_sock);
+                metrics_add(METRICS_SLOT_MAIN, METRIC_CONNECTIONS_REJECTED, 1);
+                (void)printf("no more sessions available...\n");
+            }
+            else
+            {
+                (void)pthread_detach(thread);
+            }
         }
     }
 
@@ -153,9 +464,25 @@ int main(int argc, char *argv[])
 void *child_task(void *ptr)
 {
     struct client_data_t *data = (struct client_data_t*)ptr;
+    struct session_t *session = pool_alloc(&session_pool);
+    char *out = pool_alloc(&io_pool);
+    int sock = data->socket;
+    int rc = 1;
 
-    int rc = child_process(data->socket, data->id);
-    close(data->socket);
+    /* there is a block of each class per client id */
+    if(session != NULL && out != NULL)
+    {
+        *session = (struct session_t){ .sock = data->socket, .id = data->id, .out = out, .replay = { .fd = -1 } };
+        rc = child_process(session);
+        /* the session may have been resumed on another connection, or handed this one over */
+        sock = session->sock;
+    }
+    pool_free(&io_pool, out);
+    pool_free(&session_pool, session);
+    if(sock >= 0)
+    {
+        close(sock);
+    }
     release_client_id(data->id);
 
     if(rc != 0 && rc != 2)
@@ -166,66 +493,149 @@ void *child_task(void *ptr)
     return NULL;
 }
 
-/*! \brief high score writer task.
-    \param prog_name    program name string
+/*! \brief recover the leaderboard from the high score log and publish the best scores.
+    \param sync_ms  group commit interval of the log.
+    \return 0 on success, 1 on error.
 */
-void *high_score_writer_task(void *ptr) 
+static int load_high_scores(uint32_t sync_ms)
+{
+    if(lb_init(LB_CAPACITY) != 0)
+    {
+        return 1;
+    }
+    if(wal_open(HIGH_SCORE_LOG, sync_ms, replay_high_score) != 0)
+    {
+        return 1;
+    }
+    if(lb_size() == 0 && import_high_score_file() != 0)
+    {
+        return 1;
+    }
+    rcu_init(&high_scores, NULL);
+
+    return publish_high_scores();
+}
+
+/*! \brief add a result recovered from the high score log to the leaderboard.
+    \param e    recovered result.
+    \return 0 on success, 1 on error.
+*/
+static int replay_high_score(const struct lb_entry *e)
+{
+    uint32_t rank = 0;
+
+    return lb_insert(e, &rank);
+}
+
+/*! \brief import the text high score file of older versions into the log.
+    \return 0 on success, 1 on error.
+*/
+static int import_high_score_file(void)
 {
     char * line = NULL;
     size_t len = 0;
     size_t i = 0;
-    uint32_t data_in = 0;
-
-    (void)ptr;
+    uint32_t rank = 0;
 
-    if(pthread_mutex_lock(&lock) != 0)
+    FILE *fp = fopen(HIGH_SCORE_FILE, "r");
+    if(fp == NULL)
     {
-        perror("pthread_mutex_lock()");
-        return NULL;
+        return 0;
     }
-    /* read high score file, sort data and save them to memory */
-    FILE *fp = fopen(HIGH_SCORE_FILE, "r");
-    if(fp != NULL)
+    while (getline(&line, &len, fp) != -1) 
     {
-        while (getline(&line, &len, fp) != -1 && i < NB_HIGH_SCORES_SHOWN) 
+        struct lb_entry e = {0};
+        unsigned long long timestamp = 0;
+
+        /* "<score> <timestamp> <name>", older files only hold the score */
+        int n = sscanf(line, "%u %llu %15s", &e.score, &timestamp, e.name);
+        if(n < 1)
+        {
+            continue;
+        }
+        if(n < 3)
         {
-            high_score[i++] = atoi(line);
+            (void)snprintf(e.name, sizeof(e.name), "legacy-%zu", i);
         }
+        e.timestamp = timestamp;
+        e.player = player_id(e.name);
+        if(lb_insert(&e, &rank) != 0 || wal_append(&e) != 0)
+        {
+            break;
+        }
+        i++;
+    }
 
-        fclose(fp);
+    free(line);
+    fclose(fp);
+    wal_sync();
 
-        bubble_sort(high_score, NB_HIGH_SCORES_SHOWN);
-    }
-    if(pthread_mutex_unlock(&lock) != 0)
+    return 0;
+}
+
+/*! \brief build a new snapshot of the best scores aside and swap it in.
+    \return 0 on success, 1 on error.
+*/
+static int publish_high_scores(void)
+{
+    struct high_scores_t *next = malloc(sizeof(*next));
+    struct lb_entry top[NB_HIGH_SCORES_SHOWN];
+
+    if(next == NULL)
     {
-        perror("pthread_mutex_unlock()");
-        return NULL;
+        perror("malloc()");
+        return 1;
     }
+    size_t count = lb_range(1, NB_HIGH_SCORES_SHOWN, top);
+    next->len = encode_scores_range(next->msg, MSG_HIGH_SCORES, 1, top, count);
+    free(rcu_publish(&high_scores, next));
+
+    return 0;
+}
+
+/*! \brief high score writer task, only writer of the leaderboard and the published high scores.
+    \param ptr    unused.
+*/
+void *high_score_writer_task(void *ptr) 
+{
+    struct game_result data_in[RESULTS_BATCH];
+    size_t count = 0;
+    uint32_t rank = 0;
+
+    (void)ptr;
 
     while(1)
     {
-        if(consume(&data_in) != 0)
+        if(consume_batch(data_in, RESULTS_BATCH, &count) != 0)
         {
             perror("consume error");
             break;
         }
+        (void)history_append(data_in, count);
+        lobby_rate(data_in, count);
 
-        if(pthread_mutex_lock(&lock) != 0)
+        bool changed = false;
+        for(size_t i = 0; i < count; i++)
         {
-            perror("pthread_mutex_lock()");
-            return NULL;
-        }
-        /* if the new value is at least bigger than the lowest high score entry */
-        if(data_in > high_score[NB_HIGH_SCORES_SHOWN - 1])
-        {
-            /* add value and let bubble sort work */
-            high_score[NB_HIGH_SCORES_SHOWN - 1] = data_in;
-            bubble_sort(high_score, NB_HIGH_SCORES_SHOWN);
+            struct lb_entry e = {
+                .player = data_in[i].player,
+                .timestamp = data_in[i].timestamp,
+                .score = data_in[i].points,
+            };
+            memcpy(e.name, data_in[i].name, PLAYER_NAME_LEN);
+            uint64_t start = trace_begin();
+            if(lb_insert(&e, &rank) != 0 || wal_append(&e) != 0)
+            {
+                continue;
+            }
+            trace_end(METRICS_SLOT_WRITER, TRACE_LEADERBOARD, start);
+            metrics_add(METRICS_SLOT_WRITER, METRIC_LEADERBOARD_WRITES, 1);
+            /* only a new entry among the shown ones changes the snapshot */
+            changed |= rank != 0 && rank <= NB_HIGH_SCORES_SHOWN;
         }
-        if(pthread_mutex_unlock(&lock) != 0)
+        if(changed)
         {
-            perror("pthread_mutex_unlock()");
-            return NULL;
+            (void)publish_high_scores();
         }
     }
 
@@ -237,191 +647,1065 @@ void *high_score_writer_task(void *ptr)
 */
 static void print_usage(const char *prog_name)
 {
-    (void)fprintf(stderr, "Usage: %s [-p <port>] [-h]\n"
+    (void)fprintf(stderr, "Usage: %s [-p <port>] [-s <ms>] [-q drop|spill] [-l <file>] [-r <dir>] [-m <socket>] [-t <file>] [-g <ms>] [-b <ms>] [-w <ms>] [-d <ms>] [-h]\n"
                     "Options:\n"
                     "  -p <port>\t\tPort to use.\n"
+                    "  -s <ms>\t\tHigh score log sync interval (default %d ms).\n"
+                    "  -q drop|spill\t\tDrop or spill results while the result queue is full (default spill).\n"
+                    "  -l <file>\t\tExport input latency histograms to a file after each session.\n"
+                    "  -r <dir>\t\tRecord sessions into a directory, they can be streamed to viewers.\n"
+                    "  -m <socket>\t\tServe metrics on a Unix domain socket.\n"
+                    "  -t <file>\t\tTrace while toggled on by SIGUSR1, dump the spans to a file when toggled off.\n"
+                    "  -g <ms>\t\tTick granularity, %d to %d ms (default %d ms).\n"
+                    "  -b <ms>\t\tInterval between two batches of versus matches (default %u ms).\n"
+                    "  -w <ms>\t\tWait after which versus players are matched outside their rating bucket (default %u ms).\n"
+                    "  -d <ms>\t\tKeep the game of a disconnected client this long for it to resume, 0 to end it (default %d ms).\n"
                     "  -h\t\t\tPrint help and exit.\n",
-                    prog_name);
+                    prog_name, DEFAULT_SYNC_MS, STEP_TIME_GRANULARITY_MIN, STEP_TIME_INIT, STEP_TIME_GRANULARITY,
+                    LOBBY_BATCH_MS, LOBBY_BUDGET_MS, DEFAULT_GRACE_MS);
 }
 
-/*! \brief serialize and send game data to client.
-    \param sock     socket to connect to.
+/*! \brief encode a frame message: the rendered game, the inputs applied and the game snapshot.
+    \param data[out]    MSG_HEADER_SIZE + FRAME_MSG_SIZE bytes.
+    \param session      game session.
+    \param gs           game status.
+    \return length of the message.
+*/
+static size_t encode_frame(char *data, const struct session_t *session, struct game_state *gs)
+{
+    uint64_t start = trace_begin();
+
+    put_msg_header(data, MSG_FRAME, FRAME_MSG_SIZE);
+    serialize_data(data + MSG_HEADER_SIZE, gs);
+    put_u32(data + MSG_HEADER_SIZE + FRAME_ACK_OFFSET, session->applied);
+    put_u64(data + MSG_HEADER_SIZE + FRAME_ECHO_OFFSET, session->echo);
+    save_game(session->id, (unsigned char *)data + MSG_HEADER_SIZE + FRAME_SNAPSHOT_OFFSET);
+    trace_end(session->id, TRACE_SERIALIZE, start);
+
+    return MSG_HEADER_SIZE + FRAME_MSG_SIZE;
+}
+
+/*! \brief serialize and send game data to client, and publish it to other threads.
+    \param session  game session.
     \param gs       game status.
 */
-static int send_data(int sock, struct game_state *gs)
+static int send_data(struct session_t *session, struct game_state *gs)
 {
-    char data[FIELD_SIZE + 16] = {0};
-    static struct game_state old_gs = {0};
+    char *data = session->out;
 
-    if(gs == NULL)
-    {
-        serialize_data(data, &old_gs);
-    }
-    else
-    {
-        memcpy(&old_gs, gs, sizeof(struct game_state));
-        serialize_data(data, gs);
-    }
-    
-    if(send(sock, data, FIELD_SIZE + 16, MSG_NOSIGNAL) < 0)
-    {
-        perror("send()");
-        return 1;
-    }
-    return 0;
+    memset(data, 0, MSG_HEADER_SIZE + FRAME_MSG_SIZE);
+    (void)encode_frame(data, session, gs);
+    publish_view(session, gs, data);
+    metrics_add(session->id, METRIC_FRAMES_SENT, 1);
+
+    return session_send(session, data, MSG_HEADER_SIZE + FRAME_MSG_SIZE);
 }
 
-/*! \brief serialize and send high score values, wait until client responds to continue.
-    \param sock     socket to connect to.
-    \return 0 on success, 1 on error.
+/*! \brief publish the state of the session, as of the frame just encoded.
+    \param session  game session.
+    \param gs       game status, NULL once the session has no game anymore.
+    \param frame    frame message encoded for gs.
 */
-static int send_high_scores(int sock)
+static void publish_view(struct session_t *session, const struct game_state *gs, const char *frame)
 {
-    char recv_data = 0;
-    char scores[NB_HIGH_SCORES_SHOWN * 4] = {0};
+    struct session_view view = {0};
 
-    if(pthread_mutex_lock(&lock) != 0)
-    {
-        perror("pthread_mutex_lock()");
-        return 1;
-    }
-    for(size_t i = 0; i < NB_HIGH_SCORES_SHOWN; i++)
-    {
-        scores[i * 4] = (char)high_score[i];
-        scores[(i * 4) + 1] = (char)(high_score[i] >> 8);
-        scores[(i * 4) + 2] = (char)(high_score[i] >> 16);
-        scores[(i * 4) + 3] = (char)(high_score[i] >> 24);
-    }
-    if(pthread_mutex_unlock(&lock) != 0)
+    if(gs != NULL)
     {
-        perror("pthread_mutex_unlock()");
-        return 1;
+        view.player = session->result.player;
+        view.start = session->result.start;
+        view.applied = session->applied;
+        view.phase = (int32_t)gs->phase;
+        view.points = gs->points;
+        view.level = gs->level;
+        view.lines = gs->lines;
+        memcpy(view.name, session->result.name, PLAYER_NAME_LEN);
+        memcpy(view.snapshot, frame + MSG_HEADER_SIZE + FRAME_SNAPSHOT_OFFSET, GAME_SNAPSHOT_SIZE);
     }
+    seqlock_write(&views[session->id].lock, views[session->id].words, &view, sizeof(view));
+}
 
-    if(send(sock, scores, sizeof(scores) / sizeof(scores[0]), MSG_NOSIGNAL) < 0)
+/*! \brief take a consistent copy of the state of a session, from any thread.
+    It never blocks the session, which keeps publishing while it is read.
+    \param client_id    client id of the session.
+    \param view[out]    state as of the last frame sent.
+    \return 0 on success, 1 if the client id plays no game.
+*/
+static int session_inspect(uint32_t client_id, struct session_view *view)
+{
+    if(client_id >= CLIENTS_MAX ||
+            seqlock_read(&views[client_id].lock, views[client_id].words, view, sizeof(*view)) == 0)
     {
-        perror("send()");
         return 1;
     }
 
-    /* block and wait on data from user to continue */
-    if(recv(sock, &recv_data, 1, 0) < 0)
+    return view->start == 0;
+}
+
+/*! \brief send a message to the client and count it.
+    \param session  game session.
+    \param data     message.
+    \param len      message length.
+    \return 0 on success, 1 on error.
+*/
+static int session_send(struct session_t *session, const char *data, size_t len)
+{
+    uint64_t start = trace_begin();
+
+    if(send(session->sock, data, len, MSG_NOSIGNAL) < 0)
     {
-        perror("recv()");
+        perror("send()");
         return 1;
     }
+    trace_end(session->id, TRACE_SEND, start);
+    metrics_add(session->id, METRIC_BYTES_SENT, len);
 
     return 0;
 }
 
-/*! \brief This process is started by the child and handles the game session for each client.
-    \param sock         socket to connect to the client.
-    \param client_id    client id, or game session in use.
-    \return 0 on success, 1 on error.
+/*! \brief encode a range of leaderboard entries as a message.
+    \param data[out]    SCORES_MSG_SIZE(count) bytes.
+    \param type         MSG_HIGH_SCORES or MSG_SCORES_RANGE.
+    \param first_rank   rank of the first entry.
+    \param entries      entries to encode.
+    \param count        number of entries.
+    \return length of the message.
 */
-static int child_process(int sock, uint32_t client_id)
+static size_t encode_scores_range(char *data, enum msg_type type, uint32_t first_rank, const struct lb_entry *entries, size_t count)
 {
-    unsigned char recv_data = 0;
-    int rc = 1;
-    struct game_state *gs = NULL;
-    uint32_t last_handling = time_in_ms();
-
-    /* do not die on broken pipes, but handle and return */
-    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
-        perror(0);
-        exit(1);
-    }
+    size_t len = 8 + (count * LB_ENTRY_WIRE_SIZE);
 
-    if(send_high_scores(sock) != 0)
+    put_msg_header(data, type, (uint16_t)len);
+    put_u32(data + MSG_HEADER_SIZE, first_rank);
+    put_u32(data + MSG_HEADER_SIZE + 4, (uint32_t)count);
+    for(size_t i = 0; i < count; i++)
     {
-        return 1;
+        lb_entry_encode(data + MSG_HEADER_SIZE + 8 + (i * LB_ENTRY_WIRE_SIZE), &entries[i]);
     }
 
-    (void)printf("Client %d is starting a new game!\n", client_id);
-    init_game(client_id);
+    return MSG_HEADER_SIZE + len;
+}
+
+/*! \brief send a range of leaderboard entries.
+    \param session      game session.
+    \param type         MSG_HIGH_SCORES or MSG_SCORES_RANGE.
+    \param first_rank   rank of the first entry.
+    \param entries      entries to send.
+    \param count        number of entries.
+    \return 0 on success, 1 on error.
+*/
+static int send_scores_range(struct session_t *session, enum msg_type type, uint32_t first_rank, const struct lb_entry *entries, size_t count)
+{
+    size_t len = encode_scores_range(session->out, type, first_rank, entries, count);
+
+    return session_send(session, session->out, len);
+}
+
+/*! \brief send the high scores, the session parameters and the first frame in one flight.
+    \param session      game session, its client id is used as reader slot.
+    \param seed         seed of the game.
+    \param gs           initial game status.
+    \return 0 on success, 1 on error.
+*/
+static int send_handshake(struct session_t *session, uint64_t seed, struct game_state *gs)
+{
+    char *data = session->out;
+    const struct high_scores_t *hs = rcu_read_lock(&high_scores, session->id);
+    size_t len = hs->len;
+
+    /* the message is encoded by the writer, only copy it out of the snapshot */
+    memcpy(data, hs->msg, len);
+    rcu_read_unlock(&high_scores, session->id);
+
+    put_msg_header(data + len, MSG_SESSION, SESSION_SIZE);
+    len += MSG_HEADER_SIZE;
+    put_u32(data + len, session->id);
+    put_u16(data + len + 4, FIELD_WIDTH);
+    put_u16(data + len + 6, FIELD_HEIGHT);
+    put_u32(data + len + 8, step_granularity());
+    put_u32(data + len + 12, STEP_TIME_INIT);
+    put_u64(data + len + 16, seed);
+    put_u64(data + len + 24, session->token);
+    len += SESSION_SIZE;
+    len += encode_frame(data + len, session, gs);
+    metrics_add(session->id, METRIC_FRAMES_SENT, 1);
+
+    return session_send(session, data, len);
+}
+
+/*! \brief receive the player name the client opens the session with, after REQ_HELLO.
+    \param sock         socket to connect to.
+    \param name[out]    player name, only printable characters are kept.
+    \return 0 on success, 1 on error.
+*/
+static int recv_hello(int sock, char name[PLAYER_NAME_LEN])
+{
+    if(recv_all(sock, name, PLAYER_NAME_LEN) != 0)
+    {
+        return 1;
+    }
+    clean_player_name(name);
+
+    return 0;
+}
+
+/*! \brief answer a leaderboard request of the client.
+    \param session  game session.
+    \param req      enum req_type received.
+    \param args     arguments of the request, cf. request_args().
+    \return 0 on success, 1 on error.
+*/
+static int handle_request(struct session_t *session, unsigned char req, const char *args)
+{
+    uint64_t player = session->result.player;
+    struct lb_entry entries[LB_RANGE_MAX];
+    uint32_t first_rank = 0;
+    size_t count = 0;
+
+    switch(req)
+    {
+        case REQ_RANK:
+        {
+            char data[MSG_HEADER_SIZE + 8 + LB_ENTRY_WIRE_SIZE] = {0};
+            put_msg_header(data, MSG_RANK, 8 + LB_ENTRY_WIRE_SIZE);
+            if(lb_rank(player, &first_rank, &entries[0]) == 0)
+            {
+                put_u32(data + MSG_HEADER_SIZE, first_rank);
+                lb_entry_encode(data + MSG_HEADER_SIZE + 8, &entries[0]);
+            }
+            put_u32(data + MSG_HEADER_SIZE + 4, (uint32_t)lb_size());
+            return session_send(session, data, sizeof(data));
+        }
+        case REQ_AROUND:
+        {
+            size_t radius = get_u16(args);
+            /* the player stays in the middle of a full range */
+            radius = radius > (LB_RANGE_MAX - 1) / 2 ? (LB_RANGE_MAX - 1) / 2 : radius;
+            count = lb_around(player, radius, LB_RANGE_MAX, entries, &first_rank);
+            break;
+        }
+        case REQ_TOP:
+        {
+            first_rank = get_u32(args);
+            count = get_u16(args + 4);
+            count = lb_range(first_rank, count > LB_RANGE_MAX ? LB_RANGE_MAX : count, entries);
+            first_rank = first_rank == 0 ? 1 : first_rank;
+            break;
+        }
+        default:
+            return 1;
+    }
+
+    return send_scores_range(session, MSG_SCORES_RANGE, first_rank, entries, count);
+}
+
+/*! \brief This process is started by the child and handles the game session for each client.
+    \param session      game session, its socket and client id set.
+    \return 0 on success, 1 on error.
+*/
+static int child_process(struct session_t *session)
+{
+    int sock = session->sock;
+    uint32_t client_id = session->id;
+    unsigned char recv_data = 0;
+    uint8_t players = 0;
+    int rc = 1;
+    struct game_state *gs = NULL;
+    struct game_state last_gs = {0};
+    uint64_t tick_ns = (uint64_t)step_granularity() * 1000000;
+    uint64_t next_tick = 0;
+    uint32_t catchup_max = CATCHUP_MAX_MS / step_granularity() + 1;
+    struct game_result *result = &session->result;
+    char thread_name[TRACE_THREAD_NAME_LEN];
+
+    /* do not die on broken pipes, but handle and return */
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        perror(0);
+        exit(1);
+    }
+
+    /* frames and pongs are small, do not hold them back waiting on acknowledgements */
+    if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) != 0)
+    {
+        perror("setsockopt(TCP_NODELAY)");
+    }
+
+    /* viewers ask for a recording instead of opening a game */
+    if(recv_all(sock, &recv_data, 1) == 0 && recv_data == REQ_REPLAY)
+    {
+        return send_replay(sock);
+    }
+    /* reconnecting clients hand their connection over to their parked session */
+    if(recv_data == REQ_RESUME)
+    {
+        return resume_session(session);
+    }
+    /* versus players name the size of the room they want to play in first */
+    if(recv_data == REQ_VERSUS && recv_all(sock, &players, 1) == 0 && players >= 2)
+    {
+        recv_data = REQ_HELLO;
+    }
+    if(recv_data != REQ_HELLO || recv_hello(sock, result->name) != 0)
+    {
+        (void)printf("Client %d did not say hello, closing!\n", client_id);
+        return 2;
+    }
+    result->player = player_id(result->name);
+    (void)snprintf(thread_name, sizeof(thread_name), "session %d %.12s", client_id, result->name);
+    trace_name_thread(client_id, thread_name);
+
+    /* the client predicts the game with the same seed */
+    uint64_t seed = (epoch_ms() * UINT64_C(0x9E3779B97F4A7C15)) ^ result->player;
+    session->seed = seed;
+    session->token = new_token(seed);
+    seed_game(client_id, seed);
+    init_game(client_id);
+    if(send_handshake(session, seed, handle_input(client_id, TET_VOID)) != 0)
+    {
+        return 2;
+    }
+
+    /* block and wait on data from user to continue */
+    if(recv(sock, &recv_data, 1, 0) <= 0)
+    {
+        return 2;
+    }
+    if(players != 0)
+    {
+        struct lobby_ticket ticket = { .versus = &session->versus, .sock = sock, .player = result->player, .size = players };
+        /* all the games of the room start together */
+        session->versus.client_id = client_id;
+        (void)printf("Client %d (%s) is waiting for %u players\n", client_id, result->name, players);
+        if(lobby_play(&ticket) == 0)
+        {
+            if(ticket.gone)
+            {
+                (void)printf("Client %d left the lobby, closing!\n", client_id);
+            }
+            else
+            {
+                (void)printf("Client %d asked for a versus room of %u players, closing!\n", client_id, players);
+            }
+            return 2;
+        }
+        (void)printf("Client %d (%s) rated %u plays versus %u players\n", client_id, result->name, ticket.rating, ticket.players - 1);
+    }
+
+    (void)printf("Client %d (%s) is starting a new game!\n", client_id, result->name);
+    result->start = epoch_ms();
+    session->started_at = mono_ns();
+    rate_limit_init(&session->limit, session->started_at);
+    next_tick = session->started_at + tick_ns;
+    metrics_add(client_id, METRIC_SESSIONS, 1);
+    metrics_add(client_id, METRIC_SESSIONS_ACTIVE, 1);
+    metrics_set(client_id, METRIC_TICK_LAG_MAX_NS, 0);
+    if(replay_dir != NULL)
+    {
+        char path[256];
+        char file_name[PLAYER_NAME_LEN];
+        struct replay_header header = { .seed = seed, .start = result->start, .substep_ms = step_granularity() };
+        memcpy(header.name, result->name, PLAYER_NAME_LEN);
+        /* names may hold a '/', the recording stays in the directory and can be asked for */
+        memcpy(file_name, result->name, PLAYER_NAME_LEN);
+        for(size_t i = 0; file_name[i] != '\0'; i++)
+        {
+            if(file_name[i] == '/')
+            {
+                file_name[i] = '_';
+            }
+        }
+        (void)snprintf(path, sizeof(path), "%s/%llu-%s.rpl", replay_dir, (unsigned long long)result->start, file_name);
+        if(replay_create(&session->replay, path, &header) == 0)
+        {
+            (void)printf("Client %d is recorded to %s\n", client_id, path);
+        }
+    }
 
     while(1)
     {
-        gs = handle_input(client_id, (enum tet_input)recv_data);
-        if(nanosleep(&(struct timespec){0, DELAY_MS*1000*1000}, NULL) != 0)
+        uint64_t now = mono_ns();
+        struct pollfd pfd = { .fd = session->sock, .events = POLLIN };
+        /* a paused game has no substep to run, only an input wakes it up */
+        bool idle = peek_game(client_id)->phase != TET_IN_PROG;
+
+        /* sleep until the player sends something or the next substep is due, rounded up to the ms */
+        int ready = poll(&pfd, 1, idle ? -1 : now >= next_tick ? 0 : (int)((next_tick - now + 999999) / 1000000));
+        if(ready < 0 && errno != EINTR)
         {
-            perror("nanosleep()");
+            perror("poll()");
             rc = 1; break;
         }
-        if((time_in_ms() - last_handling) > STEP_TIME_GRANULARITY)
+
+        gs = NULL;
+        uint64_t tick = 0;
+        session->ready_at = mono_ns();
+        if(ready > 0 && (rc = recv_inputs(session, &gs)) != 0)
         {
-            gs = handle_substep(client_id);
-            last_handling = time_in_ms();
+            /* flooding costs the client its session, the game ends where it is */
+            if(rc == 3)
+            {
+                (void)printf("Client %d floods its session, closing!\n", client_id);
+                metrics_add(client_id, METRIC_SESSIONS_FLOODING, 1);
+                rc = 2; break;
+            }
+            /* the client quit, there is nothing to resume */
+            if(rc == 1)
+            {
+                rc = 2; break;
+            }
+            /* the client is gone, its game waits for it without advancing */
+            if(rc == 2 && park_session(session) == 0)
+            {
+                next_tick = mono_ns() + tick_ns;
+                continue;
+            }
+            break;
         }
-        if(send_data(sock, gs) != 0)
+        if(idle)
         {
-            rc = 2; break;
+            /* the game time starts again from the input, the pause is not caught up with */
+            next_tick = session->ready_at + tick_ns;
         }
-        if (gs != NULL && (gs->phase == TET_LOSE || gs->phase == TET_WIN)) 
+        /* fixed timestep: every substep due runs, each one advances the game by exactly one tick */
+        now = mono_ns();
+        for(uint32_t n = 0; now >= next_tick; n++)
+        {
+            if(n == catchup_max)
+            {
+                /* do not catch up with a long stall, the game time slips instead */
+                next_tick = now + tick_ns;
+                break;
+            }
+            uint64_t lag_ns = now - next_tick;
+            metrics_add(client_id, METRIC_TICKS, 1);
+            metrics_add(client_id, METRIC_TICK_LAG_NS, lag_ns);
+            metrics_max(client_id, METRIC_TICK_LAG_MAX_NS, lag_ns);
+            receive_garbage(session, &gs);
+            record_event(session, REPLAY_SUBSTEP, 0);
+            uint64_t start = trace_begin();
+            struct game_state *next = handle_substep(client_id);
+            trace_line_clear(session, start, next);
+            send_garbage(session);
+            tick = tick != 0 ? tick : start;
+            gs = next != NULL ? next : gs;
+            next_tick += tick_ns;
+            if(gs != NULL && (gs->phase == TET_LOSE || gs->phase == TET_WIN))
+            {
+                break;
+            }
+        }
+        /* inputs which changed nothing, e.g. a pause, are acknowledged by a frame all the same */
+        if(gs == NULL && session->applied_at != 0)
+        {
+            gs = peek_game(client_id);
+        }
+        /* frames are pushed only when the game changed or inputs were applied */
+        if(gs == NULL)
+        {
+            trace_end(client_id, TRACE_TICK, tick);
+            continue;
+        }
+        last_gs = *gs;
+        if(send_data(session, gs) != 0)
+        {
+            if(park_session(session) != 0)
+            {
+                rc = 2; break;
+            }
+            next_tick = mono_ns() + tick_ns;
+        }
+        trace_end(client_id, TRACE_TICK, tick);
+        if(session->applied_at != 0)
+        {
+            hist_record(&session->apply_to_send, mono_ns() - session->applied_at);
+            session->applied_at = 0;
+        }
+        if (gs->phase == TET_LOSE || gs->phase == TET_WIN)
         {
             (void)printf("Player %s with %u points in level %u.\n",
                     gs->phase == TET_WIN ? "wins" : "loses", gs->points, gs->level);
             rc = 0; break;
         }
-        if(recv(sock, &recv_data, 1, 0) < 0)
+        /* the last player in of a versus room wins */
+        if(versus_won(&session->versus))
         {
-            perror("recv()");
-            rc = 2; break;
+            struct game_state won = *gs;
+            won.phase = TET_WIN;
+            (void)printf("Player wins versus with %u points in level %u.\n", gs->points, gs->level);
+            rc = send_data(session, &won) != 0 ? 2 : 0;
+            break;
         }
-        if(recv_data >= (unsigned char)TET_MAX)
+    }
+    metrics_add(client_id, METRIC_SESSIONS_ACTIVE, (uint64_t)-1);
+    metrics_set(client_id, METRIC_TICK_LAG_MAX_NS, 0);
+    publish_view(session, NULL, NULL);
+    result->points = last_gs.points;
+    result->level = last_gs.level;
+    result->lines = last_gs.lines;
+    result->timestamp = epoch_ms();
+    versus_leave(&session->versus);
+    (void)replay_close(&session->replay);
+    export_latency(session);
+    if(produce(result) != 0)
+    {
+        perror("produce error");
+        rc = 1;
+    }
+    return rc;
+}
+
+/*! \brief apply the inputs and requests the client sent, without blocking.
+    A flood is read INPUTS_PER_WAKEUP at a time, the rest of it waits in the
+    socket until the substeps due ran.
+    \param session      game session, counts the inputs.
+    \param gs[out]      game status if an input changed it, left untouched otherwise.
+    \return 0 on success, 1 if the client ended the session, 2 if its connection
+            is lost, 3 if the client floods the session.
+*/
+static int recv_inputs(struct session_t *session, struct game_state **gs)
+{
+    char args[REQ_ARGS_MAX];
+    unsigned char recv_data = 0;
+    ssize_t n = 0;
+
+    for(uint32_t i = 0; i < INPUTS_PER_WAKEUP; i++)
+    {
+        n = recv(session->sock, &recv_data, 1, MSG_DONTWAIT);
+        if(n != 1)
+        {
+            break;
+        }
+        size_t len = request_args(recv_data);
+        if(len != 0 && recv_all(session->sock, args, len) != 0)
+        {
+            return 2;
+        }
+        unsigned char input = recv_data == REQ_INPUT ? (unsigned char)args[0] : recv_data;
+        if(recv_data == REQ_INPUT)
+        {
+            /* apply_input() counts the input */
+            session->applied = get_u32(args + 1) - 1;
+            session->echo = get_u64(args + 5);
+        }
+        bool request = (recv_data >= REQ_RANK && recv_data <= REQ_TOP) || recv_data == REQ_PING;
+        /* quitting clients send a byte which is no input, no limit may hold it back */
+        if(!request && input >= (unsigned char)TET_MAX)
         {
             (void)printf("Unknown character received, stopping game!\n");
-            rc = 2; break;
+            return 1;
         }
-        if(nanosleep(&(struct timespec){0, DELAY_MS*1000*1000}, NULL) != 0)
+        int limited = limit_input(session, input);
+        if(limited != 0)
         {
-            perror("nanosleep()");
-            rc = 1; break;
+            if(limited == 2)
+            {
+                return 3;
+            }
+            continue;
+        }
+        if(request && recv_data != REQ_PING)
+        {
+            metrics_add(session->id, METRIC_REQUESTS, 1);
+            if(handle_request(session, recv_data, args) != 0)
+            {
+                return 2;
+            }
+        }
+        else if(recv_data == REQ_PING)
+        {
+            char pong[MSG_HEADER_SIZE + 8];
+            put_msg_header(pong, MSG_PONG, 8);
+            memcpy(pong + MSG_HEADER_SIZE, args, 8);
+            metrics_add(session->id, METRIC_REQUESTS, 1);
+            if(session_send(session, pong, sizeof(pong)) != 0)
+            {
+                return 2;
+            }
+        }
+        else if(apply_input(session, input, gs) != 0)
+        {
+            return 1;
         }
     }
-    if(produce(gs->points) != 0)
+    if(n == 0)
     {
-        perror("produce error");
-        rc = 1;
+        return 2;
+    }
+    if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        perror("recv()");
+        return 2;
+    }
+
+    return 0;
+}
+
+/*! \brief length of the arguments following a request byte.
+    \param req      byte received, enum req_type or enum tet_input.
+    \return length of the arguments, at most REQ_ARGS_MAX.
+*/
+static size_t request_args(unsigned char req)
+{
+    switch(req)
+    {
+        case REQ_AROUND:
+            return 2;   /* u16 radius */
+        case REQ_TOP:
+            return 6;   /* u32 first rank, u16 count */
+        case REQ_PING:
+            return 8;   /* u64 timestamp */
+        case REQ_INPUT:
+            return 13;  /* u8 input, u32 sequence number, u64 timestamp */
+        default:
+            return 0;
     }
-    return rc;
+}
+
+/*! \brief check an input or a request against the limit of its class.
+    \param session  game session, its limits are taken from.
+    \param input    enum tet_input or enum req_type.
+    \return 0 to apply it, 1 to skip it, 2 if the client floods the session.
+*/
+static int limit_input(struct session_t *session, unsigned char input)
+{
+    enum input_class c = input_class(input);
+
+    /* every input of a batch was received at once */
+    if(rate_limit_take(&session->limit, c, session->ready_at) == 0)
+    {
+        session->last_input = c != INPUT_REQUEST ? input : session->last_input;
+        return 0;
+    }
+    if(c != INPUT_REQUEST)
+    {
+        /* a skipped game input still takes its number, the next frame acknowledges it */
+        session->applied++;
+    }
+    /* repeats of the last input fold into it, e.g. a held key */
+    metrics_add(session->id, c != INPUT_REQUEST && input == session->last_input ?
+            METRIC_INPUTS_COALESCED : METRIC_INPUTS_DROPPED, 1);
+
+    return rate_limit_take(&session->limit, INPUT_STRIKE, session->ready_at) == 0 ? 1 : 2;
+}
+
+/*! \brief apply one game input and record how long it waited.
+    \param session      game session, counts the inputs.
+    \param input        enum tet_input received.
+    \param gs[out]      game status if the input changed it, left untouched otherwise.
+    \return 0 on success, 1 on an unknown input.
+*/
+static int apply_input(struct session_t *session, unsigned char input, struct game_state **gs)
+{
+    struct game_result *result = &session->result;
+
+    if(input >= (unsigned char)TET_MAX)
+    {
+        (void)printf("Unknown character received, stopping game!\n");
+        return 1;
+    }
+    if(input == TET_RESTART)
+    {
+        result->start = epoch_ms();
+        result->inputs = 0;
+    }
+    else if(input != TET_VOID)
+    {
+        result->inputs++;
+    }
+    metrics_add(session->id, METRIC_INPUTS, 1);
+    /* versus games can neither be paused nor restarted */
+    if(session->versus.room != NULL && (input == TET_PAUSE || input == TET_RESTART))
+    {
+        input = TET_VOID;
+    }
+    record_event(session, REPLAY_INPUT, input);
+    uint64_t start = trace_begin();
+    struct game_state *next = handle_input(session->id, (enum tet_input)input);
+    trace_end(session->id, TRACE_INPUT, start);
+    trace_line_clear(session, start, next);
+    send_garbage(session);
+    *gs = next != NULL ? next : *gs;
+    session->applied++;
+
+    uint64_t now = mono_ns();
+    hist_record(&session->input_to_apply, now - session->ready_at);
+    session->applied_at = session->applied_at != 0 ? session->applied_at : now;
+
+    return 0;
+}
+
+/*! \brief record a game event of the session, if it is recorded.
+    \param session      game session.
+    \param event        enum replay_event, about to be applied.
+    \param input        enum tet_input of REPLAY_INPUT events.
+*/
+static void record_event(struct session_t *session, enum replay_event event, uint8_t input)
+{
+    if(session->replay.fd == -1)
+    {
+        return;
+    }
+    uint32_t ms = (uint32_t)((mono_ns() - session->started_at) / 1000000);
+    if(replay_record(&session->replay, session->id, ms, event, input) != 0)
+    {
+        /* stop recording rather than leave a gap in the events */
+        (void)replay_close(&session->replay);
+    }
+}
+
+/*! \brief trace an engine call as a line clear if the game cleared lines in it.
+    \param session      game session.
+    \param start        trace_begin() before the engine call.
+    \param gs           game status returned by the engine call, NULL if unchanged.
+*/
+static void trace_line_clear(struct session_t *session, uint64_t start, const struct game_state *gs)
+{
+    if(gs == NULL)
+    {
+        return;
+    }
+    /* restarts reset the count */
+    if(gs->lines > session->lines)
+    {
+        trace_end(session->id, TRACE_LINE_CLEAR, start);
+    }
+    session->lines = gs->lines;
+}
+
+/*! \brief send the garbage earned by the last engine call to an opponent.
+    \param session      game session.
+*/
+static void send_garbage(struct session_t *session)
+{
+    unsigned int rows = take_garbage(session->id);
+
+    if(rows == 0 || session->versus.room == NULL)
+    {
+        return;
+    }
+    if(versus_attack(&session->versus, rows) != 0)
+    {
+        metrics_add(session->id, METRIC_GARBAGE_DROPPED, 1);
+        return;
+    }
+    metrics_add(session->id, METRIC_GARBAGE_SENT, rows);
+}
+
+/*! \brief apply the garbage opponents sent since the last substep, before it.
+    \param session      game session.
+    \param gs[out]      game status if garbage changed it, left untouched otherwise.
+*/
+static void receive_garbage(struct session_t *session, struct game_state **gs)
+{
+    struct garbage garbage[MAILBOX_SIZE];
+    size_t n = versus_receive(&session->versus, garbage, MAILBOX_SIZE);
+
+    for(size_t i = 0; i < n; i++)
+    {
+        metrics_add(session->id, METRIC_GARBAGE_RECEIVED, garbage[i].rows);
+        /* recorded in pieces which fit an event */
+        for(unsigned int rows = garbage[i].rows; rows != 0; )
+        {
+            unsigned int piece = rows > REPLAY_GARBAGE_ROWS_MAX ? REPLAY_GARBAGE_ROWS_MAX : rows;
+            record_event(session, REPLAY_GARBAGE, REPLAY_GARBAGE_INPUT(piece, garbage[i].hole));
+            struct game_state *next = add_garbage(session->id, piece, garbage[i].hole);
+            *gs = next != NULL ? next : *gs;
+            rows -= piece;
+        }
+    }
+}
+
+/*! \brief stream a recording to a viewer, after REQ_REPLAY.
+    \param sock     socket to connect to.
+    \return 0 on success, 2 on a connection issue.
+*/
+static int send_replay(int sock)
+{
+    char name[REPLAY_NAME_LEN];
+    char data[MSG_HEADER_SIZE + 8];
+    char path[256];
+    struct stat st = {0};
+    int fd = -1;
+
+    if(recv_all(sock, name, sizeof(name)) != 0)
+    {
+        return 2;
+    }
+    name[REPLAY_NAME_LEN - 1] = '\0';
+    /* only recordings of the directory can be asked for */
+    if(replay_dir != NULL && name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL)
+    {
+        (void)snprintf(path, sizeof(path), "%s/%s", replay_dir, name);
+        fd = open(path, O_RDONLY);
+    }
+    if(fd != -1 && fstat(fd, &st) != 0)
+    {
+        perror("fstat()");
+        st.st_size = 0;
+    }
+    put_msg_header(data, MSG_REPLAY, 8);
+    put_u64(data + MSG_HEADER_SIZE, (uint64_t)st.st_size);
+    if(send(sock, data, sizeof(data), MSG_NOSIGNAL) < 0)
+    {
+        if(fd != -1)
+        {
+            close(fd);
+        }
+        return 2;
+    }
+    (void)printf("Streaming recording %s (%lld bytes)\n", name, (long long)st.st_size);
+
+    /* the file goes from the page cache to the socket without a copy through user space */
+    off_t offset = 0;
+    while(offset < st.st_size)
+    {
+        if(sendfile(sock, fd, &offset, (size_t)(st.st_size - offset)) <= 0)
+        {
+            perror("sendfile()");
+            break;
+        }
+    }
+    if(fd != -1)
+    {
+        close(fd);
+    }
+
+    return offset == st.st_size ? 0 : 2;
+}
+
+/*! \brief add the latency of a finished session to the totals and export them.
+    \param session      finished game session.
+*/
+static void export_latency(struct session_t *session)
+{
+    if(session->input_to_apply.count != 0)
+    {
+        (void)printf("Client %u latency in us: input to apply p50 %.1f p99 %.1f, apply to send p50 %.1f p99 %.1f\n", session->id,
+                hist_percentile(&session->input_to_apply, 50) / 1e3, hist_percentile(&session->input_to_apply, 99) / 1e3,
+                hist_percentile(&session->apply_to_send, 50) / 1e3, hist_percentile(&session->apply_to_send, 99) / 1e3);
+    }
+
+    if(pthread_mutex_lock(&latency_lock) != 0)
+    {
+        perror("pthread_mutex_lock()");
+        return;
+    }
+    hist_merge(&latency[0], &session->input_to_apply);
+    hist_merge(&latency[1], &session->apply_to_send);
+
+    FILE *fp = latency_file != NULL ? fopen(latency_file, "w") : NULL;
+    if(fp != NULL)
+    {
+        (void)hist_write(fp, &latency[0], "input to apply (us)", 1e3);
+        (void)hist_write(fp, &latency[1], "apply to send (us)", 1e3);
+        fclose(fp);
+    }
+    else if(latency_file != NULL)
+    {
+        perror(latency_file);
+    }
+    (void)pthread_mutex_unlock(&latency_lock);
+}
+
+/*! \brief write the metrics of the server which are not kept per thread.
+    \param fp   destination.
+*/
+static void write_server_metrics(FILE *fp)
+{
+    struct session_view view;
+    uint64_t playing = 0;
+    uint64_t best = 0;
+    uint64_t level = 0;
+
+    /* the games being played, as their sessions last published them */
+    for(uint32_t i = 0; i < CLIENTS_MAX; i++)
+    {
+        if(session_inspect(i, &view) == 0 && view.phase > TET_WIN)
+        {
+            playing++;
+            best = view.points > best ? view.points : best;
+            level = view.level > level ? view.level : level;
+        }
+    }
+    metrics_write_one(fp, "games_playing", "Games in progress or paused.", 1, playing);
+    metrics_write_one(fp, "games_points_max", "Most points of a game in progress or paused.", 1, best);
+    metrics_write_one(fp, "games_level_max", "Highest level of a game in progress or paused.", 1, level);
+    metrics_write_one(fp, "result_queue_depth", "Results waiting for the high score writer.", 1, queue_depth());
+    metrics_write_one(fp, "results_dropped_total", "Results dropped while the result queue was full.", 0, queue_dropped());
+    metrics_write_one(fp, "results_spilled_total", "Results spilled while the result queue was full.", 0, queue_spilled());
+    metrics_write_one(fp, "leaderboard_entries", "Players in the leaderboard.", 1, lb_size());
+    pool_write_metrics(&session_pool, fp);
+    pool_write_metrics(&io_pool, fp);
+    pool_write_metrics(&stack_pool, fp);
+    lobby_write_metrics(fp);
+}
+
+/*! \brief map a block of every size class for each client id.
+    \return 0 on success, 1 on error.
+*/
+static int init_pools(void)
+{
+    if(pool_init(&session_pool, "session", sizeof(struct session_t), CLIENTS_MAX, POOL_HUGE | POOL_PREFAULT) != 0 ||
+            pool_init(&io_pool, "io", IO_BUFFER_SIZE, CLIENTS_MAX, POOL_HUGE | POOL_PREFAULT) != 0 ||
+            pool_init(&stack_pool, "stack", SESSION_STACK_SIZE, CLIENTS_MAX, POOL_GUARD) != 0)
+    {
+        return 1;
+    }
+
+    return 0;
 }
 
 /*! \brief Finish and cleanup everything.
     \param sig    signal which triggered this function.
+    \remark only async-signal-safe calls, results are already in the high score log.
 */
 static void finish(int sig)
 {
+    static const char msg[] = "Data saved. Exiting!!\n";
+
     (void)sig;
-    FILE *fp = fopen(HIGH_SCORE_FILE, "w+");
-    if(fp == NULL)
+    wal_sync();
+
+    (void)write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+
+    _exit(0);
+}
+
+/*! \brief draw the token a client resumes its session with.
+    \param seed     seed of the game, only used if the system has no random source.
+    \return token, never 0.
+*/
+static uint64_t new_token(uint64_t seed)
+{
+    uint64_t token = 0;
+
+    if(urandom_fd < 0 || read(urandom_fd, &token, sizeof(token)) != (ssize_t)sizeof(token))
     {
-        perror("fopen()");
-        exit(1);
+        token = (mono_ns() ^ seed) * UINT64_C(0x9E3779B97F4A7C15);
     }
 
-    if(pthread_mutex_lock(&lock) != 0)
+    return token != 0 ? token : 1;
+}
+
+/*! \brief park the session while its client is gone, its game does not advance meanwhile.
+    \param session  game session, its socket is replaced by the one of the resuming client.
+    \return 0 once resumed and sent the current state, 1 if the grace period ended.
+*/
+static int park_session(struct session_t *session)
+{
+    uint32_t id = session->id;
+    uint64_t parked_at = mono_ns();
+    uint64_t deadline = parked_at + (uint64_t)grace_ms * 1000000;
+    struct timespec ts = { .tv_sec = deadline / 1000000000, .tv_nsec = deadline % 1000000000 };
+    int sock = -1;
+
+    if(grace_ms == 0)
     {
-        perror("pthread_mutex_unlock()");
-        exit(1);
+        return 1;
     }
-    for(size_t i = 0; i < NB_HIGH_SCORES_SHOWN; i++)
+    (void)printf("Client %u (%s) is gone, its session is parked\n", id, session->result.name);
+    metrics_add(id, METRIC_SESSIONS_PARKED, 1);
+    do
     {
-        (void)fprintf(fp, "%u\n", high_score[i]);
+        pthread_mutex_lock(&parked_lock);
+        parked[id].sock = -1;
+        parked[id].token = session->token;
+        while(parked[id].sock < 0 && mono_ns() < deadline)
+        {
+            (void)pthread_cond_timedwait(&parked_cond, &parked_lock, &ts);
+        }
+        /* no other connection can hand itself over once the token is cleared */
+        sock = parked[id].sock;
+        parked[id].token = 0;
+        pthread_mutex_unlock(&parked_lock);
+        if(sock < 0)
+        {
+            (void)printf("Client %u (%s) did not come back, closing!\n", id, session->result.name);
+            metrics_add(id, METRIC_SESSIONS_EXPIRED, 1);
+            return 1;
+        }
+        close(session->sock);
+        session->sock = sock;
     }
-    if(pthread_mutex_unlock(&lock) != 0)
+    while(send_handshake(session, session->seed, peek_game(id)) != 0);
+
+    /* recordings do not include the time parked */
+    session->started_at += mono_ns() - parked_at;
+    (void)printf("Client %u (%s) resumed its session\n", id, session->result.name);
+    metrics_add(id, METRIC_SESSIONS_RESUMED, 1);
+
+    return 0;
+}
+
+/*! \brief hand a connection over to the parked session it asks for.
+    \param sock     connection, owned by the parked session on success.
+    \param args     arguments of REQ_RESUME: u32 session id, u64 reconnect token.
+    \return true if the connection was handed over.
+*/
+static bool hand_over(int sock, const char args[12])
+{
+    uint32_t id = get_u32(args);
+    uint64_t token = get_u64(args + 4);
+    bool handed = false;
+
+    pthread_mutex_lock(&parked_lock);
+    if(id < CLIENTS_MAX && token != 0 && parked[id].token == token && parked[id].sock < 0)
     {
-        perror("pthread_mutex_unlock()");
-        exit(1);
+        parked[id].sock = sock;
+        handed = true;
+        (void)pthread_cond_broadcast(&parked_cond);
     }
+    pthread_mutex_unlock(&parked_lock);
 
-    fclose(fp);
+    return handed;
+}
 
-    (void)cleanup_queue();
+/*! \brief hand the connection over to the parked session it asks for, after REQ_RESUME.
+    \param session  session of the connection, its socket is given away on success.
+    \return 2, the session of the connection ends either way.
+*/
+static int resume_session(struct session_t *session)
+{
+    char args[12];
 
-    (void)printf("Data saved. Exiting!!\n");
+    if(recv_all(session->sock, args, sizeof(args)) != 0)
+    {
+        return 2;
+    }
+    if(hand_over(session->sock, args))
+    {
+        session->sock = -1;
+    }
+    else
+    {
+        (void)printf("Client %u could not resume session %u, closing!\n", session->id, get_u32(args));
+    }
+
+    return 2;
+}
+
+/*! \brief read the request of a connection which came while every client id was
+    taken, only a REQ_RESUME is answered: by the parked session it asks for.
+    \param ptr    socket.
+*/
+static void *resume_task(void *ptr)
+{
+    int sock = (int)(intptr_t)ptr;
+    struct timeval tv = { .tv_sec = RESUME_TIMEOUT_MS / 1000, .tv_usec = (RESUME_TIMEOUT_MS % 1000) * 1000 };
+    struct timeval none = { .tv_sec = 0, .tv_usec = 0 };
+    unsigned char req = 0;
+    char args[12];
 
-    (void)pthread_mutex_destroy(&lock);
+    /* the request comes right after the connection, a client which does not send it holds nothing for long */
+    if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0 ||
+            recv_all(sock, &req, 1) != 0 || req != REQ_RESUME || recv_all(sock, args, sizeof(args)) != 0 ||
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none)) != 0 ||
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) != 0 || !hand_over(sock, args))
+    {
+        close(sock);
+        (void)printf("no more sessions available...\n");
+    }
+    __atomic_sub_fetch(&resumers, 1, __ATOMIC_RELAXED);
 
-    exit(0);
+    return NULL;
 }
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "game.h"
+#include "common.h"
+#include "history.h"
+
+#define DEFAULT_HISTORY_DIR ("./history")
+
+static void print_usage(const char *prog_name);
+static int print_avg(const struct history_view *v, uint64_t player);
+static int print_percentiles(const struct history_view *v, uint64_t player, int argc, char *argv[]);
+static int print_trend(const struct history_view *v, uint64_t player, const char *name);
+
+int main(int argc, char *argv[])
+{
+    int c = 0;
+    int rc = 1;
+    const char *dir = DEFAULT_HISTORY_DIR;
+    const char *name = NULL;
+    char clean[PLAYER_NAME_LEN] = "";
+    uint64_t player = 0;
+    struct history_view v;
+
+    while ( (c = getopt(argc, argv, "hd:n:")) != -1 ) {
+        switch ( c ) {
+            case 'd':
+                /* user passed the history directory */
+                dir = optarg;
+                break;
+
+            case 'n':
+                /* user passed the player to query, all players otherwise */
+                strncpy(clean, optarg, PLAYER_NAME_LEN - 1);
+                /* the history holds the ids of the names as the server stored them */
+                clean_player_name(clean);
+                name = clean;
+                player = player_id(name);
+                break;
+
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+
+            case '?':
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if(optind >= argc)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if(history_map(dir, &v) != 0)
+    {
+        return 1;
+    }
+    (void)printf("%zu games in %s\n", v.rows, dir);
+
+    if(strcmp(argv[optind], "avg") == 0)
+    {
+        rc = print_avg(&v, player);
+    }
+    else if(strcmp(argv[optind], "pct") == 0)
+    {
+        rc = print_percentiles(&v, player, argc - optind - 1, argv + optind + 1);
+    }
+    else if(strcmp(argv[optind], "trend") == 0 && name != NULL)
+    {
+        rc = print_trend(&v, player, name);
+    }
+    else
+    {
+        print_usage(argv[0]);
+    }
+
+    history_unmap(&v);
+    return rc;
+}
+
+/*! \brief print usage to sterr
+    \param prog_name    program name string
+*/
+static void print_usage(const char *prog_name)
+{
+    (void)fprintf(stderr, "Usage: %s [-d <dir>] [-n <name>] avg | pct [<p>...] | trend\n"
+                    "Options:\n"
+                    "  -d <dir>\t\tHistory directory (default %s).\n"
+                    "  -n <name>\t\tOnly the games of this player, required by trend.\n"
+                    "  -h\t\t\tPrint help and exit.\n"
+                    "Queries:\n"
+                    "  avg\t\t\tAverage points per level reached.\n"
+                    "  pct [<p>...]\t\tPoints percentiles (default 50 90 99).\n"
+                    "  trend\t\t\tPoints trend of the player over its games.\n",
+                    prog_name, DEFAULT_HISTORY_DIR);
+}
+
+/*! \brief print the average points per level reached.
+    \param v        mapped history.
+    \param player   player id, 0 for all players.
+    \return 0 on success.
+*/
+static int print_avg(const struct history_view *v, uint64_t player)
+{
+    double avg[MAX_LEVEL + 1];
+    uint64_t games[MAX_LEVEL + 1];
+
+    history_avg_by_level(v, player, avg, games);
+    (void)printf("level\tgames\tavg points\n");
+    for(size_t level = 0; level <= MAX_LEVEL; level++)
+    {
+        (void)printf("%zu\t%llu\t%.1f\n", level, (unsigned long long)games[level], avg[level]);
+    }
+
+    return 0;
+}
+
+/*! \brief print points percentiles.
+    \param v        mapped history.
+    \param player   player id, 0 for all players.
+    \param argc     number of percentiles requested.
+    \param argv     percentiles requested.
+    \return 0 on success, 1 if there is no game.
+*/
+static int print_percentiles(const struct history_view *v, uint64_t player, int argc, char *argv[])
+{
+    static const char *defaults[] = { "50", "90", "99" };
+    uint32_t value = 0;
+
+    if(argc == 0)
+    {
+        argc = sizeof(defaults) / sizeof(defaults[0]);
+        argv = (char **)defaults;
+    }
+    for(int i = 0; i < argc; i++)
+    {
+        double p = atof(argv[i]);
+        if(history_percentile(v, player, p, &value) != 0)
+        {
+            (void)fprintf(stderr, "no game found\n");
+            return 1;
+        }
+        (void)printf("p%g\t%u\n", p, value);
+    }
+
+    return 0;
+}
+
+/*! \brief print the points trend of a player.
+    \param v        mapped history.
+    \param player   player id.
+    \param name     player name.
+    \return 0 on success, 1 if the player has no game.
+*/
+static int print_trend(const struct history_view *v, uint64_t player, const char *name)
+{
+    struct history_trend t;
+
+    if(history_trend(v, player, &t) != 0)
+    {
+        (void)fprintf(stderr, "no game found for %s\n", name);
+        return 1;
+    }
+    (void)printf("%s: %zu games, %.1f points on average, best %u, %+.2f points per game\n",
+            name, t.games, t.mean, t.best, t.slope);
+    (void)printf("first game %llu, last game %llu (ms since the epoch)\n",
+            (unsigned long long)t.first, (unsigned long long)t.last);
+
+    return 0;
+}
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include "common.h"
+#include "trace.h"
+
+#define TRACE_SIGNAL (SIGUSR1)
+
+struct trace_span {
+    uint64_t start;     /* ns */
+    uint32_t duration;  /* ns */
+    uint32_t name;      /* enum trace_name */
+};
+
+/* ring of one thread, head counts the spans ever recorded */
+struct trace_ring {
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t mark;      /* head when tracing started, only used by the control thread */
+    char thread[TRACE_THREAD_NAME_LEN];
+    struct trace_span spans[TRACE_RING_SPANS];
+};
+
+static const char *const names[TRACE_NAMES] = {
+    [TRACE_TICK] = "tick",
+    [TRACE_INPUT] = "handle_input",
+    [TRACE_LINE_CLEAR] = "line_clear",
+    [TRACE_SERIALIZE] = "serialize",
+    [TRACE_SEND] = "send",
+    [TRACE_LEADERBOARD] = "leaderboard",
+};
+
+static struct trace_ring *rings = NULL;
+static size_t nb_rings = 0;
+static const char *dump_path = NULL;
+static int enabled = 0;
+
+static void *trace_task(void *ptr);
+static void put_json_string(FILE *fp, const char *str);
+
+int trace_init(size_t threads, const char *path)
+{
+    sigset_t set;
+
+    /* pages of rings which are never traced into are never touched */
+    rings = calloc(threads, sizeof(*rings));
+    if(rings == NULL)
+    {
+        perror("calloc()");
+        return 1;
+    }
+    nb_rings = threads;
+    dump_path = path;
+    for(size_t i = 0; i < threads; i++)
+    {
+        (void)snprintf(rings[i].thread, TRACE_THREAD_NAME_LEN, "thread %u", (unsigned int)i);
+    }
+
+    /* the signal is only taken by the control thread, all threads started later inherit the mask */
+    sigemptyset(&set);
+    sigaddset(&set, TRACE_SIGNAL);
+    if(pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+    {
+        perror("pthread_sigmask()");
+        return 1;
+    }
+
+    return 0;
+}
+
+void trace_name_thread(size_t slot, const char *name)
+{
+    if(rings == NULL)
+    {
+        return;
+    }
+    (void)snprintf(rings[slot].thread, TRACE_THREAD_NAME_LEN, "%s", name);
+}
+
+int trace_control(void)
+{
+    pthread_t thread;
+
+    if(pthread_create(&thread, NULL, trace_task, NULL) != 0)
+    {
+        perror("pthread_create()");
+        return 1;
+    }
+    (void)pthread_detach(thread);
+
+    return 0;
+}
+
+void trace_enable(int on)
+{
+    __atomic_store_n(&enabled, on, __ATOMIC_RELAXED);
+}
+
+uint64_t trace_begin(void)
+{
+    return __atomic_load_n(&enabled, __ATOMIC_RELAXED) ? mono_ns() : 0;
+}
+
+void trace_end(size_t slot, enum trace_name name, uint64_t start)
+{
+    if(start == 0)
+    {
+        return;
+    }
+    struct trace_ring *ring = &rings[slot];
+    uint64_t head = ring->head;
+    uint64_t end = mono_ns();
+    struct trace_span *span = &ring->spans[head % TRACE_RING_SPANS];
+
+    span->start = start;
+    span->duration = end - start > UINT32_MAX ? UINT32_MAX : (uint32_t)(end - start);
+    span->name = (uint32_t)name;
+    /* publishes the span to a dump running at the same time */
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int trace_dump(const char *path)
+{
+    struct trace_span *copy = malloc(sizeof(rings[0].spans));
+    FILE *fp = fopen(path, "w");
+    size_t count = 0;
+
+    if(copy == NULL || fp == NULL)
+    {
+        perror(fp == NULL ? path : "malloc()");
+        free(copy);
+        if(fp != NULL)
+        {
+            fclose(fp);
+        }
+        return 1;
+    }
+    (void)fprintf(fp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for(size_t r = 0; r < nb_rings; r++)
+    {
+        struct trace_ring *ring = &rings[r];
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > TRACE_RING_SPANS ? head - TRACE_RING_SPANS : 0;
+
+        first = first > ring->mark ? first : ring->mark;
+        if(head == first)
+        {
+            continue;
+        }
+        for(uint64_t i = first; i < head; i++)
+        {
+            copy[i - first] = ring->spans[i % TRACE_RING_SPANS];
+        }
+        /* spans the owner overwrote while they were copied are torn, skip them */
+        uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t valid = now > TRACE_RING_SPANS ? now - TRACE_RING_SPANS : 0;
+
+        (void)fprintf(fp, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %zu, \"args\": {\"name\": ",
+                count++ != 0 ? ",\n" : "", r);
+        /* threads are named after their player, whose name may hold quotes */
+        put_json_string(fp, ring->thread);
+        (void)fprintf(fp, "}}");
+        for(uint64_t i = first > valid ? first : valid; i < head; i++)
+        {
+            const struct trace_span *s = &copy[i - first];
+            (void)fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %zu, \"ts\": %.3f, \"dur\": %.3f}",
+                    s->name < TRACE_NAMES ? names[s->name] : "?", r, s->start / 1e3, s->duration / 1e3);
+        }
+    }
+    (void)fprintf(fp, "\n]}\n");
+    free(copy);
+    if(fclose(fp) != 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*! \brief write a string as a JSON string, escaping what has to be.
+    \param fp     destination.
+    \param str    zero terminated string.
+*/
+static void put_json_string(FILE *fp, const char *str)
+{
+    (void)fputc('"', fp);
+    for(; *str != '\0'; str++)
+    {
+        unsigned char c = (unsigned char)*str;
+        if(c == '"' || c == '\\')
+        {
+            (void)fprintf(fp, "\\%c", c);
+        }
+        else if(c < ' ')
+        {
+            (void)fprintf(fp, "\\u%04x", c);
+        }
+        else
+        {
+            (void)fputc(c, fp);
+        }
+    }
+    (void)fputc('"', fp);
+}
+
+/*! \brief toggle tracing on each signal, dump the spans when it stops.
+    \param ptr    unused.
+*/
+static void *trace_task(void *ptr)
+{
+    sigset_t set;
+    int sig = 0;
+
+    (void)ptr;
+    sigemptyset(&set);
+    sigaddset(&set, TRACE_SIGNAL);
+    while(sigwait(&set, &sig) == 0)
+    {
+        if(!__atomic_load_n(&enabled, __ATOMIC_RELAXED))
+        {
+            /* spans of an earlier trace are not dumped again */
+            for(size_t r = 0; r < nb_rings; r++)
+            {
+                rings[r].mark = __atomic_load_n(&rings[r].head, __ATOMIC_ACQUIRE);
+            }
+            trace_enable(1);
+            (void)printf("Tracing started\n");
+        }
+        else
+        {
+            trace_enable(0);
+            if(trace_dump(dump_path) == 0)
+            {
+                (void)printf("Trace written to %s\n", dump_path);
+            }
+        }
+        (void)fflush(stdout);
+    }
+
+    return NULL;
+}
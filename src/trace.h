@@ -0,0 +1,67 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Spans of the hot paths are recorded into a ring buffer per thread,
+   written by its owner only: recording a span is two clock reads and a
+   16 byte store, and nothing at all while tracing is off. The rings
+   keep the most recent TRACE_RING_SPANS spans of each thread and are
+   dumped as Chrome trace JSON (chrome://tracing, Perfetto). */
+#define TRACE_RING_SPANS (4096u)
+#define TRACE_THREAD_NAME_LEN (24)
+
+enum trace_name {
+    TRACE_TICK,             /* session loop iteration which ran a substep */
+    TRACE_INPUT,            /* handle_input() */
+    TRACE_LINE_CLEAR,       /* engine call which cleared lines */
+    TRACE_SERIALIZE,        /* frame encoding */
+    TRACE_SEND,             /* send() to a client */
+    TRACE_LEADERBOARD,      /* leaderboard insert and high score log append */
+    TRACE_NAMES
+};
+
+/*! \brief allocate the rings and block the toggle signal, before any other thread is started.
+    \param threads  number of rings, one per thread recording spans.
+    \param path     file the spans are dumped to.
+    \return 0 on success, 1 on error.
+*/
+int trace_init(size_t threads, const char *path);
+
+/*! \brief name the thread owning a ring in the dumps.
+    \param slot     ring.
+    \param name     thread name, truncated to TRACE_THREAD_NAME_LEN - 1 characters.
+*/
+void trace_name_thread(size_t slot, const char *name);
+
+/*! \brief start the thread toggling tracing on SIGUSR1: the first signal
+    clears the rings and starts tracing, the next one stops it and dumps the spans.
+    \return 0 on success, 1 on error.
+*/
+int trace_control(void);
+
+/*! \brief start or stop tracing.
+    \param on   trace or not.
+*/
+void trace_enable(int on);
+
+/*! \brief timestamp the start of a span.
+    \return monotonic time in ns, 0 while tracing is off.
+*/
+uint64_t trace_begin(void);
+
+/*! \brief record a span into the ring of the calling thread.
+    \param slot     ring owned by the calling thread.
+    \param name     what the span measured.
+    \param start    trace_begin() at its start, nothing is recorded for 0.
+*/
+void trace_end(size_t slot, enum trace_name name, uint64_t start);
+
+/*! \brief write the spans of all rings as Chrome trace JSON.
+    \param path     destination file.
+    \return 0 on success, 1 on error.
+*/
+int trace_dump(const char *path);
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "game.h"
+#include "common.h"
+#include "versus.h"
+
+static struct mailbox mailboxes[CLIENTS_MAX];
+static struct room rooms[CLIENTS_MAX];
+static uint32_t last_room_id = 0;
+static pthread_mutex_t rooms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void versus_init(void)
+{
+    for(size_t i = 0; i < CLIENTS_MAX; i++)
+    {
+        mailbox_init(&mailboxes[i]);
+    }
+}
+
+int versus_start(struct versus *const members[], uint32_t players)
+{
+    struct garbage stale[MAILBOX_SIZE];
+    struct room *room = NULL;
+
+    if(players == 0 || players > ROOM_PLAYERS_MAX)
+    {
+        return 1;
+    }
+    pthread_mutex_lock(&rooms_lock);
+    for(size_t i = 0; room == NULL && i < CLIENTS_MAX; i++)
+    {
+        if(rooms[i].id == 0)
+        {
+            room = &rooms[i];
+            memset(room, 0, sizeof(*room));
+            last_room_id = last_room_id + 1 != 0 ? last_room_id + 1 : 1;
+            room->id = last_room_id;
+        }
+    }
+    /* there is a room for every client id */
+    room->players = players;
+    room->refs = players;
+    room->alive = players;
+    pthread_mutex_unlock(&rooms_lock);
+
+    for(uint32_t i = 0; i < players; i++)
+    {
+        struct versus *v = members[i];
+        /* messages sent to the previous session of the client id, its thread is waiting */
+        while(mailbox_take(&mailboxes[v->client_id], stale, MAILBOX_SIZE) != 0)
+        {
+        }
+        v->room = room;
+        v->index = i;
+        v->attacks = 0;
+        room->members[i] = v->client_id;
+    }
+
+    return 0;
+}
+
+/* hole of the garbage rows, a function of the attack only */
+static uint8_t garbage_hole(uint32_t room, uint32_t from, uint32_t seq)
+{
+    uint64_t z = ((uint64_t)room << 40 ^ (uint64_t)from << 24 ^ seq) * UINT64_C(0x9E3779B97F4A7C15);
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    return (uint8_t)((z ^ (z >> 31)) % FIELD_WIDTH);
+}
+
+int versus_attack(struct versus *v, unsigned int rows)
+{
+    struct room *room = v->room;
+
+    if(room == NULL)
+    {
+        return 0;
+    }
+    /* the first opponent still in, in rotation from the one after the last target */
+    for(uint32_t k = 0; k < room->players; k++)
+    {
+        uint32_t target = (v->index + 1 + v->attacks + k) % room->players;
+        if(target == v->index || __atomic_load_n(&room->out[target], __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+        struct garbage g = {
+            .room = room->id,
+            .from = v->index,
+            .seq = v->attacks,
+            .rows = (uint8_t)(rows > FIELD_HEIGHT ? FIELD_HEIGHT : rows),
+            .hole = garbage_hole(room->id, v->index, v->attacks),
+        };
+        v->attacks++;
+        return mailbox_post(&mailboxes[room->members[target]], &g);
+    }
+
+    return 0;
+}
+
+static int garbage_order(const void *a, const void *b)
+{
+    const struct garbage *x = a, *y = b;
+
+    if(x->from != y->from)
+    {
+        return x->from < y->from ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+size_t versus_receive(struct versus *v, struct garbage *out, size_t max)
+{
+    size_t n = 0;
+
+    if(v->room == NULL)
+    {
+        return 0;
+    }
+    size_t taken = mailbox_take(&mailboxes[v->client_id], out, max);
+    for(size_t i = 0; i < taken; i++)
+    {
+        if(out[i].room == v->room->id)
+        {
+            out[n++] = out[i];
+        }
+    }
+    qsort(out, n, sizeof(*out), garbage_order);
+
+    return n;
+}
+
+bool versus_won(const struct versus *v)
+{
+    const struct room *room = v->room;
+
+    return room != NULL && room->players > 1 &&
+            __atomic_load_n(&room->alive, __ATOMIC_RELAXED) == 1 &&
+            !__atomic_load_n(&room->out[v->index], __ATOMIC_RELAXED);
+}
+
+void versus_leave(struct versus *v)
+{
+    struct room *room = v->room;
+
+    if(room == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&rooms_lock);
+    if(!room->out[v->index])
+    {
+        __atomic_store_n(&room->out[v->index], 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&room->alive, 1, __ATOMIC_RELAXED);
+    }
+    if(--room->refs == 0)
+    {
+        room->id = 0;
+    }
+    pthread_mutex_unlock(&rooms_lock);
+    v->room = NULL;
+}
@@ -0,0 +1,72 @@
+#ifndef _VERSUS_H_
+#define _VERSUS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "mailbox.h"
+
+/* Versus rooms: the line clears of a player send garbage rows to one
+   opponent at a time, in rotation among the players still in. Garbage
+   goes straight into the mailbox of the opponent's session, whatever
+   thread runs it, and is applied at its next substep. Rooms are formed
+   by the lobby, the exchange during the game never takes a lock. */
+#define ROOM_PLAYERS_MAX    (100u)
+
+struct room {
+    uint32_t id;                        /* 0 while the room is free */
+    uint32_t players;
+    uint32_t refs;                      /* players which did not leave yet */
+    uint32_t members[ROOM_PLAYERS_MAX]; /* client ids, by index in the room */
+    /* written when a player is out, read by every attack */
+    uint32_t alive __attribute__((aligned(64)));
+    uint8_t out[ROOM_PLAYERS_MAX];
+};
+
+/* versus state of a session */
+struct versus {
+    struct room *room;  /* NULL for a solo game */
+    uint32_t client_id;
+    uint32_t index;     /* in the room */
+    uint32_t attacks;   /* garbage messages sent */
+};
+
+/*! \brief empty the rooms and the mailboxes of all client ids.
+*/
+void versus_init(void);
+
+/*! \brief open a room for sessions which wait for it, their client ids set.
+    \param members      versus states of the sessions, by index in the room.
+    \param players      number of sessions, 1 to ROOM_PLAYERS_MAX.
+    \return 0 on success, 1 if the number of players is not possible.
+*/
+int versus_start(struct versus *const members[], uint32_t players);
+
+/*! \brief send garbage to the next opponent still in.
+    \param v        versus state of the session.
+    \param rows     garbage rows.
+    \return 0 if the rows were posted or no opponent is left, 1 if the mailbox was full.
+*/
+int versus_attack(struct versus *v, unsigned int rows);
+
+/*! \brief take the garbage sent to the session, in an order which does not
+    depend on the timing of the senders: by sender, then by attack.
+    \param v        versus state of the session.
+    \param out[out] garbage to apply.
+    \param max      size of out.
+    \return number of messages taken.
+*/
+size_t versus_receive(struct versus *v, struct garbage *out, size_t max);
+
+/*! \brief tell whether the session is the last one in of a room which started with several players.
+    \param v    versus state of the session.
+    \return true if the session won.
+*/
+bool versus_won(const struct versus *v);
+
+/*! \brief leave the room, the player is out.
+    \param v    versus state of the session, its room is NULL afterwards.
+*/
+void versus_leave(struct versus *v);
+
+#endif
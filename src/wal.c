@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wal.h"
+
+#define WAL_MAGIC ("TETWAL01")
+#define WAL_TMP_SUFFIX (".tmp")
+/* compact once the log holds this many records more than the leaderboard */
+#define WAL_COMPACT_MIN (4096)
+#define WAL_COPY_CHUNK (64 * WAL_RECORD_SIZE)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dirty_cond = PTHREAD_COND_INITIALIZER;
+static int wal_fd = -1;
+static off_t wal_size = 0;      /* append offset */
+static size_t nb_records = 0;   /* records in the log */
+static bool dirty = false;
+static uint32_t interval_ms = 0;
+static char wal_path[256];
+static uint32_t crc_table[256];
+
+static void crc32_init(void)
+{
+    for(uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for(size_t k = 0; k < 8; k++)
+        {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const char *buf, size_t len)
+{
+    uint32_t c = 0xFFFFFFFFu;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        c = crc_table[(c ^ (unsigned char)buf[i]) & 0xFF] ^ (c >> 8);
+    }
+
+    return c ^ 0xFFFFFFFFu;
+}
+
+static void encode_record(char buf[WAL_RECORD_SIZE], const struct lb_entry *e)
+{
+    put_u64(buf + 4, e->player);
+    lb_entry_encode(buf + 12, e);
+    put_u32(buf, crc32(buf + 4, WAL_RECORD_SIZE - 4));
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if(n < 0)
+        {
+            perror("write()");
+            return 1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+
+    return 0;
+}
+
+/* make the entries of the directory holding path durable, e.g. after a rename */
+static int sync_dir(const char *path)
+{
+    char dir[sizeof(wal_path)];
+    const char *slash = strrchr(path, '/');
+
+    if(slash == NULL)
+    {
+        (void)snprintf(dir, sizeof(dir), ".");
+    }
+    else
+    {
+        (void)snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if(fd < 0)
+    {
+        perror("open()");
+        return 1;
+    }
+    if(fsync(fd) != 0)
+    {
+        perror("fsync()");
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    return 0;
+}
+
+/* open a new log file holding only the header */
+static int create_log(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if(fd < 0)
+    {
+        perror("open()");
+        return -1;
+    }
+    if(write_all(fd, WAL_MAGIC, WAL_HEADER_SIZE) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* map the log, replay every record up to the first torn or corrupted one and cut the rest */
+static int recover(int fd, int (*replay)(const struct lb_entry *e))
+{
+    struct stat st;
+
+    if(fstat(fd, &st) != 0)
+    {
+        perror("fstat()");
+        return 1;
+    }
+    if(st.st_size < WAL_HEADER_SIZE)
+    {
+        /* cut short by a crash while it was created, it holds no record yet */
+        (void)fprintf(stderr, "%s: rewriting a header of %lld bytes\n", wal_path, (long long)st.st_size);
+        if(ftruncate(fd, 0) != 0 || pwrite(fd, WAL_MAGIC, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE || fdatasync(fd) != 0)
+        {
+            perror("recover()");
+            return 1;
+        }
+        wal_size = WAL_HEADER_SIZE;
+        return 0;
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED)
+    {
+        perror("mmap()");
+        return 1;
+    }
+    (void)posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+    if(memcmp(map, WAL_MAGIC, WAL_HEADER_SIZE) != 0)
+    {
+        (void)fprintf(stderr, "%s is not a high score log\n", wal_path);
+        munmap(map, st.st_size);
+        return 1;
+    }
+
+    off_t off = WAL_HEADER_SIZE;
+    while(off + WAL_RECORD_SIZE <= st.st_size)
+    {
+        const char *rec = map + off;
+        struct lb_entry e;
+
+        if(get_u32(rec) != crc32(rec + 4, WAL_RECORD_SIZE - 4))
+        {
+            break;
+        }
+        lb_entry_decode(&e, rec + 12);
+        e.player = get_u64(rec + 4);
+        if(replay(&e) != 0)
+        {
+            break;
+        }
+        off += WAL_RECORD_SIZE;
+        nb_records++;
+    }
+    munmap(map, st.st_size);
+
+    if(off != st.st_size)
+    {
+        (void)fprintf(stderr, "%s: dropping %lld bytes of torn records\n", wal_path, (long long)(st.st_size - off));
+        if(ftruncate(fd, off) != 0)
+        {
+            perror("ftruncate()");
+            return 1;
+        }
+    }
+    wal_size = off;
+
+    return 0;
+}
+
+/* rewrite the log with one record per ranked player, appends continue meanwhile */
+static void compact(void)
+{
+    char tmp_path[sizeof(wal_path) + sizeof(WAL_TMP_SUFFIX)];
+    char buf[WAL_COPY_CHUNK];
+    struct lb_entry entries[64];
+    uint32_t rank = 1;
+    size_t n = 0;
+    size_t count = 0;
+
+    (void)snprintf(tmp_path, sizeof(tmp_path), "%s%s", wal_path, WAL_TMP_SUFFIX);
+    int fd = create_log(tmp_path);
+    if(fd < 0)
+    {
+        return;
+    }
+
+    /* every record before this offset is already part of the leaderboard */
+    pthread_mutex_lock(&lock);
+    off_t start = wal_size;
+    pthread_mutex_unlock(&lock);
+
+    while((n = lb_range(rank, sizeof(entries) / sizeof(entries[0]), entries)) > 0)
+    {
+        for(size_t i = 0; i < n; i++)
+        {
+            encode_record(buf + (i * WAL_RECORD_SIZE), &entries[i]);
+        }
+        if(write_all(fd, buf, n * WAL_RECORD_SIZE) != 0)
+        {
+            close(fd);
+            unlink(tmp_path);
+            return;
+        }
+        rank += n;
+        count += n;
+    }
+
+    /* carry over the records appended while scanning and swap the files */
+    pthread_mutex_lock(&lock);
+    bool ok = true;
+    for(off_t off = start; ok && off < wal_size; off += WAL_COPY_CHUNK)
+    {
+        size_t len = (size_t)(wal_size - off) < sizeof(buf) ? (size_t)(wal_size - off) : sizeof(buf);
+        ok = pread(wal_fd, buf, len, off) == (ssize_t)len && write_all(fd, buf, len) == 0;
+        count += len / WAL_RECORD_SIZE;
+    }
+    if(ok && fsync(fd) == 0 && rename(tmp_path, wal_path) == 0)
+    {
+        close(wal_fd);
+        wal_fd = fd;
+        wal_size = lseek(fd, 0, SEEK_END);
+        nb_records = count;
+        pthread_mutex_unlock(&lock);
+        /* the rename itself is only durable once the directory is */
+        (void)sync_dir(wal_path);
+        return;
+    }
+    pthread_mutex_unlock(&lock);
+
+    perror("compaction");
+    close(fd);
+    unlink(tmp_path);
+}
+
+/* background flusher: groups every append of an interval into one fsync */
+static void *flusher_task(void *ptr)
+{
+    (void)ptr;
+
+    while(1)
+    {
+        pthread_mutex_lock(&lock);
+        while(!dirty)
+        {
+            pthread_cond_wait(&dirty_cond, &lock);
+        }
+        pthread_mutex_unlock(&lock);
+
+        (void)nanosleep(&(struct timespec){interval_ms / 1000, (interval_ms % 1000) * 1000 * 1000}, NULL);
+
+        pthread_mutex_lock(&lock);
+        dirty = false;
+        int fd = wal_fd;
+        bool need_compaction = nb_records > (2 * lb_size()) + WAL_COMPACT_MIN;
+        pthread_mutex_unlock(&lock);
+
+        if(fdatasync(fd) != 0)
+        {
+            perror("fdatasync()");
+        }
+        if(need_compaction)
+        {
+            compact();
+        }
+    }
+
+    return NULL;
+}
+
+int wal_open(const char *path, uint32_t sync_ms, int (*replay)(const struct lb_entry *e))
+{
+    pthread_t thread;
+
+    crc32_init();
+    interval_ms = sync_ms;
+    (void)snprintf(wal_path, sizeof(wal_path), "%s", path);
+
+    wal_fd = open(path, O_RDWR);
+    if(wal_fd >= 0)
+    {
+        if(recover(wal_fd, replay) != 0)
+        {
+            close(wal_fd);
+            return 1;
+        }
+    }
+    else
+    {
+        wal_fd = create_log(path);
+        if(wal_fd < 0 || sync_dir(path) != 0)
+        {
+            return 1;
+        }
+        wal_size = WAL_HEADER_SIZE;
+    }
+    if(lseek(wal_fd, wal_size, SEEK_SET) < 0)
+    {
+        perror("lseek()");
+        return 1;
+    }
+
+    if(pthread_create(&thread, NULL, flusher_task, NULL) != 0)
+    {
+        perror("pthread_create()");
+        return 1;
+    }
+    (void)pthread_detach(thread);
+
+    return 0;
+}
+
+int wal_append(const struct lb_entry *e)
+{
+    char rec[WAL_RECORD_SIZE];
+    int rc = 0;
+
+    encode_record(rec, e);
+
+    pthread_mutex_lock(&lock);
+    if(pwrite(wal_fd, rec, sizeof(rec), wal_size) != (ssize_t)sizeof(rec))
+    {
+        perror("pwrite()");
+        rc = 1;
+    }
+    else
+    {
+        wal_size += sizeof(rec);
+        nb_records++;
+        if(!dirty)
+        {
+            dirty = true;
+            pthread_cond_signal(&dirty_cond);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return rc;
+}
+
+void wal_sync(void)
+{
+    if(wal_fd >= 0)
+    {
+        (void)fsync(wal_fd);
+    }
+}
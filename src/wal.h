@@ -0,0 +1,30 @@
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "leaderboard.h"
+
+/* Size of a record in the log: u32 crc32, u64 player id, encoded entry */
+#define WAL_RECORD_SIZE (4 + 8 + LB_ENTRY_WIRE_SIZE)
+#define WAL_HEADER_SIZE (8)
+
+/*! \brief open the write-ahead log, replay its records and start the background flusher.
+    \param path         log file, created if missing.
+    \param sync_ms      group commit interval: appended records reach the disk at most this late.
+    \param replay       called for each valid record found in the log.
+    \return 0 on success, 1 on error.
+*/
+int wal_open(const char *path, uint32_t sync_ms, int (*replay)(const struct lb_entry *e));
+
+/*! \brief append a result to the log, it will be synced by the next group commit.
+    \param e    result to append.
+    \return 0 on success, 1 on error.
+*/
+int wal_append(const struct lb_entry *e);
+
+/*! \brief sync the log to disk right away, async-signal-safe.
+*/
+void wal_sync(void);
+
+#endif